@@ -6,8 +6,9 @@
 
 #include "stm32l4xx_hal.h"
 
-#define BATT_THRESHOLD 3.65
-#define SLEEP_DURATION_DEFAULT 60 * 60 * 18  // 18 hours
+#define SLEEP_DURATION_DEFAULT \
+    (60 * 60 * 24 * 27)  // 27 days, longest single RTC alarm (day-of-month
+                         // match must not wrap a 28 day month)
 
 enum spi_device_t {
     AEON_SPI_NONE = 0,  // no device selected, all CS pins high
@@ -31,6 +32,8 @@ enum sleep_reason_t {
     SLEEP_REASON_NO_IMAGE = 4,             // no image available
     SLEEP_REASON_NO_SD = 5,                // SD card not available
     SLEEP_REASON_REFRESH_DISABLED = 6,     // refresh disabled
+    SLEEP_REASON_HARVEST_WAIT = 7,  // refresh deferred to a time of day with
+                                    // more harvest
 };
 
 extern const char* sleep_reason_t_str[];
@@ -42,7 +45,7 @@ void set_aux_pwr(bool enable);
 
 uint16_t get_toggle_sw_bits();
 
-bool batt_threshold_check(double* batt_voltage_out);
+uint32_t rtc_get_seconds();
 
 uint32_t calculate_update_sleep_duration(uint32_t remaining_duration,
                                          uint16_t current_interval_sw_value);
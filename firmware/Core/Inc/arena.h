@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "ff.h"
+#include "img.h"
+#include "main.h"
+#include "sd.h"
+#include "sdlog.h"
+
+#define ARENA_PIXEL_BUF_SIZE 5000  // decoded bytes sent to the panel per chunk
+
+/**
+ * Phases of a wake cycle, each with its own layout of the arena. The layouts
+ * overlap, so entering a phase ends the previous one and its buffers must no
+ * longer be used. Phases only move forward within a wake.
+ */
+enum arena_phase_t {
+    ARENA_PHASE_NONE = 0,   // boot, FRAM, SD mount and battery check
+    ARENA_PHASE_IMAGE = 1,  // image lookup, decode and display transfer
+    ARENA_PHASE_LOG = 2,    // log writes before sleep
+};
+
+struct arena_image_t {
+    FIL file;  // image file, open from lookup until the transfer is done
+    DWORD album_clmt[SD_ALBUM_CLMT_SIZE];  // fast seek table of the album
+    struct img_t img;  // container and decoder state
+    uint8_t pixel_buf[ARENA_PIXEL_BUF_SIZE];
+};
+
+struct arena_log_t {
+    uint8_t sector[SDLOG_SECTOR_SIZE];  // sector staged for a log write
+};
+
+union arena_t {
+    struct arena_image_t image;
+    struct arena_log_t log;
+};
+
+extern union arena_t arena;
+
+void arena_enter(enum arena_phase_t phase);
+
+#endif  // ARENA_H
@@ -0,0 +1,36 @@
+#ifndef BATT_H
+#define BATT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BATT_VDIV_RATIO 1.861  // battery voltage divider, 6.14 V full scale
+                               // at a 3.3 V ADC supply
+#define BATT_MIN_LOADED_MV \
+    3550  // lowest battery voltage under panel refresh load that keeps the
+          // 3.3 V regulator in regulation
+#define BATT_RESERVE_PCT \
+    5  // charge kept back beyond what a refresh needs, for the wakes until
+       // the battery recovers
+#define BATT_SAG_DEFAULT_MV 100  // refresh load drop assumed until measured
+#define BATT_CHARGING_MV_PER_DAY 5  // trend above which the battery is charging
+
+// Battery readings of this wake
+struct batt_status_t {
+    uint16_t mv;       // calibrated battery voltage at rest
+    uint16_t vdda_mv;  // ADC supply, measured against VREFINT
+    uint16_t sag_mv;   // smoothed drop under panel refresh load
+    uint16_t required_mv;  // lowest rest voltage with charge for a refresh
+    uint8_t soc;           // state of charge from the rest voltage, in %
+    int8_t headroom;  // charge above what a refresh needs, in %, negative if
+                      // a refresh could brown out
+    int16_t trend_mv_per_day;  // smoothed change of the rest voltage
+};
+
+extern struct batt_status_t batt_status;
+
+bool batt_measure();
+void batt_measure_load();
+bool batt_charging();
+
+#endif  // BATT_H
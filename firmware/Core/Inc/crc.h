@@ -0,0 +1,10 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+
+void crc_start();
+void crc_update(const uint8_t* data, uint32_t len);
+uint32_t crc_result();
+
+#endif  // CRC_H
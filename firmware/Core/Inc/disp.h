@@ -1,6 +1,13 @@
 #ifndef DISP_H
 #define DISP_H
 
+#include <stdint.h>
+
+#define DISP_WIDTH 800   // pixels
+#define DISP_HEIGHT 480  // pixels
+#define DISP_BPP 4       // bits per pixel, two pixels per byte
+#define DISP_FRAME_SIZE (DISP_WIDTH * DISP_BPP / 8 * DISP_HEIGHT)  // bytes
+
 #define DISP_BLACK 0x0   /// 000
 #define DISP_WHITE 0x1   /// 001
 #define DISP_GREEN 0x2   /// 010
@@ -12,9 +19,12 @@
 
 void disp_send_command(uint8_t reg);
 void disp_send_data(uint8_t data);
+void disp_send_pixels(const uint8_t* data, uint32_t len);
 void disp_init();
 void disp_init_regs(void);
 void disp_turn_on();
+void disp_turn_on_start();
+void disp_turn_on_wait();
 void disp_clear(uint8_t color);
 void disp_sleep(void);
 void disp_exit();
@@ -9,6 +9,63 @@
 #include "aeon.h"
 #include "stm32l4xx_hal.h"
 
+#define FRAM_LOG_COUNT 3  // number of SD ring logs with a stored position
+
+// Location and write position of a ring log file on the SD card
+struct fram_log_state_t {
+    uint32_t sclust;  // start cluster of the log file, 0 if unknown
+    uint32_t id;      // random id of the log file, stamped on each sector
+    uint32_t head;    // next data sector to write
+    uint32_t seq;     // sequence number of the next sector
+};
+
+// Battery readings kept between wakes for the load and trend estimates
+struct fram_batt_state_t {
+    uint16_t sample_mv;        // rest voltage of the trend sample, 0 if none
+    uint32_t sample_time;      // RTC time of sample_mv, in seconds
+    int16_t trend_mv_per_day;  // smoothed change of the rest voltage
+    uint16_t sag_mv;  // smoothed drop under panel refresh load, 0 if unknown
+};
+
+#define FRAM_NEXT_IMAGE_PATH_SIZE 41
+#define FRAM_DIR_ENTRY_SIZE 32
+
+// Image picked and checked at the end of a refresh, for the next refresh to
+// open from its directory entry, or from its first cluster when the catalog
+// listed it. The image sequence stays at the previous image until it is used.
+struct fram_next_image_t {
+    uint32_t volume;  // serial of the volume holding the image
+    uint32_t index;
+    char path[FRAM_NEXT_IMAGE_PATH_SIZE];
+    uint8_t shuffle;      // picked with shuffle enabled
+    uint32_t offset;      // start of the image within the file
+    uint32_t size;        // image size in bytes, 0 if unknown
+    uint32_t crc32;       // CRC32 of the image, 0 if unknown
+    uint32_t sclust;      // first cluster from the catalog, 0 if not used
+    uint32_t dir_sect;    // sector holding the directory entry, 0 if unset
+    uint16_t dir_offset;  // offset of the entry within that sector
+    uint8_t dir_entry[FRAM_DIR_ENTRY_SIZE];  // name, first cluster, size and
+                                             // timestamps of the file
+    // image sequence after the image, stored once it is shown
+    uint32_t img_counter;
+    uint32_t shuffle_seed;
+    uint32_t shuffle_position;
+    uint32_t shuffle_count;
+};
+
+#define FRAM_HARVEST_SLOTS 4  // parts of the day with a harvest estimate
+
+// Harvest history kept between wakes by the refresh scheduler
+struct fram_sched_state_t {
+    uint16_t last_mv;    // rest voltage of the previous wake, 0 if none
+    uint32_t last_time;  // RTC time of last_mv, in seconds
+    int16_t harvest_mv_per_day[FRAM_HARVEST_SLOTS];  // smoothed net change of
+                                                     // the rest voltage in
+                                                     // each part of the day
+};
+
+bool fram_state_load();
+bool fram_state_commit();
 
 void fram_set_image_counter(uint32_t counter);
 uint32_t fram_get_image_counter();
@@ -27,4 +84,25 @@ enum sleep_reason_t fram_get_sleep_reason();
 
 uint32_t fram_sys_wake_cycle_count_update();
 
+void fram_set_shuffle_state(uint32_t seed, uint32_t position, uint32_t count);
+void fram_get_shuffle_state(uint32_t* seed, uint32_t* position,
+                            uint32_t* count);
+
+void fram_set_album_layout(uint32_t sclust, uint32_t size);
+void fram_get_album_layout(uint32_t* sclust, uint32_t* size);
+
+void fram_set_log_state(uint8_t log, const struct fram_log_state_t* state);
+void fram_get_log_state(uint8_t log, struct fram_log_state_t* state);
+void fram_set_log_volume(uint32_t serial);
+uint32_t fram_get_log_volume();
+
+void fram_set_batt_state(const struct fram_batt_state_t* state);
+void fram_get_batt_state(struct fram_batt_state_t* state);
+
+void fram_set_sched_state(const struct fram_sched_state_t* state);
+void fram_get_sched_state(struct fram_sched_state_t* state);
+
+void fram_set_next_image(const struct fram_next_image_t* next);
+bool fram_get_next_image(struct fram_next_image_t* next);
+
 #endif  // FRAM_H
\ No newline at end of file
@@ -0,0 +1,69 @@
+#ifndef IMG_H
+#define IMG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ff.h"
+#include "sd.h"
+#include "slic.h"
+
+#define IMG_MAGIC 0x474D4941  // "AIMG"
+#define IMG_VERSION 1
+#define IMG_ATTEMPTS 3  // images tried per refresh before giving up
+
+// Codec of an image payload, each handled by an entry of the decoder registry
+// in img.c. Values are stored on the card, so they must not change.
+enum img_codec_t {
+    IMG_CODEC_SLIC = 1,  // SLIC compressed, 8 bpp holding two panel pixels
+    IMG_CODEC_RAW = 2,   // the panel's frame data as sent, sector aligned
+};
+
+// Container header in front of each image written by the conversion script,
+// followed by header_size - sizeof(struct img_header_t) reserved bytes and
+// the payload
+struct __attribute__((packed)) img_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;    // offset of the payload from the header
+    uint8_t codec;           // enum img_codec_t
+    uint8_t bpp;             // bits per panel pixel
+    uint16_t width;          // panel pixels
+    uint16_t height;
+    uint16_t flags;          // reserved, 0
+    uint32_t payload_size;   // bytes of codec data
+    uint32_t payload_crc32;  // CRC32 of the payload, as zlib
+};
+
+struct img_t;
+
+// Decoder of a codec, filling output buffers with panel bytes from the
+// payload read through img_read. decode returns the number of bytes filled,
+// up to len, or 0 on an error.
+struct img_decoder_t {
+    uint8_t codec;
+    bool (*init)(struct img_t* img);
+    uint32_t (*decode)(struct img_t* img, uint8_t* out, uint32_t len);
+};
+
+// Image being streamed to the panel
+struct img_t {
+    FIL* fp;  // positioned at the next payload byte
+    const struct img_decoder_t* decoder;
+    struct img_header_t header;
+    uint32_t remaining;  // payload bytes not read yet
+    bool crc_known;      // payload_crc32 can be checked
+    bool failed;         // read or decode error
+    union {
+        SLICSTATE slic;
+    } state;
+};
+
+bool img_read_header(FIL* fp, const struct sd_image_t* image,
+                     struct img_header_t* header);
+bool img_open(struct img_t* img, FIL* fp, const struct sd_image_t* image);
+int32_t img_read(struct img_t* img, uint8_t* buf, uint32_t len);
+uint32_t img_decode(struct img_t* img, uint8_t* out, uint32_t len);
+bool img_finish(struct img_t* img);
+
+#endif  // IMG_H
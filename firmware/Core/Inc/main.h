@@ -49,6 +49,15 @@ extern "C" {
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
+// Place a variable in .noinit, which the startup code does not clear. Its
+// content is undefined at every boot, so it must be set up before use.
+#define NOINIT __attribute__((section(".noinit")))
+// Place a variable in SRAM2, which keeps its content in standby, see retain.c
+#define RETAINED __attribute__((section(".retained")))
+// Run a function from SRAM2 at zero wait states instead of from flash, for hot
+// loops. Copied from flash by the startup code, library functions are placed
+// there by the linker script instead.
+#define RAM2FUNC __attribute__((section(".ram2func"), noinline))
 
 /* USER CODE END EM */
 
@@ -118,6 +127,17 @@ extern RNG_HandleTypeDef hrng;
 
 #define BATT_LOGGING true  // enable battery logging to SD card
 
+#define PROFILE_LOGGING true  // enable wake phase timing logging to SD card
+
+#define OVERLAY_BATTERY \
+    false  // draw the battery charge in the bottom right corner of every
+           // image
+
+#define SRAM2_RETENTION \
+    false  // keep cached card state and staged logs in SRAM2 through standby.
+           // Costs 0.2 uA in standby, more than it saves at refresh
+           // intervals of 12 hours or longer.
+
 #define SET_DEBUG_LED(x)                                  \
     HAL_GPIO_WritePin(DEBUG_LED_GPIO_Port, DEBUG_LED_Pin, \
                       (x) ? GPIO_PIN_SET : GPIO_PIN_RESET)
@@ -146,12 +166,6 @@ extern bool runtime_debug_mode;  // when true, full log is written to SD card
 
 extern uint32_t wake_cycle_count;
 
-extern char debug_output_arr[20000];
-extern int debug_output_arr_index;
-
-extern uint32_t wake_cycle_count;
-extern double batt_voltage;
-
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
@@ -0,0 +1,21 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OVERLAY_ITEMS_MAX 4  // text boxes drawn over one frame
+#define OVERLAY_TEXT_MAX 16  // characters per text box
+#define OVERLAY_SCALE 3      // panel pixels per font pixel
+#define OVERLAY_MARGIN 12    // distance of corner boxes from the panel edge
+#define OVERLAY_BATTERY_LOW_SOC 20  // charge below which the battery is red
+
+// First of the battery icons of the font, showing 0 to 5 fifths of charge
+#define OVERLAY_ICON_BATTERY '\x01'
+
+bool overlay_add_text(uint16_t x, uint16_t y, const char* text,
+                      uint8_t color);
+void overlay_add_battery();
+void overlay_apply(uint8_t* data, uint32_t offset, uint32_t len);
+
+#endif  // OVERLAY_H
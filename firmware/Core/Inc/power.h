@@ -0,0 +1,20 @@
+#ifndef POWER_H
+#define POWER_H
+
+/**
+ * Operating points of the core. SystemClock_Config starts each wake at full
+ * speed, power_init drops it to POWER_MODE_LOW before the peripherals are set
+ * up, and the clock is only raised again around work that is limited by
+ * the CPU or by bulk SPI transfers, where finishing sooner saves more than
+ * the higher run current costs. Waits always run in POWER_MODE_LOW.
+ */
+enum power_mode_t {
+    POWER_MODE_LOW = 0,   // MSI at 4 MHz in voltage range 2
+    POWER_MODE_FULL = 1,  // PLL at 80 MHz from HSI in voltage range 1
+};
+
+void power_init();
+void power_init_spi();
+enum power_mode_t power_set_mode(enum power_mode_t mode);
+
+#endif  // POWER_H
@@ -0,0 +1,53 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "user_diskio_spi.h"
+
+#define PROFILE_VERSION 2
+
+/**
+ * Phases of a wake cycle, as X(id, name). The names are used by
+ * tools/profile_report.py. New phases must be appended, so records from older
+ * firmware still decode.
+ */
+#define PROFILE_PHASES(X)                       \
+    X(PROFILE_BOOT, "boot")                     \
+    X(PROFILE_FRAM, "fram")                     \
+    X(PROFILE_SD_MOUNT, "sd_mount")             \
+    X(PROFILE_BATT_CHECK, "batt_check")         \
+    X(PROFILE_IMAGE_LOOKUP, "image_lookup")     \
+    X(PROFILE_DECODE, "decode")                 \
+    X(PROFILE_DISP_TRANSFER, "disp_transfer")   \
+    X(PROFILE_DISP_BUSY, "disp_busy")           \
+    X(PROFILE_LOG_FLUSH, "log_flush")           \
+    X(PROFILE_IMAGE_PREPARE, "image_prepare")
+
+enum profile_phase_t {
+#define PROFILE_PHASE_ENUM(id, name) id,
+    PROFILE_PHASES(PROFILE_PHASE_ENUM)
+#undef PROFILE_PHASE_ENUM
+        PROFILE_PHASE_COUNT,
+};
+
+// Timing record of one wake cycle, appended to the profile log
+struct __attribute__((packed)) profile_record_t {
+    uint8_t version;
+    uint8_t phase_count;
+    uint8_t wake_reason;
+    uint8_t sleep_reason;
+    uint32_t total_us;  // from the start of main until the record was made
+    uint32_t phase_us[PROFILE_PHASE_COUNT];     // total time in each phase
+    uint16_t phase_calls[PROFILE_PHASE_COUNT];  // times each phase was entered
+    USER_SPI_StatsTypeDef disk;  // SD card I/O counters of this wake
+};
+
+void profile_init();
+void profile_clock_changed();
+void profile_start(enum profile_phase_t phase);
+void profile_stop(enum profile_phase_t phase);
+bool profile_write();
+
+#endif  // PROFILE_H
@@ -0,0 +1,59 @@
+#ifndef RETAIN_H
+#define RETAIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RETAIN_MAGIC 0x4E544552  // "RETN"
+#define RETAIN_VERSION 5
+#define RETAIN_STAGE_SIZE 3072  // bytes of log records staged between mounts,
+                                // the rest of SRAM2 holds code
+#define RETAIN_BPB_SIZE 90  // boot sector bytes identifying the FAT volume
+
+// Geometry of the FAT volume on the card, enough to use it without reading
+// the partition table or FSInfo
+struct retain_volume_t {
+    uint8_t bpb[RETAIN_BPB_SIZE];  // start of the boot sector, up to the
+                                   // boot code, including the volume serial
+    uint8_t fs_type;               // FatFs FS_FAT*, 0 if unset
+    uint8_t n_fats;
+    uint16_t n_rootdir;
+    uint16_t csize;
+    uint32_t volbase;  // boot sector of the volume
+    uint32_t fatbase;
+    uint32_t dirbase;
+    uint32_t database;
+    uint32_t fsize;
+    uint32_t n_fatent;
+};
+
+// Image library found by the last full lookup
+struct retain_library_t {
+    uint32_t count;  // number of images, 0 if unknown
+    uint8_t flags;   // SD_LIBRARY_FLAG_*
+};
+
+// Log record staged while the card isn't mounted, followed by its data
+struct retain_log_record_t {
+    uint8_t log;  // enum sdlog_t
+    uint8_t reserved;
+    uint16_t size;
+    uint32_t wake;  // wake cycle count the record was made in
+    uint8_t data[];
+};
+
+bool retain_load();
+void retain_commit();
+
+void retain_set_volume(const struct retain_volume_t* volume);
+bool retain_get_volume(struct retain_volume_t* volume);
+
+void retain_set_library(const struct retain_library_t* library);
+bool retain_get_library(struct retain_library_t* library);
+
+bool retain_stage_log(uint8_t log, uint32_t wake, const void* data,
+                      uint16_t size);
+const struct retain_log_record_t* retain_staged_log(uint32_t* pos);
+void retain_clear_staged_logs();
+
+#endif  // RETAIN_H
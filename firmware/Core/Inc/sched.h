@@ -0,0 +1,36 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCHED_STRETCH_MAX 4  // longest interval, in multiples of the switches
+#define SCHED_SHORTEN_MAX 2  // shortest interval, in fractions of the switches
+#define SCHED_INTERVAL_MIN (60 * 60)  // never refresh more often than hourly
+#define SCHED_TIGHT_HEADROOM_PCT \
+    10  // headroom below which refreshes are spaced out and kept cheap
+#define SCHED_RUNWAY_DAYS \
+    60  // how long the charge above the refresh threshold should last at the
+        // current trend before refreshes are spaced out
+#define SCHED_SURPLUS_SOC 90  // charge above which harvest would be wasted
+#define SCHED_WAIT_MAX (6 * 60 * 60)  // longest a refresh waits for harvest
+#define SCHED_HARVEST_MIN_MV_PER_DAY 10  // harvest worth waiting for
+
+enum sched_budget_t {
+    SCHED_BUDGET_TIGHT = 0,    // little charge left or draining too fast
+    SCHED_BUDGET_NORMAL = 1,   // refresh at the switch interval
+    SCHED_BUDGET_SURPLUS = 2,  // nearly full while charging
+};
+
+// How the refresh of this wake and the next one are run
+struct sched_plan_t {
+    enum sched_budget_t budget;
+    uint32_t interval;  // seconds until the next refresh
+    bool clear;         // run the clearing pass before the image
+};
+
+void sched_update();
+void sched_plan(uint16_t interval_sw_value, struct sched_plan_t* plan);
+uint32_t sched_harvest_wait(const struct sched_plan_t* plan);
+
+#endif  // SCHED_H
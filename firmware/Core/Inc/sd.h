@@ -6,10 +6,71 @@
 
 #include "ff.h"
 
-bool sd_init(FATFS* FatFs);
+#define SD_CATALOG_PATH "/images/catalog.bin"
+#define SD_CATALOG_MAGIC 0x54414341  // "ACAT"
+#define SD_CATALOG_VERSION 1
+#define SD_CATALOG_FLAG_SHARDED 0x01  // images are in /images/NNN/N.slc
+
+#define SD_IMAGES_PER_SHARD 1000  // images per shard directory, NNN = N / 1000
+
+// Image catalog written by the conversion script: a header followed by one
+// fixed size entry per image, in index order
+struct __attribute__((packed)) sd_catalog_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;  // size of each entry, may grow in later versions
+    uint32_t count;       // number of images
+    uint32_t flags;
+};
+
+struct __attribute__((packed)) sd_catalog_entry_t {
+    uint32_t size;           // file size in bytes
+    uint32_t crc32;          // CRC32 of the whole file
+    uint32_t start_cluster;  // first cluster of the file, 0 if unknown
+};
+
+#define SD_ALBUM_PATH "/images/album.bin"
+#define SD_ALBUM_MAGIC 0x424C4141  // "AALB"
+#define SD_ALBUM_VERSION 1
+#define SD_ALBUM_CLMT_SIZE 32  // fast seek table size, fits 15 fragments
+
+// Packed album written by the conversion script: a header, a table of one
+// fixed size entry per image, then the images, each starting on a sector
+// boundary
+struct __attribute__((packed)) sd_album_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;  // size of each table entry
+    uint32_t count;       // number of images
+    uint32_t flags;
+};
+
+struct __attribute__((packed)) sd_album_entry_t {
+    uint32_t offset;  // start of the image in the album file
+    uint32_t length;  // image length in bytes
+};
+
+#define SD_LIBRARY_FLAG_CATALOG 0x01  // count and entries come from a catalog
+#define SD_LIBRARY_FLAG_SHARDED 0x02  // images are in shard directories
+
+// Location of the image selected for display
+struct sd_image_t {
+    uint32_t index;
+    char path[41];    // file holding the image
+    uint32_t offset;  // start of the image within the file
+    uint32_t size;    // image size in bytes, 0 if unknown
+    uint32_t crc32;   // CRC32 of the image, 0 if unknown
+};
+
+bool sd_init();
+bool sd_is_mounted();
+FATFS* sd_get_fs();
+uint32_t sd_volume_serial();
 void sd_close();
-void sd_write_logfile();
-bool sd_get_next_image_filename(char* filename_buf, bool shuffle_enabled);
+bool sd_open_next_image(FIL* fp, bool shuffle_enabled,
+                        struct sd_image_t* image);
+void sd_close_image(FIL* fp);
+void sd_prepare_next_image(FIL* fp, bool shuffle_enabled);
 void sd_append_batt_charge_log(int sleep_seconds);
 
 #endif  // SD_H
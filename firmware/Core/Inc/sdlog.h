@@ -0,0 +1,43 @@
+#ifndef SDLOG_H
+#define SDLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SDLOG_MAGIC 0x474F4C41  // "ALOG"
+#define SDLOG_VERSION 2  // 2: room for the longer battery log columns
+#define SDLOG_SECTOR_SIZE 512
+
+// Ring logs kept on the SD card, each a fixed size, preallocated contiguous
+// file written in place
+enum sdlog_t {
+    SDLOG_BATT,   // battery charge log, one CSV line per wake
+    SDLOG_TRACE,  // binary trace of debug mode wakes
+    SDLOG_PROFILE,  // phase timing record of each wake
+    SDLOG_COUNT,
+};
+
+// First sector of a log file, written once when the file is created
+struct __attribute__((packed)) sdlog_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t sector_size;
+    uint32_t id;       // random id, stamped on each data sector of this file
+    uint32_t sectors;  // number of data sectors in the ring
+    char columns[240];  // CSV header of text logs, empty otherwise
+};
+
+// Every data sector after the header
+struct __attribute__((packed)) sdlog_sector_t {
+    uint32_t id;    // id of the log file, tells data sectors from stale data
+    uint32_t seq;   // incremented for each sector written, the oldest sector
+                    // after a wrap is the one following the highest seq
+    uint32_t wake;  // wake cycle count when the sector was written
+    uint16_t used;  // number of data bytes used
+    uint16_t flags;
+    uint8_t data[SDLOG_SECTOR_SIZE - 16];
+};
+
+bool sdlog_append(enum sdlog_t log, const void* data, uint32_t size);
+
+#endif  // SDLOG_H
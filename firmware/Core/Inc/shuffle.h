@@ -0,0 +1,8 @@
+#ifndef SHUFFLE_H
+#define SHUFFLE_H
+
+#include <stdint.h>
+
+uint32_t shuffle_permute(uint32_t position, uint32_t count, uint32_t seed);
+
+#endif  // SHUFFLE_H
@@ -81,11 +81,13 @@ typedef struct slic_file_tag
 // Define a small buffer to cache incoming and outgoing data
 // on AVR make it tiny since there's not much RAM to work with
 //
+#ifndef FILE_BUF_SIZE
 #ifdef __AVR__
 #define FILE_BUF_SIZE 128
 #else
 #define FILE_BUF_SIZE 1024
 #endif
+#endif
 
 typedef int (SLIC_READ_CALLBACK)(SLICFILE *pFile, uint8_t *pBuf, int32_t iLen);
 typedef int (SLIC_WRITE_CALLBACK)(SLICFILE *pFile, uint8_t *pBuf, int32_t iLen);
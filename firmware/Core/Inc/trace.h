@@ -0,0 +1,128 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_BUF_SIZE 2048  // bytes of trace records kept per wake
+#define TRACE_MAX_ARGS 3
+
+/**
+ * Trace events, as X(id, format). A record only stores the event id, a
+ * timestamp and up to TRACE_MAX_ARGS 32-bit arguments. The format is applied
+ * on the host by tools/decode_trace.py, and on the device only for SWO
+ * output, so formats may only use integer conversions. New events must be
+ * appended, so traces from older firmware still decode.
+ */
+#define TRACE_EVENTS(X)                                                       \
+    X(TRACE_FLUSH, "End of trace: %lu event types, %lu records dropped")      \
+    X(TRACE_WAKE_BTN, "Wake from Standby (Refresh Btn)")                      \
+    X(TRACE_WAKE_RTC, "Wake from Standby (RTC)")                              \
+    X(TRACE_WAKE_RESET, "Wake from pwr off (Reset)")                          \
+    X(TRACE_AUX_PWR_ON, "Enabled AUX PWR")                                    \
+    X(TRACE_ITERATION, "Starting iteration %lu")                              \
+    X(TRACE_SHUTDOWN_SAFE, "Previous shutdown was safe")                      \
+    X(TRACE_SHUTDOWN_UNSAFE, "Previous shutdown was UNSAFE")                  \
+    X(TRACE_FRAM_INVALID, "No valid FRAM state record, using defaults")       \
+    X(TRACE_SD_UNAVAILABLE,                                                   \
+      "SD card not available, will be unable to refresh image")               \
+    X(TRACE_BATT_LOW, "Battery voltage is %lu mV, below threshold of %lu mV") \
+    X(TRACE_BATT_CHECK_DISABLED,                                              \
+      "Battery threshold check disabled, continuing...")                      \
+    X(TRACE_BATT_OK, "Battery voltage is %lu mV, above threshold of %lu mV")  \
+    X(TRACE_DEBUG_UNSAFE_SHUTDOWN, "Debug mode enabled by unsafe shutdown!")  \
+    X(TRACE_DEBUG_BTN, "Debug mode enabled due to button press!")             \
+    X(TRACE_SLEEP_REMAINING, "Remaining sleep duration: %lu")                 \
+    X(TRACE_INTERVAL_SW,                                                      \
+      "Previous interval switch value: %lu, Current interval switch value: "  \
+      "%lu")                                                                  \
+    X(TRACE_SLEEP_NOT_ELAPSED,                                                \
+      "Sleep duration not elapsed... Conditions not met for refresh, going "  \
+      "back to sleep.")                                                       \
+    X(TRACE_REFRESH_DISABLED, "Refresh not enabled... Going back to sleep.")  \
+    X(TRACE_NO_SD,                                                            \
+      "SD card not available to refresh image... Going back to sleep.")       \
+    X(TRACE_NO_IMAGE, "No image to display... Going back to sleep.")          \
+    X(TRACE_IMAGE_OPEN, "Opening image %lu at offset %lu")                    \
+    X(TRACE_IMAGE_OPEN_FAILED,                                                \
+      "Unable to open image (%li)... Going back to sleep.")                   \
+    X(TRACE_DISP_INIT, "Initialising display")                                \
+    X(TRACE_DISP_INIT_REGS, "Initialising display registers")                 \
+    X(TRACE_DISP_CLEAR, "Clearing display")                                   \
+    X(TRACE_DISP_TRANSFER,                                                    \
+      "Transferring image data to disp (%lu bytes per chunk)")                \
+    X(TRACE_DISP_TRANSFER_DONE, "Completed image transfer")                   \
+    X(TRACE_DISP_ON, "Turning on display")                                    \
+    X(TRACE_DISP_SLEEP, "Display to sleep and shutdown")                      \
+    X(TRACE_DISP_BUSY_TIMEOUT, "ERROR: Display busy timeout")                 \
+    X(TRACE_SLEEP, "Sleeping for %lu seconds...")                             \
+    X(TRACE_SLEEP_FAILED, "Should not reach here, something went wrong...")   \
+    X(TRACE_F_MOUNT_ERROR, "f_mount error (%li)")                             \
+    X(TRACE_F_OPEN_ERROR, "f_open error (%li)")                               \
+    X(TRACE_F_READ_ERROR, "f_read error (%li)")                               \
+    X(TRACE_RNG_ERROR, "Error generating random number")                      \
+    X(TRACE_NO_CATALOG, "No image catalog, falling back to directory scan")   \
+    X(TRACE_CATALOG_STALE,                                                    \
+      "Image size does not match catalog, catalog is stale")                  \
+    X(TRACE_LOG_SCAN, "Scanning log %lu for its last write")                  \
+    X(TRACE_LOG_ALLOC_FAILED, "Unable to allocate log %lu (%li)")             \
+    X(TRACE_LOG_OPEN_FAILED, "Unable to open log %lu")                        \
+    X(TRACE_ARENA_PHASE, "Arena phase %lu -> %lu")                            \
+    X(TRACE_RETAIN_INVALID, "No retained state in SRAM2, starting empty")     \
+    X(TRACE_SD_MOUNT_RETAINED, "Mounted SD card with retained geometry")      \
+    X(TRACE_LIBRARY_RETAINED, "Using retained image count %lu")               \
+    X(TRACE_LIBRARY_STALE, "Retained library is stale, looking up again")     \
+    X(TRACE_LOG_STAGED, "Staged %lu bytes for log %lu")                       \
+    X(TRACE_LOG_STAGED_WRITE, "Writing %lu bytes of staged log records")      \
+    X(TRACE_NEXT_IMAGE_READY, "Prepared image %lu for the next refresh")      \
+    X(TRACE_NEXT_IMAGE_BAD, "Image %lu has a bad header, skipping it")        \
+    X(TRACE_NEXT_IMAGE_PREPARED, "Opening prepared image %lu")                \
+    X(TRACE_NEXT_IMAGE_STALE, "Prepared image is stale, looking up again")    \
+    X(TRACE_POWER_MODE, "Power mode %lu -> %lu")                              \
+    X(TRACE_BATT_VDDA, "ADC supply is %lu mV, refresh load drop is %lu mV")   \
+    X(TRACE_BATT_STATE, "Battery %lu%% charged, %li%% headroom, %li mV/day")  \
+    X(TRACE_BATT_SAG, "Battery is %lu mV under refresh load, %lu mV drop")    \
+    X(TRACE_BATT_CHARGING, "Battery is charging, checking again in %lu s")    \
+    X(TRACE_SCHED_HARVEST, "Harvest in part %lu of the day is %li mV/day")    \
+    X(TRACE_SCHED_PLAN, "Energy budget %lu, refresh in %lu s, clear %lu")     \
+    X(TRACE_SCHED_WAIT, "Waiting %lu s for more harvest")                     \
+    X(TRACE_IMG_HEADER_BAD, "Image %lu has a bad container header")           \
+    X(TRACE_IMG_LEGACY, "Image %lu has no container, reading it as SLIC")     \
+    X(TRACE_IMG_NO_DECODER, "Image %lu has codec %lu, which has no decoder")  \
+    X(TRACE_IMG_TRUNCATED, "Image payload is %lu bytes, %lu on the card")     \
+    X(TRACE_IMG_DECODER_FAILED, "Image %lu can't be decoded as codec %lu")    \
+    X(TRACE_IMG_OPEN, "Image %lu has codec %lu, %lu byte payload")            \
+    X(TRACE_IMG_READ_FAILED, "Image read or decode failed, %lu bytes left")   \
+    X(TRACE_IMG_CRC_MISMATCH, "Image payload CRC is %08lx, expected %08lx")   \
+    X(TRACE_IMG_SKIPPED, "Skipping image %lu")                                \
+    X(TRACE_OVERLAY_TEXT, "Overlay of %lu characters at %lu, %lu")            \
+    X(TRACE_LOG_CHECK, "Checking log %lu on the card")                        \
+    X(TRACE_CATALOG_CLUSTER, "Opening image %lu from its catalog cluster")    \
+    X(TRACE_CATALOG_CLUSTER_STALE, "Catalog cluster of image %lu is stale")
+
+enum trace_event_t {
+#define TRACE_EVENT_ENUM(id, format) id,
+    TRACE_EVENTS(TRACE_EVENT_ENUM)
+#undef TRACE_EVENT_ENUM
+        TRACE_EVENT_COUNT,
+};
+
+// Record stored in the trace buffer, followed by nargs 32-bit arguments
+struct __attribute__((packed)) trace_record_t {
+    uint8_t event;
+    uint8_t nargs;
+    uint32_t tick;  // HAL_GetTick() when the event was recorded, in ms
+};
+
+void trace_record(enum trace_event_t event, uint8_t nargs, uint32_t a0,
+                  uint32_t a1, uint32_t a2);
+bool trace_flush();
+
+#define TRACE0(event) trace_record(event, 0, 0, 0, 0)
+#define TRACE1(event, a0) trace_record(event, 1, (uint32_t)(a0), 0, 0)
+#define TRACE2(event, a0, a1) \
+    trace_record(event, 2, (uint32_t)(a0), (uint32_t)(a1), 0)
+#define TRACE3(event, a0, a1, a2) \
+    trace_record(event, 3, (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2))
+
+#endif  // TRACE_H
@@ -3,9 +3,14 @@
 
 #include <stdio.h>
 
+#include "arena.h"
 #include "fram.h"
 #include "main.h"
+#include "power.h"
+#include "profile.h"
+#include "retain.h"
 #include "sd.h"
+#include "trace.h"
 #include "stm32l4xx_hal.h"
 
 const char *wake_reason_t_str[] = {"WAKE_REASON_RESET",
@@ -18,7 +23,8 @@ const char *sleep_reason_t_str[] = {"SLEEP_REASON_NULL",
                                     "SLEEP_REASON_LOW_BATT",
                                     "SLEEP_REASON_NO_IMAGE",
                                     "SLEEP_REASON_NO_SD",
-                                    "SLEEP_REASON_REFRESH_DISABLED"};
+                                    "SLEEP_REASON_REFRESH_DISABLED",
+                                    "SLEEP_REASON_HARVEST_WAIT"};
 
 /**
  * @brief Select the SPI device to communicate with.
@@ -94,29 +100,6 @@ uint16_t get_toggle_sw_bits() {
     return bits;
 }
 
-/**
- * Enable VDIV switch and read the battery voltage with the ADC.
- */
-bool batt_threshold_check(double *batt_voltage_out) {
-    HAL_GPIO_WritePin(BATT_VDIV_EN_GPIO_Port, BATT_VDIV_EN_Pin, GPIO_PIN_SET);
-    HAL_Delay(10);
-
-    HAL_ADC_Start(&hadc1);
-    HAL_ADC_PollForConversion(&hadc1, 100);
-    uint32_t adcValue = HAL_ADC_GetValue(&hadc1);
-    double batt_voltage = (double)adcValue / 4095.0 *
-                          6.14;  // this value has to be manually calibrated
-    HAL_ADC_Stop(&hadc1);
-
-    HAL_GPIO_WritePin(BATT_VDIV_EN_GPIO_Port, BATT_VDIV_EN_Pin, GPIO_PIN_RESET);
-
-    if (batt_voltage_out != NULL) {
-        *batt_voltage_out = batt_voltage;
-    }
-
-    return batt_voltage > BATT_THRESHOLD;
-}
-
 bool check_debug_mode_en() {
     if (GET_BTN_IN() == GPIO_PIN_SET) {
         SET_DEBUG_LED(true);
@@ -128,7 +111,7 @@ bool check_debug_mode_en() {
                 SET_DEBUG_LED(false);
                 HAL_Delay(50);
             }
-            printf("Debug mode enabled due to button press!\n");
+            TRACE0(TRACE_DEBUG_BTN);
             return true;
         }
         SET_DEBUG_LED(false);
@@ -172,31 +155,134 @@ uint32_t calculate_update_sleep_duration(uint32_t remaining_duration,
     return new_duration;
 }
 
+/**
+ * @brief Number of days in a month of the RTC calendar (years 2000-2099).
+ */
+static uint8_t rtc_days_in_month(uint8_t month, uint8_t year) {
+    static const uint8_t days[12] = {31, 28, 31, 30, 31, 30,
+                                     31, 31, 30, 31, 30, 31};
+    if (month == 2 && (year % 4) == 0) return 29;
+    return days[month - 1];
+}
+
+/**
+ * @brief Read the RTC calendar.
+ */
+static void rtc_read(RTC_TimeTypeDef *time, RTC_DateTypeDef *date) {
+    // shadow registers are stale after a wake from standby until resynced
+    __HAL_RTC_WRITEPROTECTION_DISABLE(&hrtc);
+    HAL_RTC_WaitForSynchro(&hrtc);
+    __HAL_RTC_WRITEPROTECTION_ENABLE(&hrtc);
+
+    HAL_RTC_GetTime(&hrtc, time, RTC_FORMAT_BIN);
+    HAL_RTC_GetDate(&hrtc, date, RTC_FORMAT_BIN);  // unlocks shadow regs
+}
+
+/**
+ * @brief Get the RTC time as seconds since the start of 2000. Only the time
+ * between two readings means anything, as the calendar starts from an
+ * arbitrary date on first power up.
+ */
+uint32_t rtc_get_seconds() {
+    RTC_TimeTypeDef time = {0};
+    RTC_DateTypeDef date = {0};
+    rtc_read(&time, &date);
+
+    // every fourth year from 2000 is a leap year
+    uint32_t days = date.Year * 365UL + (date.Year + 3) / 4;
+    for (uint8_t month = 1; month < date.Month; month++) {
+        days += rtc_days_in_month(month, date.Year);
+    }
+    days += date.Date - 1;
+
+    return days * 24UL * 60 * 60 + time.Hours * 3600UL + time.Minutes * 60UL +
+           time.Seconds;
+}
+
+/**
+ * @brief Arm RTC alarm A to fire sleep_seconds from now.
+ *
+ * The alarm matches on day-of-month, hours, minutes and seconds, so a single
+ * standby period can last up to SLEEP_DURATION_DEFAULT (unlike the 16-bit
+ * wakeup timer, which caps out at about 18 hours).
+ */
+static void rtc_set_wake_alarm(uint32_t sleep_seconds) {
+    RTC_TimeTypeDef time = {0};
+    RTC_DateTypeDef date = {0};
+    RTC_AlarmTypeDef alarm = {0};
+
+    rtc_read(&time, &date);
+
+    // an alarm on the current second may already have passed
+    if (sleep_seconds < 2) sleep_seconds = 2;
+
+    uint32_t seconds_of_day = time.Hours * 3600UL + time.Minutes * 60UL +
+                              time.Seconds + sleep_seconds;
+    uint8_t day = date.Date;
+    uint8_t month = date.Month;
+    uint8_t year = date.Year;
+
+    while (seconds_of_day >= 24UL * 60 * 60) {
+        seconds_of_day -= 24UL * 60 * 60;
+        if (++day > rtc_days_in_month(month, year)) {
+            day = 1;
+            if (++month > 12) {
+                month = 1;
+                year = (year + 1) % 100;
+            }
+        }
+    }
+
+    alarm.AlarmTime.Hours = seconds_of_day / 3600;
+    alarm.AlarmTime.Minutes = (seconds_of_day / 60) % 60;
+    alarm.AlarmTime.Seconds = seconds_of_day % 60;
+    alarm.AlarmMask = RTC_ALARMMASK_NONE;
+    alarm.AlarmSubSecondMask = RTC_ALARMSUBSECONDMASK_ALL;
+    alarm.AlarmDateWeekDaySel = RTC_ALARMDATEWEEKDAYSEL_DATE;
+    alarm.AlarmDateWeekDay = day;
+    alarm.Alarm = RTC_ALARM_A;
+
+    if (HAL_RTC_SetAlarm_IT(&hrtc, &alarm, RTC_FORMAT_BIN) != HAL_OK) {
+        // fall back to the wakeup timer, which can't exceed ~18 hours
+        HAL_RTCEx_SetWakeUpTimer_IT(
+            &hrtc, sleep_seconds > 0xFFFF ? 0xFFFF : sleep_seconds,
+            RTC_WAKEUPCLOCK_CK_SPRE_16BITS, 0);
+    }
+}
+
 /**
  * Enter sleep mode.
  */
 void enter_sleep(int sleep_seconds) {
-    if (DBG) {
-        printf("Sleeping for %d seconds...\n", sleep_seconds);
-    }
+    TRACE1(TRACE_SLEEP, sleep_seconds);
+
+    // log writes to a mounted card are bulk SPI, the rest is short enough to
+    // stay in low power mode
+    if (sd_is_mounted()) power_set_mode(POWER_MODE_FULL);
 
     spi_device_select(AEON_SPI_SD);
+    arena_enter(ARENA_PHASE_LOG);  // image buffers are no longer needed
+    profile_start(PROFILE_LOG_FLUSH);
     if (BATT_LOGGING)
         sd_append_batt_charge_log(sleep_seconds);  // append battery charge log
                                                    // to SD card
     if (runtime_debug_mode || DEBUG_MODE_FORCE_EN)
-        sd_write_logfile();  // write debug log to SD card
+        trace_flush();  // write debug trace to SD card
+    profile_stop(PROFILE_LOG_FLUSH);
+    if (PROFILE_LOGGING) profile_write();  // append this wake's phase timings
     sd_close();              // unmount SD card
+    power_set_mode(POWER_MODE_LOW);
 
     fram_set_unsafe_shutdown(false);  // clear unsafe shutdown flag
+    fram_state_commit();              // store state for next wake in one write
+    retain_commit();                  // keep SRAM2 state through standby
 
     SET_AUX_PWR(false);               // disable AUX PWR
     spi_device_select(AEON_SPI_OFF);  // disable all CS lines to prevent
                                       // powering AUX via CS pull-up resistors
 
-    HAL_RTCEx_SetWakeUpTimer_IT(&hrtc, sleep_seconds,
-                                RTC_WAKEUPCLOCK_CK_SPRE_16BITS,
-                                0);  // set wake up time
+    HAL_RTCEx_DeactivateWakeUpTimer(&hrtc);  // alarm A is used instead
+    rtc_set_wake_alarm(sleep_seconds);       // set wake up time
 
     // HAL_PWREx_EnablePullUpPullDownConfig(); // enable pull-ups
     // enabling internal pullups actually uses about 0.5uA more current, so not
@@ -216,7 +302,7 @@ void enter_sleep(int sleep_seconds) {
 
     HAL_PWR_EnterSTANDBYMode();  // go to low power standby mode
 
-    printf("Should not reach here, something has gone wrong...\n");
+    TRACE0(TRACE_SLEEP_FAILED);
 
     while (true) {
         SET_DEBUG_LED(true);
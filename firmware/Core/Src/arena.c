@@ -0,0 +1,20 @@
+#include "arena.h"
+
+#include "trace.h"
+
+// The largest buffers of a wake, shared between phases. Kept out of .bss so
+// the startup code doesn't clear them at every boot.
+NOINIT union arena_t arena;
+
+static enum arena_phase_t arena_phase = ARENA_PHASE_NONE;
+
+/**
+ * @brief Start using the arena layout of a phase. The buffers of the previous
+ * phase are lost, and the new ones hold undefined data.
+ */
+void arena_enter(enum arena_phase_t phase) {
+    if (phase == arena_phase) return;
+
+    TRACE2(TRACE_ARENA_PHASE, arena_phase, phase);
+    arena_phase = phase;
+}
@@ -0,0 +1,237 @@
+#include "batt.h"
+
+#include "aeon.h"
+#include "fram.h"
+#include "main.h"
+#include "stm32l4xx_hal.h"
+#include "trace.h"
+
+#define BATT_ADC_OVERSAMPLING 16  // as set up by batt_adc_setup, without shift
+#define BATT_ADC_FULL_SCALE (4095UL * BATT_ADC_OVERSAMPLING)
+#define BATT_TREND_MIN_SECONDS (6UL * 60 * 60)  // shortest span for a trend
+#define BATT_TREND_WEIGHT 4  // each new span moves the trend by a quarter
+
+struct batt_status_t batt_status;
+
+static bool batt_adc_ready;
+
+// Rest voltage of a single lithium polymer cell against its state of charge
+static const struct {
+    uint16_t mv;
+    uint8_t soc;
+} batt_ocv_table[] = {
+    {3300, 0},  {3450, 5},  {3680, 10}, {3740, 20}, {3770, 30},  {3790, 40},
+    {3820, 50}, {3870, 60}, {3920, 70}, {3980, 80}, {4060, 90}, {4200, 100},
+};
+
+#define BATT_OCV_POINTS (sizeof(batt_ocv_table) / sizeof(batt_ocv_table[0]))
+
+/**
+ * @brief State of charge of the cell at a rest voltage, in %.
+ */
+static uint8_t batt_soc_from_mv(uint16_t mv) {
+    if (mv <= batt_ocv_table[0].mv) return 0;
+
+    for (uint32_t i = 1; i < BATT_OCV_POINTS; i++) {
+        if (mv < batt_ocv_table[i].mv) {
+            uint16_t mv0 = batt_ocv_table[i - 1].mv;
+            uint8_t soc0 = batt_ocv_table[i - 1].soc;
+            return soc0 + (mv - mv0) * (batt_ocv_table[i].soc - soc0) /
+                              (batt_ocv_table[i].mv - mv0);
+        }
+    }
+    return 100;
+}
+
+/**
+ * @brief Rest voltage of the cell at a state of charge in %.
+ */
+static uint16_t batt_mv_from_soc(uint8_t soc) {
+    for (uint32_t i = 1; i < BATT_OCV_POINTS; i++) {
+        if (soc <= batt_ocv_table[i].soc) {
+            uint16_t mv0 = batt_ocv_table[i - 1].mv;
+            uint8_t soc0 = batt_ocv_table[i - 1].soc;
+            return mv0 + (soc - soc0) * (batt_ocv_table[i].mv - mv0) /
+                             (batt_ocv_table[i].soc - soc0);
+        }
+    }
+    return batt_ocv_table[BATT_OCV_POINTS - 1].mv;
+}
+
+/**
+ * @brief Reconfigure the ADC left by MX_ADC1_Init for the battery readings,
+ * once per wake. The ADC runs from the bus clock, since no asynchronous ADC
+ * clock is selected, and sums BATT_ADC_OVERSAMPLING samples per conversion.
+ * The offset calibration is lost in standby, so it is redone every wake.
+ *
+ * @return true if the ADC can be used
+ */
+static bool batt_adc_setup() {
+    if (batt_adc_ready) return true;
+
+    hadc1.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV1;
+    hadc1.Init.OversamplingMode = ENABLE;
+    hadc1.Init.Oversampling.Ratio = ADC_OVERSAMPLING_RATIO_16;
+    hadc1.Init.Oversampling.RightBitShift = ADC_RIGHTBITSHIFT_NONE;
+    hadc1.Init.Oversampling.TriggeredMode = ADC_TRIGGEREDMODE_SINGLE_TRIGGER;
+    hadc1.Init.Oversampling.OversamplingStopReset =
+        ADC_REGOVERSAMPLING_CONTINUED_MODE;
+    if (HAL_ADC_Init(&hadc1) != HAL_OK) return false;
+    if (HAL_ADCEx_Calibration_Start(&hadc1, ADC_SINGLE_ENDED) != HAL_OK) {
+        return false;
+    }
+
+    batt_adc_ready = true;
+    return true;
+}
+
+/**
+ * @brief Convert a channel, BATT_ADC_OVERSAMPLING samples summed in hardware.
+ *
+ * @return the sum of the samples, 0 on error
+ */
+static uint32_t batt_adc_read(uint32_t channel) {
+    ADC_ChannelConfTypeDef sConfig = {0};
+    uint32_t value = 0;
+
+    if (!batt_adc_setup()) return 0;
+
+    // long enough for VREFINT at any clock, and for the divider's impedance
+    sConfig.Channel = channel;
+    sConfig.Rank = ADC_REGULAR_RANK_1;
+    sConfig.SamplingTime = ADC_SAMPLETIME_640CYCLES_5;
+    sConfig.SingleDiff = ADC_SINGLE_ENDED;
+    sConfig.OffsetNumber = ADC_OFFSET_NONE;
+    sConfig.Offset = 0;
+    if (HAL_ADC_ConfigChannel(&hadc1, &sConfig) != HAL_OK) return 0;
+
+    HAL_ADC_Start(&hadc1);
+    if (HAL_ADC_PollForConversion(&hadc1, 100) == HAL_OK) {
+        value = HAL_ADC_GetValue(&hadc1);
+    }
+    HAL_ADC_Stop(&hadc1);
+
+    return value;
+}
+
+/**
+ * @brief Enable the voltage divider and read the battery voltage. The ADC
+ * supply is measured against VREFINT and its factory calibration, so the
+ * reading doesn't depend on the regulator's tolerance.
+ *
+ * @param vdda_mv: set to the measured ADC supply
+ * @return the battery voltage in mV
+ */
+static uint16_t batt_read_mv(uint16_t* vdda_mv) {
+    HAL_GPIO_WritePin(BATT_VDIV_EN_GPIO_Port, BATT_VDIV_EN_Pin, GPIO_PIN_SET);
+    HAL_Delay(10);
+
+    uint32_t vrefint = batt_adc_read(ADC_CHANNEL_VREFINT);
+    uint32_t batt = batt_adc_read(ADC_CHANNEL_16);
+
+    HAL_GPIO_WritePin(BATT_VDIV_EN_GPIO_Port, BATT_VDIV_EN_Pin,
+                      GPIO_PIN_RESET);
+
+    *vdda_mv = 3300;  // nominal supply if VREFINT couldn't be converted
+    if (vrefint != 0) {
+        *vdda_mv = VREFINT_CAL_VREF * (uint32_t)*VREFINT_CAL_ADDR *
+                   BATT_ADC_OVERSAMPLING / vrefint;
+    }
+
+    return (uint16_t)((double)*vdda_mv * batt / BATT_ADC_FULL_SCALE *
+                          BATT_VDIV_RATIO +
+                      0.5);
+}
+
+/**
+ * @brief Update the smoothed rest voltage trend once enough time has passed
+ * since the reading it was last taken from.
+ */
+static void batt_update_trend(struct fram_batt_state_t* state) {
+    uint32_t now = rtc_get_seconds();
+
+    // first reading, or the calendar restarted after a power loss
+    if (state->sample_mv == 0 || now < state->sample_time) {
+        state->sample_mv = batt_status.mv;
+        state->sample_time = now;
+        return;
+    }
+
+    uint32_t elapsed = now - state->sample_time;
+    if (elapsed < BATT_TREND_MIN_SECONDS) return;
+
+    int32_t change = ((int32_t)batt_status.mv - state->sample_mv) *
+                     (24L * 60 * 60) / (int32_t)elapsed;
+    int32_t trend = state->trend_mv_per_day +
+                    (change - state->trend_mv_per_day) / BATT_TREND_WEIGHT;
+    if (trend > INT16_MAX) trend = INT16_MAX;
+    if (trend < INT16_MIN) trend = INT16_MIN;
+
+    state->trend_mv_per_day = trend;
+    state->sample_mv = batt_status.mv;
+    state->sample_time = now;
+}
+
+/**
+ * @brief Measure the battery at rest and estimate how much charge is left
+ * for refreshes. The cell counts as empty once the drop under panel refresh
+ * load, measured by batt_measure_load on earlier refreshes, would take it
+ * below BATT_MIN_LOADED_MV.
+ *
+ * @return true if there is enough charge for a refresh
+ */
+bool batt_measure() {
+    struct fram_batt_state_t state;
+    fram_get_batt_state(&state);
+
+    batt_status.mv = batt_read_mv(&batt_status.vdda_mv);
+    batt_status.sag_mv = state.sag_mv ? state.sag_mv : BATT_SAG_DEFAULT_MV;
+    batt_status.soc = batt_soc_from_mv(batt_status.mv);
+
+    int required_soc =
+        batt_soc_from_mv(BATT_MIN_LOADED_MV + batt_status.sag_mv) +
+        BATT_RESERVE_PCT;
+    if (required_soc > 100) required_soc = 100;
+    batt_status.required_mv = batt_mv_from_soc(required_soc);
+    batt_status.headroom = batt_status.soc - required_soc;
+
+    batt_update_trend(&state);
+    batt_status.trend_mv_per_day = state.trend_mv_per_day;
+    fram_set_batt_state(&state);
+
+    TRACE2(TRACE_BATT_VDDA, batt_status.vdda_mv, batt_status.sag_mv);
+    TRACE3(TRACE_BATT_STATE, batt_status.soc, batt_status.headroom,
+           batt_status.trend_mv_per_day);
+
+    return batt_status.mv > batt_status.required_mv;
+}
+
+/**
+ * @brief Measure the battery while the panel refreshes, to learn how far
+ * its load pulls the voltage down. Called after batt_measure, while the
+ * panel is busy.
+ */
+void batt_measure_load() {
+    struct fram_batt_state_t state;
+    uint16_t vdda_mv;
+
+    uint16_t loaded_mv = batt_read_mv(&vdda_mv);
+    uint16_t sag = loaded_mv < batt_status.mv ? batt_status.mv - loaded_mv : 0;
+    if (sag == 0) sag = 1;  // 0 is kept for unknown
+
+    fram_get_batt_state(&state);
+    state.sag_mv =
+        state.sag_mv ? (state.sag_mv * 3 + sag + 2) / 4 : sag;  // smoothed
+    fram_set_batt_state(&state);
+    batt_status.sag_mv = state.sag_mv;
+
+    TRACE2(TRACE_BATT_SAG, loaded_mv, sag);
+}
+
+/**
+ * @brief Whether the battery has been charging over the last wakes, e.g.
+ * from the energy harvester.
+ */
+bool batt_charging() {
+    return batt_status.trend_mv_per_day > BATT_CHARGING_MV_PER_DAY;
+}
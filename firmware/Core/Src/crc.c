@@ -0,0 +1,48 @@
+#include "crc.h"
+
+#include "main.h"
+#include "stm32l4xx_hal.h"
+
+/**
+ * CRC-32 as used by zlib, computed by the CRC unit. Only one computation can
+ * run at a time.
+ *
+ * The unit's default polynomial and initial value match, the input is
+ * bit-reversed per byte and the output reversed, and the final inversion is
+ * done in crc_result. Words are written byte swapped, so bytes go in in
+ * memory order, as HAL_CRC_Accumulate does with byte input.
+ */
+
+/**
+ * @brief Start a new CRC computation.
+ */
+void crc_start() {
+    __HAL_RCC_CRC_CLK_ENABLE();
+
+    CRC->POL = 0x04C11DB7;
+    CRC->INIT = 0xFFFFFFFF;
+    CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+}
+
+/**
+ * @brief Add bytes to the CRC. Runs from SRAM2, as it is called for every
+ * byte of an image.
+ */
+RAM2FUNC void crc_update(const uint8_t* data, uint32_t len) {
+    while (len > 0 && ((uintptr_t)data & 3) != 0) {
+        *(__IO uint8_t*)&CRC->DR = *data++;
+        len--;
+    }
+    for (; len >= 4; len -= 4, data += 4) {
+        CRC->DR = __REV(*(const uint32_t*)data);
+    }
+    while (len > 0) {
+        *(__IO uint8_t*)&CRC->DR = *data++;
+        len--;
+    }
+}
+
+/**
+ * @brief CRC of the bytes added since crc_start.
+ */
+uint32_t crc_result() { return ~CRC->DR; }
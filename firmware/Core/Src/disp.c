@@ -3,11 +3,14 @@
 
 #include "aeon.h"
 #include "main.h"
+#include "power.h"
+#include "profile.h"
 #include "stm32l4xx_hal.h"
+#include "trace.h"
 
 // extern SPI_HandleTypeDef hspi1;
 
-static void disp_write_byte(uint8_t value) {
+RAM2FUNC static void disp_write_byte(uint8_t value) {
     HAL_SPI_Transmit(&hspi1, &value, 1, 1000);
 }
 
@@ -18,13 +21,31 @@ void disp_send_command(uint8_t reg) {
     SET_DISP_CS(1);
 }
 
-void disp_send_data(uint8_t data) {
+RAM2FUNC void disp_send_data(uint8_t data) {
     SET_DISP_DC(1);
     SET_DISP_CS(0);
     disp_write_byte(data);
     SET_DISP_CS(1);
 }
 
+/**
+ * @brief Send a run of frame data, two 4-bit pixels per byte. The panel takes
+ * data bytes back to back while it stays selected, so the run is sent as one
+ * block instead of a HAL call and chip select toggle per byte. Runs from
+ * SRAM2 with the HAL functions it uses, as it sends every byte of a frame.
+ */
+RAM2FUNC void disp_send_pixels(const uint8_t* data, uint32_t len) {
+    SET_DISP_DC(1);
+    SET_DISP_CS(0);
+    while (len > 0) {
+        uint16_t block = len > UINT16_MAX ? UINT16_MAX : len;
+        HAL_SPI_Transmit(&hspi1, data, block, 1000);
+        data += block;
+        len -= block;
+    }
+    SET_DISP_CS(1);
+}
+
 void disp_init() {
     SET_DISP_DC(0);
     spi_device_select(AEON_SPI_DISP);
@@ -41,15 +62,20 @@ static void disp_reset(void) {
 }
 
 static void disp_wait_busy(void) {
+    // nothing else runs while the panel is busy
+    enum power_mode_t mode = power_set_mode(POWER_MODE_LOW);
     int tick = HAL_GetTick();
+    profile_start(PROFILE_DISP_BUSY);
 
     while (!GET_DISP_BUSY()) {  // LOW: busy, HIGH: idle
         HAL_Delay(1);
         if (HAL_GetTick() - tick > 60000) {
-            if (DBG) printf("ERROR: Display busy timeout\n");
+            TRACE0(TRACE_DISP_BUSY_TIMEOUT);
             break;
         }
     }
+    profile_stop(PROFILE_DISP_BUSY);
+    power_set_mode(mode);
 }
 
 void disp_init_regs(void) {
@@ -143,12 +169,24 @@ void disp_init_regs(void) {
     disp_send_data(0x00);
 }
 
-void disp_turn_on() {
+/**
+ * @brief Start refreshing the panel from the transferred frame. The refresh
+ * takes several seconds, during which SPI may be used for other devices
+ * until disp_turn_on_wait is called.
+ */
+void disp_turn_on_start() {
     disp_send_command(0x04);  // POWER_ON
     disp_wait_busy();
 
     disp_send_command(0x12);  // DISPLAY_REFRESH
     disp_send_data(0x00);
+}
+
+/**
+ * @brief Wait for the refresh started by disp_turn_on_start, then power off
+ * the panel.
+ */
+void disp_turn_on_wait() {
     disp_wait_busy();
 
     disp_send_command(0x02);  // POWER_OFF
@@ -156,6 +194,11 @@ void disp_turn_on() {
     disp_wait_busy();
 }
 
+void disp_turn_on() {
+    disp_turn_on_start();
+    disp_turn_on_wait();
+}
+
 void disp_clear(uint8_t color) {
     int width = 400;
     int height = 480;
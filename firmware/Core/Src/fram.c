@@ -1,24 +1,82 @@
 #include "fram.h"
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "aeon.h"
 #include "main.h"
 #include "stm32l4xx_hal.h"
 
-#define FRAM_IMG_COUNTER_ADDR 0
-#define FRAM_IMG_COUNTER_SIZE 4
+// Layout used before the state record was introduced, only read to migrate
+// existing devices
+#define FRAM_LEGACY_ADDR 0
+#define FRAM_LEGACY_SIZE 27
+#define FRAM_LEGACY_IMG_COUNTER_ADDR 0
+#define FRAM_LEGACY_SLEEP_DURATION_ADDR 8
+#define FRAM_LEGACY_WAKE_CYCLE_COUNT_ADDR 16
+#define FRAM_LEGACY_INTERVAL_SW_ADDR 24
+#define FRAM_LEGACY_STATUS_BYTE_ADDR 26
+
+// The state record is double buffered in two slots. Each commit goes to the
+// slot not holding the current record, so a power failure mid-write always
+// leaves one valid copy behind.
+#define FRAM_STATE_SLOT_A_ADDR 0x100
+#define FRAM_STATE_SLOT_SIZE 0x80
+#define FRAM_STATE_MAGIC 0xAE01
+
+// The image prepared for the next refresh is kept apart from the state
+// record, between the legacy layout and the slots. It is written when
+// prepared and cleared when used, rather than with each commit.
+#define FRAM_NEXT_IMAGE_ADDR 0x20
+#define FRAM_NEXT_IMAGE_MAGIC 0xAE02
+
+#define FRAM_STATUS_UNSAFE_SHUTDOWN 0x01
+#define FRAM_STATUS_SLEEP_REASON_MASK 0x0E
 
-#define FRAM_SLEEP_DURATION_ADDR 8
-#define FRAM_SLEEP_DURATION_SIZE 4
-
-#define FRAM_WAKE_CYCLE_COUNT_ADDR 16
-#define FRAM_WAKE_CYCLE_COUNT_SIZE 4
-
-#define FRAM_INTERVAL_SW_ADDR 24
-#define FRAM_INTERVAL_SW_SIZE 2
-
-#define FRAM_STATUS_BYTE_ADDR 26
+/**
+ * Persistent device state, read in one burst at boot and written in one burst
+ * when committed. New fields must only be appended: records written by older
+ * firmware are accepted and the missing fields read as zero.
+ */
+struct __attribute__((packed)) fram_state_t {
+    uint16_t magic;
+    uint16_t crc;     // CRC-16/CCITT of the bytes after this field, up to size
+    uint8_t size;     // sizeof(struct fram_state_t) when the record was written
+    uint8_t status;   // bit 0: unsafe shutdown, bits 1-3: sleep reason
+    uint16_t interval_sw;
+    uint32_t seq;     // incremented on each commit, the newest valid slot wins
+    uint32_t image_counter;
+    uint32_t sleep_duration;
+    uint32_t wake_cycle_count;
+    uint32_t shuffle_seed;      // key of the current shuffle permutation
+    uint32_t shuffle_position;  // next position in the shuffled sequence
+    uint32_t shuffle_count;     // image count the permutation was made for
+    uint32_t album_sclust;      // start cluster of the album if contiguous
+    uint32_t album_size;        // size of the album when it was checked
+    struct fram_log_state_t log_state[FRAM_LOG_COUNT];  // SD ring log heads
+    struct fram_batt_state_t batt_state;  // battery sag and trend
+    struct fram_sched_state_t sched_state;  // harvest history
+    uint32_t log_volume;  // serial of the volume holding the log files
+};
+
+_Static_assert(sizeof(struct fram_state_t) <= FRAM_STATE_SLOT_SIZE,
+               "FRAM state record does not fit in its slot");
+
+struct fram_next_image_record_t {
+    uint16_t magic;
+    uint16_t crc;  // CRC-16/CCITT of next
+    struct fram_next_image_t next;
+};
+
+_Static_assert(FRAM_NEXT_IMAGE_ADDR >= FRAM_LEGACY_ADDR + FRAM_LEGACY_SIZE &&
+                   FRAM_NEXT_IMAGE_ADDR +
+                           sizeof(struct fram_next_image_record_t) <=
+                       FRAM_STATE_SLOT_A_ADDR,
+               "FRAM next image record overlaps another area");
+
+static struct fram_state_t fram_state;
+static uint8_t fram_state_slot = 1;  // slot holding the current record
 
 /**
  * @brief Write bytes to FRAM at the specified address.
@@ -27,7 +85,7 @@
  * @param address: address in FRAM to write to (0 - 511)
  * @param size: number of bytes to write
  */
-bool fram_write_bytes(uint8_t* buffer, uint16_t address, int size) {
+static bool fram_write_bytes(uint8_t* buffer, uint16_t address, int size) {
     spi_device_select(AEON_SPI_FRAM);
 
     uint8_t txBuffer[2];
@@ -64,7 +122,7 @@ bool fram_write_bytes(uint8_t* buffer, uint16_t address, int size) {
  * @param address: address in FRAM to read from (0 - 511)
  * @param size: number of bytes to read
  */
-bool fram_read_bytes(uint8_t* buffer, uint16_t address, int size) {
+static bool fram_read_bytes(uint8_t* buffer, uint16_t address, int size) {
     spi_device_select(AEON_SPI_FRAM);
 
     uint8_t txBuffer[2] = {0x03 | ((address & 0x100) >> 5), (address & 0xFF)};
@@ -81,144 +139,342 @@ bool fram_read_bytes(uint8_t* buffer, uint16_t address, int size) {
     return true;
 }
 
+static uint16_t crc16_ccitt(const uint8_t* data, int len) {
+    uint16_t crc = 0xFFFF;
+    while (len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
 /**
- * @brief Write image counter to FRAM.
- *
- * @param counter: image counter value to write
+ * @brief Check a state record read from one of the slots.
  */
-void fram_set_image_counter(uint32_t counter) {
-    fram_write_bytes((uint8_t*)&counter, FRAM_IMG_COUNTER_ADDR,
-                     FRAM_IMG_COUNTER_SIZE);
+static bool fram_state_valid(const uint8_t* record) {
+    const struct fram_state_t* state = (const struct fram_state_t*)record;
+    if (state->magic != FRAM_STATE_MAGIC) return false;
+    if (state->size < offsetof(struct fram_state_t, seq) + 4 ||
+        state->size > sizeof(struct fram_state_t))
+        return false;
+
+    return state->crc == crc16_ccitt(record + 4, state->size - 4);
 }
 
 /**
- * @brief Read image counter from FRAM and return value.
+ * @brief Import the per-field layout written by older firmware.
  */
-uint32_t fram_get_image_counter() {
-    uint32_t image_counter;
-    fram_read_bytes((uint8_t*)&image_counter, FRAM_IMG_COUNTER_ADDR,
-                    FRAM_IMG_COUNTER_SIZE);
-    return image_counter;
+static void fram_state_migrate_legacy() {
+    uint8_t legacy[FRAM_LEGACY_SIZE];
+    if (!fram_read_bytes(legacy, FRAM_LEGACY_ADDR, sizeof(legacy))) return;
+
+    memcpy(&fram_state.image_counter, &legacy[FRAM_LEGACY_IMG_COUNTER_ADDR],
+           4);
+    memcpy(&fram_state.sleep_duration,
+           &legacy[FRAM_LEGACY_SLEEP_DURATION_ADDR], 4);
+    memcpy(&fram_state.wake_cycle_count,
+           &legacy[FRAM_LEGACY_WAKE_CYCLE_COUNT_ADDR], 4);
+    memcpy(&fram_state.interval_sw, &legacy[FRAM_LEGACY_INTERVAL_SW_ADDR], 2);
+    fram_state.status = legacy[FRAM_LEGACY_STATUS_BYTE_ADDR];
 }
 
 /**
- * @brief Write interval switch value to FRAM.
+ * @brief Read the state record from FRAM. Both slots are fetched in a single
+ * transaction and the newest valid one is kept in RAM. Must be called before
+ * any of the accessors below.
  *
- * @param value: interval switch value to write
+ * @return true if a valid record was found
  */
-void fram_set_interval_sw_value(uint16_t value) {
-    fram_write_bytes((uint8_t*)&value, FRAM_INTERVAL_SW_ADDR,
-                     FRAM_INTERVAL_SW_SIZE);
+bool fram_state_load() {
+    uint8_t buf[FRAM_STATE_SLOT_SIZE + sizeof(struct fram_state_t)];
+
+    memset(&fram_state, 0, sizeof(fram_state));
+    fram_state_slot = 1;
+
+    if (!fram_read_bytes(buf, FRAM_STATE_SLOT_A_ADDR, sizeof(buf))) {
+        return false;
+    }
+
+    uint8_t* slot_a = buf;
+    uint8_t* slot_b = buf + FRAM_STATE_SLOT_SIZE;
+    bool valid_a = fram_state_valid(slot_a);
+    bool valid_b = fram_state_valid(slot_b);
+
+    if (valid_a && valid_b) {
+        // signed difference handles the sequence number wrapping around
+        int32_t diff = (int32_t)(((struct fram_state_t*)slot_b)->seq -
+                                 ((struct fram_state_t*)slot_a)->seq);
+        fram_state_slot = diff > 0 ? 1 : 0;
+    } else if (valid_a || valid_b) {
+        fram_state_slot = valid_a ? 0 : 1;
+    } else {
+        fram_state_migrate_legacy();
+        return false;
+    }
+    uint8_t* record = fram_state_slot ? slot_b : slot_a;
+
+    memcpy(&fram_state, record, ((struct fram_state_t*)record)->size);
+    return true;
 }
 
 /**
- * @brief Read interval switch value from FRAM and return value.
+ * @brief Write the RAM copy of the state record to FRAM, in the slot not
+ * holding the previous record.
  */
-uint16_t fram_get_interval_sw_value() {
-    uint16_t value;
-    fram_read_bytes((uint8_t*)&value, FRAM_INTERVAL_SW_ADDR,
-                    FRAM_INTERVAL_SW_SIZE);
-    return value;
+bool fram_state_commit() {
+    uint8_t slot = fram_state_slot ^ 1;
+
+    fram_state.magic = FRAM_STATE_MAGIC;
+    fram_state.size = sizeof(struct fram_state_t);
+    fram_state.seq++;
+    fram_state.crc =
+        crc16_ccitt((uint8_t*)&fram_state + 4, sizeof(struct fram_state_t) - 4);
+
+    if (!fram_write_bytes((uint8_t*)&fram_state,
+                          FRAM_STATE_SLOT_A_ADDR + slot * FRAM_STATE_SLOT_SIZE,
+                          sizeof(struct fram_state_t))) {
+        return false;
+    }
+
+    fram_state_slot = slot;
+    return true;
 }
 
 /**
- * @brief Write remaining sleep iterations to FRAM.
+ * @brief Set image counter in the state record.
  *
- * @param remaining_iterations: remaining sleep iterations to write
+ * @param counter: image counter value to write
  */
-void fram_set_sleep_duration(uint32_t remaining_iterations) {
-    fram_write_bytes((uint8_t*)&remaining_iterations, FRAM_SLEEP_DURATION_ADDR,
-                     FRAM_SLEEP_DURATION_SIZE);
+void fram_set_image_counter(uint32_t counter) {
+    fram_state.image_counter = counter;
 }
 
 /**
- * @brief Read remaining sleep iterations from FRAM and return value.
+ * @brief Get image counter from the state record.
  */
-uint32_t fram_get_sleep_duration() {
-    uint32_t remaining_iterations;
-    fram_read_bytes((uint8_t*)&remaining_iterations, FRAM_SLEEP_DURATION_ADDR,
-                    FRAM_SLEEP_DURATION_SIZE);
-    return remaining_iterations;
-}
+uint32_t fram_get_image_counter() { return fram_state.image_counter; }
 
 /**
- * @brief Get the status byte from FRAM.
+ * @brief Set interval switch value in the state record.
+ *
+ * @param value: interval switch value to write
  */
-uint8_t fram_get_status_byte() {
-    uint8_t status_byte = 0;
-    fram_read_bytes((uint8_t*)&status_byte, FRAM_STATUS_BYTE_ADDR, 1);
-    return status_byte;
+void fram_set_interval_sw_value(uint16_t value) {
+    fram_state.interval_sw = value;
 }
 
 /**
- * @brief Set the status byte in FRAM.
+ * @brief Get interval switch value from the state record.
+ */
+uint16_t fram_get_interval_sw_value() { return fram_state.interval_sw; }
+
+/**
+ * @brief Set remaining sleep duration in the state record.
  *
- * @param status_byte: status byte to write
+ * @param remaining_iterations: remaining sleep duration to write
  */
-void fram_set_status_byte(uint8_t status_byte) {
-    fram_write_bytes((uint8_t*)&status_byte, FRAM_STATUS_BYTE_ADDR, 1);
+void fram_set_sleep_duration(uint32_t remaining_iterations) {
+    fram_state.sleep_duration = remaining_iterations;
 }
 
+/**
+ * @brief Get remaining sleep duration from the state record.
+ */
+uint32_t fram_get_sleep_duration() { return fram_state.sleep_duration; }
+
 /**
  * @brief Set the unsafe shutdown flag in the status byte.
  *
  * @param unsafe_shutdown: true to set the flag, false to clear it
  */
 void fram_set_unsafe_shutdown(bool unsafe_shutdown) {
-    uint8_t status_byte = fram_get_status_byte();
-    status_byte = unsafe_shutdown ? status_byte | 0x01 : status_byte & 0xFE;
-    fram_set_status_byte(status_byte);
+    if (unsafe_shutdown) {
+        fram_state.status |= FRAM_STATUS_UNSAFE_SHUTDOWN;
+    } else {
+        fram_state.status &= ~FRAM_STATUS_UNSAFE_SHUTDOWN;
+    }
 }
 
 /**
- * @brief Get the unsafe shutdown flag from the status byte, and set stored
- * value to true.
+ * @brief Get the unsafe shutdown flag from the status byte, and set the flag.
+ * The caller must commit the record for the flag to be stored.
  */
 bool fram_sys_start_unsafe_shutdown_update() {
-    uint8_t status_byte = fram_get_status_byte();
-    bool prev_unsafe_shutdown = status_byte & 0x01;
-    fram_set_status_byte(status_byte | 0x01);
+    bool prev_unsafe_shutdown = fram_state.status & FRAM_STATUS_UNSAFE_SHUTDOWN;
+    fram_state.status |= FRAM_STATUS_UNSAFE_SHUTDOWN;
 
     return prev_unsafe_shutdown;
 }
 
-// bool fram_get_unsafe_shutdown(){
-//     uint8_t status_byte = fram_get_status_byte();
-//     return status_byte & 0x01;
-// }
-
 /**
  * @brief Set the sleep reason in the status byte.
  *
  * @param reason: sleep reason to write
  */
 void fram_set_sleep_reason(enum sleep_reason_t reason) {
-    uint8_t status_byte = fram_get_status_byte() & 0b11110001;
-    status_byte = (status_byte & 0b00001110) | (reason << 1);
-    fram_set_status_byte(status_byte);
+    fram_state.status = (fram_state.status & ~FRAM_STATUS_SLEEP_REASON_MASK) |
+                        ((reason << 1) & FRAM_STATUS_SLEEP_REASON_MASK);
 }
 
 /**
  * @brief Get the sleep reason from the status byte.
  */
 enum sleep_reason_t fram_get_sleep_reason() {
-    uint8_t status_byte = fram_get_status_byte();
-    return (status_byte & 0b00001110) >> 1;
+    return (fram_state.status & FRAM_STATUS_SLEEP_REASON_MASK) >> 1;
 }
 
 /**
- * Get the wake cycle count from FRAM, store incremented value and return the
- * value for current iteration.
+ * Get the wake cycle count, increment the stored value and return the value
+ * for current iteration.
  */
 uint32_t fram_sys_wake_cycle_count_update() {
-    uint32_t wake_cycle_iteration;
+    return fram_state.wake_cycle_count++;
+}
+
+/**
+ * @brief Set the shuffle permutation state in the state record.
+ *
+ * @param seed: key of the permutation
+ * @param position: next position in the shuffled sequence
+ * @param count: image count the permutation covers
+ */
+void fram_set_shuffle_state(uint32_t seed, uint32_t position, uint32_t count) {
+    fram_state.shuffle_seed = seed;
+    fram_state.shuffle_position = position;
+    fram_state.shuffle_count = count;
+}
+
+/**
+ * @brief Get the shuffle permutation state from the state record.
+ */
+void fram_get_shuffle_state(uint32_t* seed, uint32_t* position,
+                            uint32_t* count) {
+    *seed = fram_state.shuffle_seed;
+    *position = fram_state.shuffle_position;
+    *count = fram_state.shuffle_count;
+}
+
+/**
+ * @brief Store the location of a contiguous album file, or 0 to clear it.
+ *
+ * @param sclust: start cluster of the album
+ * @param size: size of the album in bytes
+ */
+void fram_set_album_layout(uint32_t sclust, uint32_t size) {
+    fram_state.album_sclust = sclust;
+    fram_state.album_size = size;
+}
+
+/**
+ * @brief Get the location of the album file when it was last found to be
+ * contiguous.
+ */
+void fram_get_album_layout(uint32_t* sclust, uint32_t* size) {
+    *sclust = fram_state.album_sclust;
+    *size = fram_state.album_size;
+}
+
+/**
+ * @brief Store the position of a ring log file on the SD card.
+ *
+ * @param log: index of the log, below FRAM_LOG_COUNT
+ * @param state: log file location and write position
+ */
+void fram_set_log_state(uint8_t log, const struct fram_log_state_t* state) {
+    if (log < FRAM_LOG_COUNT) fram_state.log_state[log] = *state;
+}
+
+/**
+ * @brief Get the position of a ring log file on the SD card.
+ */
+void fram_get_log_state(uint8_t log, struct fram_log_state_t* state) {
+    if (log < FRAM_LOG_COUNT) {
+        *state = fram_state.log_state[log];
+    } else {
+        memset(state, 0, sizeof(*state));
+    }
+}
+
+/**
+ * @brief Store the serial number of the volume the ring log positions refer
+ * to.
+ */
+void fram_set_log_volume(uint32_t serial) { fram_state.log_volume = serial; }
+
+/**
+ * @brief Get the serial number of the volume the ring log positions refer
+ * to, 0 if unknown.
+ */
+uint32_t fram_get_log_volume() { return fram_state.log_volume; }
 
-    fram_read_bytes((uint8_t*)&wake_cycle_iteration, FRAM_WAKE_CYCLE_COUNT_ADDR,
-                    FRAM_WAKE_CYCLE_COUNT_SIZE);
+/**
+ * @brief Store the battery readings kept for the next wakes.
+ */
+void fram_set_batt_state(const struct fram_batt_state_t* state) {
+    fram_state.batt_state = *state;
+}
+
+/**
+ * @brief Get the battery readings kept by previous wakes, zeroed if there
+ * are none.
+ */
+void fram_get_batt_state(struct fram_batt_state_t* state) {
+    *state = fram_state.batt_state;
+}
 
-    uint32_t new_wake_cycle_iteration = wake_cycle_iteration + 1;
-    fram_write_bytes((uint8_t*)&new_wake_cycle_iteration,
-                     FRAM_WAKE_CYCLE_COUNT_ADDR, FRAM_WAKE_CYCLE_COUNT_SIZE);
+/**
+ * @brief Store the harvest history kept for the next wakes.
+ */
+void fram_set_sched_state(const struct fram_sched_state_t* state) {
+    fram_state.sched_state = *state;
+}
+
+/**
+ * @brief Get the harvest history kept by previous wakes, zeroed if there is
+ * none.
+ */
+void fram_get_sched_state(struct fram_sched_state_t* state) {
+    *state = fram_state.sched_state;
+}
 
-    return wake_cycle_iteration;
-}
\ No newline at end of file
+/**
+ * @brief Store the image to show on the next refresh, or clear it if next is
+ * NULL. Written to FRAM straight away.
+ */
+void fram_set_next_image(const struct fram_next_image_t* next) {
+    struct fram_next_image_record_t record = {0};
+
+    if (next == NULL) {
+        // an invalid magic is enough to clear the record
+        fram_write_bytes((uint8_t*)&record, FRAM_NEXT_IMAGE_ADDR,
+                         sizeof(record.magic));
+        return;
+    }
+
+    record.magic = FRAM_NEXT_IMAGE_MAGIC;
+    record.next = *next;
+    record.crc = crc16_ccitt((uint8_t*)&record.next, sizeof(record.next));
+    fram_write_bytes((uint8_t*)&record, FRAM_NEXT_IMAGE_ADDR, sizeof(record));
+}
+
+/**
+ * @brief Get the image picked for this refresh by the previous one.
+ *
+ * @return false if there is none
+ */
+bool fram_get_next_image(struct fram_next_image_t* next) {
+    struct fram_next_image_record_t record;
+
+    if (!fram_read_bytes((uint8_t*)&record, FRAM_NEXT_IMAGE_ADDR,
+                         sizeof(record)) ||
+        record.magic != FRAM_NEXT_IMAGE_MAGIC ||
+        record.crc !=
+            crc16_ccitt((uint8_t*)&record.next, sizeof(record.next))) {
+        return false;
+    }
+
+    *next = record.next;
+    return next->dir_sect != 0 || next->sclust != 0;
+}
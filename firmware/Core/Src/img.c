@@ -0,0 +1,233 @@
+#include "img.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc.h"
+#include "disp.h"
+#include "trace.h"
+
+static struct img_t* img_slic_img;  // image set up by img_slic_init
+
+static int img_slic_open(const char* filename, SLICFILE* file) {
+    file->fHandle = img_slic_img;
+    return SLIC_SUCCESS;
+}
+
+static int img_slic_read(SLICFILE* file, uint8_t* buf, int32_t len) {
+    return img_read(file->fHandle, buf, len);
+}
+
+/**
+ * @brief Read the SLIC header from the payload. Its pixels must be bytes
+ * holding two panel pixels each, filling exactly one frame.
+ */
+static bool img_slic_init(struct img_t* img) {
+    SLICSTATE* slic = &img->state.slic;
+
+    img_slic_img = img;
+    int rc = slic_init_decode(NULL, slic, NULL, 0, NULL, img_slic_open,
+                              img_slic_read);
+    if (rc != SLIC_SUCCESS) return false;
+
+    return slic->bpp == 8 &&
+           (uint32_t)slic->width * slic->height == DISP_FRAME_SIZE;
+}
+
+static uint32_t img_slic_decode(struct img_t* img, uint8_t* out,
+                                uint32_t len) {
+    int rc = slic_decode(&img->state.slic, out, len);
+    return rc == SLIC_SUCCESS || rc == SLIC_DONE ? len : 0;
+}
+
+static bool img_raw_init(struct img_t* img) {
+    return img->header.payload_size == DISP_FRAME_SIZE;
+}
+
+/**
+ * @brief The payload is the frame data itself, so it is read straight into
+ * the output. Reads are cut to whole sectors, which FatFs reads from the card
+ * in one multiple block read without copying them through its sector buffer,
+ * as long as the payload starts on a sector boundary.
+ */
+static uint32_t img_raw_decode(struct img_t* img, uint8_t* out, uint32_t len) {
+    if (len >= _MIN_SS) len -= len % _MIN_SS;
+    return img_read(img, out, len) == (int32_t)len ? len : 0;
+}
+
+// Decoder registry, one entry per codec
+static const struct img_decoder_t img_decoders[] = {
+    {IMG_CODEC_SLIC, img_slic_init, img_slic_decode},
+    {IMG_CODEC_RAW, img_raw_init, img_raw_decode},
+};
+
+#define IMG_DECODER_COUNT (sizeof(img_decoders) / sizeof(img_decoders[0]))
+
+static const struct img_decoder_t* img_find_decoder(uint8_t codec) {
+    for (uint32_t i = 0; i < IMG_DECODER_COUNT; i++) {
+        if (img_decoders[i].codec == codec) return &img_decoders[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Read and check the container header of an image, and seek to its
+ * payload. A bad header, an unknown codec, a geometry other than the panel's
+ * or a payload running past the end of the image are all found here, before
+ * the panel is touched.
+ *
+ * Images converted before the container was introduced start with the SLIC
+ * header instead. They are read as a SLIC payload filling the whole image,
+ * with header version 0, checked against the catalog CRC if there is one.
+ *
+ * @param fp: image file, positioned at the start of the image
+ * @param image: location of the image from sd_open_next_image
+ * @param header: filled with the header
+ * @return true if the image can be decoded, fp is then at the payload
+ */
+bool img_read_header(FIL* fp, const struct sd_image_t* image,
+                     struct img_header_t* header) {
+    UINT bytesRead;
+
+    uint32_t available =
+        image->size != 0 ? image->size : f_size(fp) - image->offset;
+
+    memset(header, 0, sizeof(*header));
+    if (f_read(fp, header, sizeof(*header), &bytesRead) != FR_OK ||
+        bytesRead < sizeof(header->magic)) {
+        TRACE1(TRACE_IMG_HEADER_BAD, image->index);
+        return false;
+    }
+
+    if (header->magic == SLIC_MAGIC) {
+        TRACE1(TRACE_IMG_LEGACY, image->index);
+        memset(header, 0, sizeof(*header));
+        header->magic = IMG_MAGIC;
+        header->codec = IMG_CODEC_SLIC;
+        header->bpp = DISP_BPP;
+        header->width = DISP_WIDTH;
+        header->height = DISP_HEIGHT;
+        header->payload_size = available;
+        header->payload_crc32 = image->crc32;
+    } else if (bytesRead != sizeof(*header) || header->magic != IMG_MAGIC ||
+               header->version != IMG_VERSION ||
+               header->header_size < sizeof(*header) ||
+               header->bpp != DISP_BPP || header->width != DISP_WIDTH ||
+               header->height != DISP_HEIGHT || header->payload_size == 0) {
+        TRACE1(TRACE_IMG_HEADER_BAD, image->index);
+        return false;
+    }
+
+    if (img_find_decoder(header->codec) == NULL) {
+        TRACE2(TRACE_IMG_NO_DECODER, image->index, header->codec);
+        return false;
+    }
+    if (header->header_size > available ||
+        header->payload_size > available - header->header_size) {
+        TRACE2(TRACE_IMG_TRUNCATED, header->payload_size,
+               available - header->header_size);
+        return false;
+    }
+
+    return f_lseek(fp, image->offset + header->header_size) == FR_OK;
+}
+
+/**
+ * @brief Open an image for streaming: check its header, then set up the
+ * decoder for its codec. The payload CRC is computed by the CRC unit as the
+ * payload is read, so no other CRC may be computed on it until img_finish.
+ *
+ * @param img: filled with the image state
+ * @param fp: image file, positioned at the start of the image
+ * @param image: location of the image from sd_open_next_image
+ */
+bool img_open(struct img_t* img, FIL* fp, const struct sd_image_t* image) {
+    img->fp = fp;
+    img->failed = false;
+    if (!img_read_header(fp, image, &img->header)) return false;
+
+    img->decoder = img_find_decoder(img->header.codec);
+    img->remaining = img->header.payload_size;
+    img->crc_known =
+        img->header.version != 0 || img->header.payload_crc32 != 0;
+
+    crc_start();
+    if (!img->decoder->init(img)) {
+        TRACE2(TRACE_IMG_DECODER_FAILED, image->index, img->header.codec);
+        return false;
+    }
+
+    TRACE3(TRACE_IMG_OPEN, image->index, img->header.codec,
+           img->header.payload_size);
+    return true;
+}
+
+/**
+ * @brief Read payload bytes for the decoder, adding them to the CRC. Reads
+ * stop at the end of the payload.
+ *
+ * @return number of bytes read, -1 on error
+ */
+int32_t img_read(struct img_t* img, uint8_t* buf, uint32_t len) {
+    UINT bytesRead;
+
+    if (len > img->remaining) len = img->remaining;
+
+    FRESULT fres = f_read(img->fp, buf, len, &bytesRead);
+    if (fres != FR_OK) {
+        TRACE1(TRACE_F_READ_ERROR, fres);
+        img->failed = true;
+        return -1;
+    }
+    if (bytesRead < len) img->failed = true;  // file ended early
+
+    crc_update(buf, bytesRead);
+    img->remaining -= bytesRead;
+    return bytesRead;
+}
+
+/**
+ * @brief Decode the next bytes of the frame, up to len. Decoders may return
+ * fewer to keep their reads aligned.
+ *
+ * @return number of bytes decoded, 0 on a decode error, the image must not be
+ * shown then
+ */
+uint32_t img_decode(struct img_t* img, uint8_t* out, uint32_t len) {
+    if (img->failed) return 0;
+
+    uint32_t decoded = img->decoder->decode(img, out, len);
+    if (decoded == 0 || img->failed) {
+        img->failed = true;
+        return 0;
+    }
+    return decoded;
+}
+
+/**
+ * @brief Read whatever payload the decoder left unread, then check the
+ * payload CRC.
+ *
+ * @return true if the whole frame was decoded from an intact payload, so the
+ * panel may be refreshed
+ */
+bool img_finish(struct img_t* img) {
+    uint8_t buf[64];
+
+    while (!img->failed && img->remaining > 0) {
+        if (img_read(img, buf, sizeof(buf)) <= 0) img->failed = true;
+    }
+    if (img->failed) {
+        TRACE1(TRACE_IMG_READ_FAILED, img->remaining);
+        return false;
+    }
+
+    if (img->crc_known) {
+        uint32_t crc = crc_result();
+        if (crc != img->header.payload_crc32) {
+            TRACE2(TRACE_IMG_CRC_MISMATCH, crc, img->header.payload_crc32);
+            return false;
+        }
+    }
+    return true;
+}
@@ -29,10 +29,18 @@
 #include <string.h>
 
 #include "aeon.h"
+#include "arena.h"
+#include "batt.h"
 #include "disp.h"
 #include "fram.h"
+#include "power.h"
+#include "profile.h"
+#include "retain.h"
+#include "sched.h"
+#include "img.h"
+#include "overlay.h"
 #include "sd.h"
-#include "slic.h"
+#include "trace.h"
 
 /* USER CODE END Includes */
 
@@ -67,18 +75,8 @@ enum wake_reason_t wake_reason;
 bool runtime_debug_mode = true;
 
 uint32_t wake_cycle_count;
-double batt_voltage;
 
-#define DEBUG_OUTPUT_ARR_SIZE 20000
-char debug_output_arr[DEBUG_OUTPUT_ARR_SIZE];
-int debug_output_arr_index = 0;
-
-FATFS FatFs;
-
-FIL img_file_ptr;
-
-#define PIXEL_BUF_SIZE 5000
-uint8_t pixel_buf[PIXEL_BUF_SIZE];
+struct sd_image_t image;
 
 /* USER CODE END PV */
 
@@ -97,41 +95,43 @@ static void MX_RNG_Init(void);
 /* USER CODE BEGIN 0 */
 
 int __io_putchar(int ch) {
-    if ((runtime_debug_mode || DEBUG_MODE_FORCE_EN) &&
-        debug_output_arr_index < DEBUG_OUTPUT_ARR_SIZE) {
-        debug_output_arr[debug_output_arr_index++] = ch;
-    }
-
     // Write character to ITM ch.0
     ITM_SendChar(ch);
     return (ch);
 }
 
-int img_slic_open_callback(const char* filename, SLICFILE* pFile) {
-    FRESULT fres;
+/**
+ * @brief Open the next image whose container header and decoder setup check
+ * out, skipping bad ones. Each image opened counts as an attempt.
+ *
+ * @param img: arena image state, its file is left open on success
+ * @param shuffle_enabled: pick a random image instead of the next one
+ * @param attempts: images tried so far this refresh, updated
+ * @return true if an image is open for decoding
+ */
+static bool open_next_image(struct arena_image_t* img, bool shuffle_enabled,
+                            int* attempts) {
+    while (*attempts < IMG_ATTEMPTS) {
+        (*attempts)++;
 
-    fres = f_open(&img_file_ptr, filename, FA_READ);
-    if (fres != FR_OK) {
-        printf("f_open error (%i)\r\n", fres);
-        return -1;
-    }
+        profile_start(PROFILE_IMAGE_LOOKUP);
+        bool image_available =
+            sd_open_next_image(&img->file, shuffle_enabled, &image);
+        profile_stop(PROFILE_IMAGE_LOOKUP);
 
-    pFile->fHandle = &img_file_ptr;
+        if (!image_available) return false;
 
-    return 0;
-}
+        TRACE2(TRACE_IMAGE_OPEN, image.index, image.offset);
+        profile_start(PROFILE_DECODE);
+        bool image_ok = img_open(&img->img, &img->file, &image);
+        profile_stop(PROFILE_DECODE);
 
-int img_slic_read_callback(SLICFILE* pFile, uint8_t* pBuf, int32_t iLen) {
-    UINT bytesRead;
-    FRESULT fres;
+        if (image_ok) return true;
 
-    fres = f_read(pFile->fHandle, pBuf, iLen, &bytesRead);
-    if (fres != FR_OK) {
-        printf("f_read error (%i)\r\n", fres);
-        return -1;
+        TRACE1(TRACE_IMG_SKIPPED, image.index);
+        sd_close_image(&img->file);
     }
-
-    return bytesRead;
+    return false;
 }
 
 /* USER CODE END 0 */
@@ -143,6 +143,9 @@ int img_slic_read_callback(SLICFILE* pFile, uint8_t* pBuf, int32_t iLen) {
 int main(void) {
     /* USER CODE BEGIN 1 */
 
+    profile_init();
+    profile_start(PROFILE_BOOT);
+
     setvbuf(stdout, NULL, _IONBF, 0);  // disable line buffering for printf
 
     bool wakeup_by_refresh_btn = __HAL_PWR_GET_FLAG(
@@ -169,6 +172,9 @@ int main(void) {
 
     /* USER CODE BEGIN SysInit */
 
+    profile_clock_changed();  // cycles so far were counted at 4 MHz MSI
+    power_init();  // drop to low power mode before the peripherals start
+
     /* USER CODE END SysInit */
 
     /* Initialize all configured peripherals */
@@ -180,6 +186,8 @@ int main(void) {
     MX_RNG_Init();
     /* USER CODE BEGIN 2 */
 
+    power_init_spi();  // SPI1 was set up for full speed, but the core is slow
+
     // ================= Initialisation ================= //
 
     __HAL_PWR_CLEAR_FLAG(
@@ -187,59 +195,76 @@ int main(void) {
                        // https://wiki.st.com/stm32mcu/wiki/Getting_started_with_PWR#Standby_mode
     __HAL_RTC_WAKEUPTIMER_EXTI_CLEAR_FLAG();
 
+    // the alarm flag is held in the backup domain, so it survives standby
+    if (__HAL_RTC_ALARM_GET_FLAG(&hrtc, RTC_FLAG_ALRAF)) {
+        wakeup_by_rtc = true;
+        __HAL_RTC_ALARM_CLEAR_FLAG(&hrtc, RTC_FLAG_ALRAF);
+    }
+
     wake_reason = WAKE_REASON_RESET;
 
     if (wakeup_by_refresh_btn) {
         wake_reason = WAKE_REASON_STBY_REFRESH_BTN;
-        if (DBG) printf("Wake from Standby (Refresh Btn)\n");
+        TRACE0(TRACE_WAKE_BTN);
     } else if (wakeup_by_rtc) {
         wake_reason = WAKE_REASON_STBY_RTC;
-        if (DBG) printf("Wake from Standby (RTC)\n");
+        TRACE0(TRACE_WAKE_RTC);
     } else {
-        if (DBG) printf("Wake from pwr off (Reset)\n");
+        TRACE0(TRACE_WAKE_RESET);
     }
 
     SET_AUX_PWR(true);  // enable AUX power rail
     HAL_Delay(10);      // wait for AUX PWR to stabilise
-    if (DBG) printf("Enabled AUX PWR\n");
+    TRACE0(TRACE_AUX_PWR_ON);
+    profile_stop(PROFILE_BOOT);
 
-    // check for previous unsafe shutdown, and set the flag to true
+    // load persistent state, check for previous unsafe shutdown and set the
+    // flag to true, then store it before doing anything else
+    profile_start(PROFILE_FRAM);
+    bool fram_state_valid = fram_state_load();
     bool previous_unsafe_shutdown = fram_sys_start_unsafe_shutdown_update();
     wake_cycle_count = fram_sys_wake_cycle_count_update();
+    fram_state_commit();
+    profile_stop(PROFILE_FRAM);
 
-    if (DBG) {
-        printf("Starting iteration %lu\n", wake_cycle_count);
-        printf("Previous shutdown was %s\n",
-               previous_unsafe_shutdown ? "UNSAFE" : "safe");
-    }
+    TRACE1(TRACE_ITERATION, wake_cycle_count);
+    TRACE0(previous_unsafe_shutdown ? TRACE_SHUTDOWN_UNSAFE
+                                    : TRACE_SHUTDOWN_SAFE);
+    if (!fram_state_valid) TRACE0(TRACE_FRAM_INVALID);
+
+    // cached card state and log records staged by wakes that didn't mount
+    // the card, kept in SRAM2
+    if (!retain_load()) TRACE0(TRACE_RETAIN_INVALID);
 
-    bool sd_avail = sd_init(&FatFs);  // initialise SD card
-    if (DBG && !sd_avail)
-        printf("SD card not available, will be unable to refresh image\n");
+    profile_start(PROFILE_BATT_CHECK);
+    bool batt_ok = batt_measure();
+    sched_update();  // learn when the harvester charges the battery
+    profile_stop(PROFILE_BATT_CHECK);
 
-    if (!batt_threshold_check(&batt_voltage)) {
-        if (DBG)
-            printf("Battery voltage is %.2fV, below threshold of %.2fV\n",
-                   batt_voltage, BATT_THRESHOLD);
+    // the threshold follows the measured refresh load, see batt_measure
+    if (!batt_ok) {
+        TRACE2(TRACE_BATT_LOW, batt_status.mv, batt_status.required_mv);
 
         if (DISABLE_BATT_THRESHOLD_CHECK) {
-            if (DBG)
-                printf("Battery threshold check disabled, continuing...\n");
+            TRACE0(TRACE_BATT_CHECK_DISABLED);
         } else {
             fram_set_sleep_reason(SLEEP_REASON_LOW_BATT);
+            if (batt_charging()) {
+                // look again sooner while the harvester recharges it
+                TRACE1(TRACE_BATT_CHARGING, 2 * 60 * 60);
+                enter_sleep(2 * 60 * 60);  // sleep for 2 hours
+            }
             enter_sleep(12 * 60 * 60);  // sleep for 12 hours
         }
     }
-    if (DBG)
-        printf("Battery voltage is %.2fV, above threshold of %.2fV\n",
-               batt_voltage, BATT_THRESHOLD);
+    TRACE2(TRACE_BATT_OK, batt_status.mv, batt_status.required_mv);
 
     // check if BTN_IN is held down to enter debug mode
     if (!check_debug_mode_en()) {
         if (!previous_unsafe_shutdown) {
             runtime_debug_mode = false;
         } else {
-            printf("Debug mode enabled due to unsafe shutdown!\n");
+            TRACE0(TRACE_DEBUG_UNSAFE_SHUTDOWN);
         }
     }
 
@@ -247,8 +272,7 @@ int main(void) {
     // Check whether to do an image refresh or go back to sleep.
 
     uint32_t remaining_sleep_duration = fram_get_sleep_duration();
-    if (DBG)
-        printf("Remaining sleep duration: %lu\n", remaining_sleep_duration);
+    TRACE1(TRACE_SLEEP_REMAINING, remaining_sleep_duration);
 
     uint16_t previous_interval_value =
         fram_get_interval_sw_value();  // get previous interval value
@@ -264,11 +288,7 @@ int main(void) {
                                           // of the toggle switch value
 
     fram_set_interval_sw_value(current_interval_value);
-    if (DBG)
-        printf(
-            "Previous interval switch value: %u, Current interval switch "
-            "value: %u\n",
-            previous_interval_value, current_interval_value);
+    TRACE2(TRACE_INTERVAL_SW, previous_interval_value, current_interval_value);
 
     // Conditions to return to sleep
     // 1. Sleep duration not elapsed
@@ -276,10 +296,7 @@ int main(void) {
     // 3. and Interval switch value not changed
     if (remaining_sleep_duration != 0 && !wakeup_by_refresh_btn &&
         previous_interval_value == current_interval_value) {
-        if (DBG)
-            printf(
-                "Sleep duration not elapsed... Conditions not met for refresh, "
-                "going back to sleep.\n");
+        TRACE0(TRACE_SLEEP_NOT_ELAPSED);
 
         uint32_t next_sleep_duration = calculate_update_sleep_duration(
             remaining_sleep_duration, current_interval_value);
@@ -290,112 +307,184 @@ int main(void) {
 
     // 4. Refresh not enabled (and not woken by refresh button)
     if (!refresh_enabled && !wakeup_by_refresh_btn) {
-        if (DBG) printf("Refresh not enabled... Going back to sleep.\n");
+        TRACE0(TRACE_REFRESH_DISABLED);
 
         fram_set_sleep_reason(SLEEP_REASON_REFRESH_DISABLED);
         enter_sleep(12 * 60 * 60);  // sleep for 12 hours
     }
 
+    // 5. Refresh due on schedule, but a later time of day harvests more. Only
+    // waits once per refresh.
+    struct sched_plan_t plan;
+    sched_plan(current_interval_value, &plan);
+
+    if (wake_reason == WAKE_REASON_STBY_RTC &&
+        fram_get_sleep_reason() != SLEEP_REASON_HARVEST_WAIT &&
+        previous_interval_value == current_interval_value) {
+        uint32_t harvest_wait = sched_harvest_wait(&plan);
+        if (harvest_wait != 0) {
+            TRACE1(TRACE_SCHED_WAIT, harvest_wait);
+
+            fram_set_sleep_reason(SLEEP_REASON_HARVEST_WAIT);
+            enter_sleep(harvest_wait);
+        }
+    }
+
     // ================= Step 2 ================= //
     // If conditions are correct, we need to refresh the image, so next, need to
-    // select the image to display.
+    // select the image to display. The SD card is only mounted from here on,
+    // wakes returning to sleep earlier stage their logs in SRAM2.
+
+    // mounting, lookup and decoding move bulk data over SPI and keep the CPU
+    // busy, so they finish sooner than the extra run current costs
+    power_set_mode(POWER_MODE_FULL);
+
+    profile_start(PROFILE_SD_MOUNT);
+    bool sd_avail = sd_init();  // initialise SD card
+    profile_stop(PROFILE_SD_MOUNT);
 
     if (!sd_avail) {
-        if (DBG)
-            printf(
-                "SD card not available to refresh image... Going back to "
-                "sleep.\n");
+        TRACE0(TRACE_NO_SD);
 
         fram_set_sleep_reason(SLEEP_REASON_NO_SD);
         enter_sleep(12 * 60 * 60);  // sleep for 12 hours
     }
 
-    char filename[41] = {0};
-    bool image_available =
-        sd_get_next_image_filename(filename, shuffle_enabled);
+    // image file, decoder state and pixel buffer share the arena with the log
+    // writes made before sleep
+    arena_enter(ARENA_PHASE_IMAGE);
+    struct arena_image_t* img = &arena.image;
 
-    if (!image_available) {
-        if (DBG)
-            printf("No image available to display... Going back to sleep.\n");
+    // images with a bad header are skipped here, before the panel is touched
+    int attempts = 0;
+    if (!open_next_image(img, shuffle_enabled, &attempts)) {
+        TRACE0(TRACE_NO_IMAGE);
 
+        fram_set_image_counter(0);  // start from the first image next time
         fram_set_sleep_reason(SLEEP_REASON_NO_IMAGE);
         enter_sleep(12 * 60 * 60);  // sleep for 12 hours
     }
 
-    f_chdir("/images");  // change to images directory
-
-    if (DBG) printf("Opening image file: %s\n", filename);
-    SLICSTATE slic_state;
-    slic_init_decode(filename, &slic_state, NULL, 0, NULL,
-                     img_slic_open_callback, img_slic_read_callback);
-
     // ================= Step 3 ================= //
     // Display the image
 
+    // the panel reset is mostly delays, and its registers are only a few bytes
+    power_set_mode(POWER_MODE_LOW);
+
     spi_device_select(AEON_SPI_DISP);
-    if (DBG) printf("Initialising display\n");
+    TRACE0(TRACE_DISP_INIT);
     disp_init();
 
-    if (DBG) printf("Initialising display registers\n");
+    TRACE0(TRACE_DISP_INIT_REGS);
     disp_init_regs();
 
-    if (DBG) printf("Clearing display\n");
-    disp_clear(DISP_WHITE);
+    // busy waits of the panel drop back to low power mode by themselves
+    power_set_mode(POWER_MODE_FULL);
 
-    if (DBG)
-        printf("Transferring image data to disp (one dot is %i bytes) -> ",
-               sizeof(pixel_buf));
+    // the clearing pass is a second full refresh, skipped when charge is short
+    if (plan.clear) {
+        TRACE0(TRACE_DISP_CLEAR);
+        disp_clear(DISP_WHITE);
+    }
 
-    disp_send_command(0x10);
+    // status drawn over the image as it is transferred
+    if (OVERLAY_BATTERY) overlay_add_battery();
+
+    TRACE1(TRACE_DISP_TRANSFER, sizeof(img->pixel_buf));
+
+    // a payload that turns out bad is only found once it has been sent, but
+    // the panel shows nothing until it is refreshed, so the next image can
+    // be sent over it
+    while (true) {
+        disp_send_command(0x10);
+        profile_start(PROFILE_DISP_TRANSFER);
+
+        bool decode_ok = true;
+        uint32_t frame_remaining = DISP_FRAME_SIZE;
+        while (frame_remaining > 0 && decode_ok) {
+            profile_stop(PROFILE_DISP_TRANSFER);
+            profile_start(PROFILE_DECODE);
+            spi_device_select(AEON_SPI_SD);
+
+            uint32_t chunk = frame_remaining < sizeof(img->pixel_buf)
+                                 ? frame_remaining
+                                 : sizeof(img->pixel_buf);
+            chunk = img_decode(&img->img, img->pixel_buf, chunk);
+            decode_ok = chunk != 0;
+
+            spi_device_select(AEON_SPI_DISP);
+            profile_stop(PROFILE_DECODE);
+            profile_start(PROFILE_DISP_TRANSFER);
+
+            // decode, overlay and transfer loops all run from SRAM2
+            overlay_apply(img->pixel_buf, DISP_FRAME_SIZE - frame_remaining,
+                          chunk);
+            disp_send_pixels(img->pixel_buf, chunk);
+            frame_remaining -= chunk;
+        }
 
-    int pix_buf_remaining = 0;
+        profile_stop(PROFILE_DISP_TRANSFER);
 
-    int EDP_width = 400;
-    int EDP_height = 480;
-    for (int i = 0; i < EDP_height; i++) {
-        for (int j = 0; j < EDP_width; j++) {
-            if (pix_buf_remaining == 0) {
-                spi_device_select(AEON_SPI_SD);
+        profile_start(PROFILE_DECODE);
+        spi_device_select(AEON_SPI_SD);
+        bool image_ok = decode_ok && img_finish(&img->img);
+        profile_stop(PROFILE_DECODE);
 
-                slic_decode(&slic_state, (uint8_t*)&pixel_buf,
-                            sizeof(pixel_buf));
-                pix_buf_remaining = sizeof(pixel_buf);
+        if (image_ok) break;
 
-                spi_device_select(AEON_SPI_DISP);
+        TRACE1(TRACE_IMG_SKIPPED, image.index);
+        sd_close_image(&img->file);
 
-                printf(".");
-            }
+        if (!open_next_image(img, shuffle_enabled, &attempts)) {
+            TRACE0(TRACE_NO_IMAGE);
 
-            // each image byte stores data of two consecutive pixels (4 bits
-            // each)
-            uint8_t pixel_data = pixel_buf[PIXEL_BUF_SIZE - pix_buf_remaining];
+            // the frame sent isn't refreshed, so the panel keeps showing the
+            // previous image, or white if the clearing pass ran
+            spi_device_select(AEON_SPI_DISP);
+            disp_sleep();
+            disp_exit();
 
-            // this sends two 4-bit pixels as one byte
-            disp_send_data(pixel_data);
-            pix_buf_remaining--;
+            fram_set_sleep_reason(SLEEP_REASON_NO_IMAGE);
+            enter_sleep(12 * 60 * 60);  // sleep for 12 hours
         }
+        spi_device_select(AEON_SPI_DISP);
     }
 
-    if (DBG) printf("\nCompleted image transfer\n");
+    TRACE0(TRACE_DISP_TRANSFER_DONE);
 
-    if (DBG) printf("Turning on display\n");
-    disp_turn_on();
+    spi_device_select(AEON_SPI_DISP);
+    TRACE0(TRACE_DISP_ON);
+    disp_turn_on_start();
 
     spi_device_select(AEON_SPI_SD);
 
-    f_close(&img_file_ptr);
+    sd_close_image(&img->file);
+
+    // pick and check the next image while the panel refreshes, so the next
+    // refresh can open it straight away
+    profile_start(PROFILE_IMAGE_PREPARE);
+    sd_prepare_next_image(&img->file, shuffle_enabled);
+    profile_stop(PROFILE_IMAGE_PREPARE);
+
+    power_set_mode(POWER_MODE_LOW);
+
+    // the panel is still refreshing, so its load on the battery can be
+    // measured
+    if (!GET_DISP_BUSY()) batt_measure_load();
 
     spi_device_select(AEON_SPI_DISP);
+    disp_turn_on_wait();
 
-    if (DBG) printf("Display to sleep and shutdown\n");
+    TRACE0(TRACE_DISP_SLEEP);
     disp_sleep();  // put display to sleep
     disp_exit();
 
     // ================= Step 4 ================= //
     // Finalise stored data and go back to sleep
 
+    // interval from the scheduler, counted down like a remaining duration
     uint32_t next_sleep_duration =
-        calculate_update_sleep_duration(0, current_interval_value);
+        calculate_update_sleep_duration(plan.interval, current_interval_value);
 
     fram_set_sleep_reason(SLEEP_REASON_FIRST_AFTER_REFRESH);
     enter_sleep(next_sleep_duration);
@@ -576,6 +665,18 @@ static void MX_RTC_Init(void) {
     }
     /* USER CODE BEGIN RTC_Init 2 */
 
+    // Give the calendar a valid date on first power up. The alarm based wake
+    // scheduling only needs a running calendar, not the real time.
+    if (!__HAL_RTC_IS_CALENDAR_INITIALIZED(&hrtc)) {
+        RTC_TimeTypeDef time = {0};
+        RTC_DateTypeDef date = {.WeekDay = RTC_WEEKDAY_MONDAY,
+                                .Month = RTC_MONTH_JANUARY,
+                                .Date = 1,
+                                .Year = 24};
+        HAL_RTC_SetTime(&hrtc, &time, RTC_FORMAT_BIN);
+        HAL_RTC_SetDate(&hrtc, &date, RTC_FORMAT_BIN);
+    }
+
     /* USER CODE END RTC_Init 2 */
 }
 
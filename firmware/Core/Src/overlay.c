@@ -0,0 +1,221 @@
+#include "overlay.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "batt.h"
+#include "disp.h"
+#include "main.h"
+#include "trace.h"
+
+#define OVERLAY_ROW_SIZE (DISP_WIDTH * DISP_BPP / 8)  // bytes per panel row
+#define OVERLAY_GLYPH_WIDTH 5
+#define OVERLAY_GLYPH_HEIGHT 7
+#define OVERLAY_CELL_WIDTH (OVERLAY_GLYPH_WIDTH + 1)  // glyph and spacing
+
+/**
+ * Font of the overlays, 5x7 font pixels per glyph, one byte per row with the
+ * leftmost pixel in bit 4. Only holds what status text needs, lower case is
+ * drawn as upper case and anything else as a space.
+ */
+static const char overlay_charset[] =
+    "\x01\x02\x03\x04\x05\x06 %+-./0123456789:ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+static const uint8_t overlay_font[][OVERLAY_GLYPH_HEIGHT] = {
+    {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x1f},  // battery 0/5
+    {0x0e, 0x11, 0x11, 0x11, 0x11, 0x1f, 0x1f},  // battery 1/5
+    {0x0e, 0x11, 0x11, 0x11, 0x1f, 0x1f, 0x1f},  // battery 2/5
+    {0x0e, 0x11, 0x11, 0x1f, 0x1f, 0x1f, 0x1f},  // battery 3/5
+    {0x0e, 0x11, 0x1f, 0x1f, 0x1f, 0x1f, 0x1f},  // battery 4/5
+    {0x0e, 0x1f, 0x1f, 0x1f, 0x1f, 0x1f, 0x1f},  // battery 5/5
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},  // ' '
+    {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03},  // '%'
+    {0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00},  // '+'
+    {0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00},  // '-'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c},  // '.'
+    {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00},  // '/'
+    {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e},  // '0'
+    {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e},  // '1'
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f},  // '2'
+    {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e},  // '3'
+    {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02},  // '4'
+    {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e},  // '5'
+    {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e},  // '6'
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},  // '7'
+    {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e},  // '8'
+    {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c},  // '9'
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00},  // ':'
+    {0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11},  // 'A'
+    {0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e},  // 'B'
+    {0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e},  // 'C'
+    {0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c},  // 'D'
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f},  // 'E'
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10},  // 'F'
+    {0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f},  // 'G'
+    {0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11},  // 'H'
+    {0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e},  // 'I'
+    {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c},  // 'J'
+    {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11},  // 'K'
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f},  // 'L'
+    {0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11},  // 'M'
+    {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11},  // 'N'
+    {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e},  // 'O'
+    {0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10},  // 'P'
+    {0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d},  // 'Q'
+    {0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11},  // 'R'
+    {0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e},  // 'S'
+    {0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04},  // 'T'
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e},  // 'U'
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04},  // 'V'
+    {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a},  // 'W'
+    {0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11},  // 'X'
+    {0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04},  // 'Y'
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f},  // 'Z'
+};
+
+// Text box drawn over the frame, a line of glyphs on a white background
+struct overlay_item_t {
+    uint16_t x, y;           // top left corner, in panel pixels
+    uint16_t width, height;  // in panel pixels
+    uint8_t color;           // of the glyphs
+    uint8_t len;
+    uint8_t glyphs[OVERLAY_TEXT_MAX];  // index into overlay_font
+};
+
+static struct overlay_item_t overlay_items[OVERLAY_ITEMS_MAX];
+static uint8_t overlay_count;
+
+static uint16_t overlay_width(uint32_t len) {
+    // a font pixel of padding on the left, the spacing of the last glyph on
+    // the right
+    return (len * OVERLAY_CELL_WIDTH + 1) * OVERLAY_SCALE;
+}
+
+static uint16_t overlay_height() {
+    return (OVERLAY_GLYPH_HEIGHT + 2) * OVERLAY_SCALE;
+}
+
+/**
+ * @brief Add a line of text to draw over the frame. Overlays are set up
+ * before the frame is transferred, and drawn by overlay_apply as it streams
+ * to the panel.
+ *
+ * @param x, y: top left corner of the text box, in panel pixels
+ * @param text: up to OVERLAY_TEXT_MAX characters, the rest is cut off
+ * @param color: of the glyphs, a DISP_* color
+ * @return false if there are too many overlays or the box doesn't fit
+ */
+bool overlay_add_text(uint16_t x, uint16_t y, const char* text,
+                      uint8_t color) {
+    uint32_t len = strlen(text);
+    if (len > OVERLAY_TEXT_MAX) len = OVERLAY_TEXT_MAX;
+
+    if (overlay_count == OVERLAY_ITEMS_MAX ||
+        x + overlay_width(len) > DISP_WIDTH ||
+        y + overlay_height() > DISP_HEIGHT) {
+        return false;
+    }
+
+    struct overlay_item_t* item = &overlay_items[overlay_count++];
+    item->x = x;
+    item->y = y;
+    item->width = overlay_width(len);
+    item->height = overlay_height();
+    item->color = color;
+    item->len = len;
+
+    for (uint32_t i = 0; i < len; i++) {
+        char c = text[i];
+        if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+
+        const char* found = c != '\0' ? strchr(overlay_charset, c) : NULL;
+        if (found == NULL) found = strchr(overlay_charset, ' ');
+        item->glyphs[i] = found - overlay_charset;
+    }
+
+    TRACE3(TRACE_OVERLAY_TEXT, len, x, y);
+    return true;
+}
+
+/**
+ * @brief Show the charge from batt_measure in the bottom right corner, as a
+ * battery icon and a percentage, in red once it runs low.
+ */
+void overlay_add_battery() {
+    char text[OVERLAY_TEXT_MAX + 1];
+    uint8_t level = (batt_status.soc + 10) / 20;  // fifths, rounded
+    if (level > 5) level = 5;
+
+    text[0] = OVERLAY_ICON_BATTERY + level;
+    snprintf(&text[1], sizeof(text) - 1, "%u%%", batt_status.soc);
+
+    uint16_t width = overlay_width(strlen(text));
+    overlay_add_text(DISP_WIDTH - OVERLAY_MARGIN - width,
+                     DISP_HEIGHT - OVERLAY_MARGIN - overlay_height(), text,
+                     batt_status.soc < OVERLAY_BATTERY_LOW_SOC ? DISP_RED
+                                                               : DISP_BLACK);
+}
+
+/**
+ * @brief Draw the overlays into a run of frame data on its way to the panel,
+ * so no frame buffer is needed. Only the bytes of the text boxes in the rows
+ * of the run are touched, so the cost per row is bounded by
+ * OVERLAY_ITEMS_MAX boxes of OVERLAY_TEXT_MAX glyphs, and rows without
+ * overlays cost nothing. Runs from SRAM2 with the transfer loop.
+ *
+ * @param data: frame data, two 4-bit pixels per byte
+ * @param offset: position of data in the frame, in bytes
+ * @param len: bytes of data
+ */
+RAM2FUNC void overlay_apply(uint8_t* data, uint32_t offset, uint32_t len) {
+    if (overlay_count == 0 || len == 0) return;
+
+    uint32_t end = offset + len;
+    uint32_t first_row = offset / OVERLAY_ROW_SIZE;
+    uint32_t last_row = (end - 1) / OVERLAY_ROW_SIZE;
+
+    for (uint8_t i = 0; i < overlay_count; i++) {
+        const struct overlay_item_t* item = &overlay_items[i];
+
+        uint32_t row = item->y > first_row ? item->y : first_row;
+        uint32_t row_end = item->y + item->height - 1;
+        if (row_end > last_row) row_end = last_row;
+
+        for (; row <= row_end; row++) {
+            // pixels of the box within the run
+            uint32_t row_start = row * OVERLAY_ROW_SIZE;
+            uint32_t px = item->x;
+            uint32_t px_end = item->x + item->width;
+            if (offset > row_start && px < (offset - row_start) * 2) {
+                px = (offset - row_start) * 2;
+            }
+            if (end < row_start + OVERLAY_ROW_SIZE &&
+                px_end > (end - row_start) * 2) {
+                px_end = (end - row_start) * 2;
+            }
+
+            int32_t fy = (int32_t)(row - item->y) / OVERLAY_SCALE - 1;
+            for (; px < px_end; px++) {
+                int32_t fx = (int32_t)(px - item->x) / OVERLAY_SCALE - 1;
+                uint8_t color = DISP_WHITE;
+                if (fy >= 0 && fy < OVERLAY_GLYPH_HEIGHT && fx >= 0) {
+                    uint8_t col = fx % OVERLAY_CELL_WIDTH;
+                    const uint8_t* glyph =
+                        overlay_font[item->glyphs[fx / OVERLAY_CELL_WIDTH]];
+                    if (col < OVERLAY_GLYPH_WIDTH &&
+                        (glyph[fy] >> (OVERLAY_GLYPH_WIDTH - 1 - col)) & 1) {
+                        color = item->color;
+                    }
+                }
+
+                // the first pixel of a byte is in its high nibble
+                uint8_t* b = &data[row_start + px / 2 - offset];
+                if (px & 1) {
+                    *b = (*b & 0xF0) | color;
+                } else {
+                    *b = (*b & 0x0F) | (color << 4);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,139 @@
+#include "power.h"
+
+#include "main.h"
+#include "profile.h"
+#include "stm32l4xx_hal.h"
+#include "trace.h"
+
+// SPI1 clock in low power mode, 1 MHz from MSI at 4 MHz. Close to the 1.25 MHz
+// MX_SPI1_Init gives at full speed, so FRAM and panel register writes take
+// about as long in either mode.
+#define POWER_LOW_SPI_PRESCALER SPI_BAUDRATEPRESCALER_4
+
+static enum power_mode_t power_mode = POWER_MODE_FULL;
+
+// SPI1 prescaler to restore at full speed. The SD driver changes it while
+// mounting the card, so it is saved on every switch to low power mode.
+static uint32_t power_full_spi_prescaler;
+
+static void power_clock_config(uint32_t sysclk_source, uint32_t latency) {
+    RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+
+    RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK | RCC_CLOCKTYPE_SYSCLK |
+                                  RCC_CLOCKTYPE_PCLK1 | RCC_CLOCKTYPE_PCLK2;
+    RCC_ClkInitStruct.SYSCLKSource = sysclk_source;
+    RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
+    RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV1;
+    RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV1;
+
+    // also moves the SysTick to the new clock, so HAL_Delay stays in ms
+    if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, latency) != HAL_OK) {
+        Error_Handler();
+    }
+}
+
+/**
+ * @brief Raise the regulator to range 1 before locking the PLL to 80 MHz and
+ * switching to it.
+ */
+static void power_enter_full() {
+    RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+
+    if (HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE1) !=
+        HAL_OK) {
+        Error_Handler();
+    }
+
+    RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSI;
+    RCC_OscInitStruct.HSIState = RCC_HSI_ON;
+    RCC_OscInitStruct.HSICalibrationValue = RCC_HSICALIBRATION_DEFAULT;
+    RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
+    RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSI;
+    RCC_OscInitStruct.PLL.PLLM = 1;
+    RCC_OscInitStruct.PLL.PLLN = 10;
+    RCC_OscInitStruct.PLL.PLLQ = RCC_PLLQ_DIV2;
+    RCC_OscInitStruct.PLL.PLLR = RCC_PLLR_DIV2;
+    if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK) {
+        Error_Handler();
+    }
+
+    power_clock_config(RCC_SYSCLKSOURCE_PLLCLK, FLASH_LATENCY_4);
+    MODIFY_REG(hspi1.Instance->CR1, SPI_CR1_BR, power_full_spi_prescaler);
+}
+
+/**
+ * @brief Switch back to MSI, stop the PLL and HSI, then lower the regulator
+ * to range 2, which only allows up to 26 MHz.
+ */
+static void power_enter_low_clock() {
+    RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+
+    power_clock_config(RCC_SYSCLKSOURCE_MSI, FLASH_LATENCY_0);
+
+    // the PLL runs from HSI, so it is stopped first
+    RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+    RCC_OscInitStruct.PLL.PLLState = RCC_PLL_OFF;
+    if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK) {
+        Error_Handler();
+    }
+
+    RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSI;
+    RCC_OscInitStruct.HSIState = RCC_HSI_OFF;
+    RCC_OscInitStruct.PLL.PLLState = RCC_PLL_NONE;
+    if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK) {
+        Error_Handler();
+    }
+
+    if (HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE2) !=
+        HAL_OK) {
+        Error_Handler();
+    }
+}
+
+static void power_enter_low() {
+    power_full_spi_prescaler = READ_BIT(hspi1.Instance->CR1, SPI_CR1_BR);
+    MODIFY_REG(hspi1.Instance->CR1, SPI_CR1_BR, POWER_LOW_SPI_PRESCALER);
+    power_enter_low_clock();
+}
+
+/**
+ * @brief Leave the 80 MHz range 1 configuration SystemClock_Config generates
+ * for POWER_MODE_LOW. Called from USER CODE SysInit, before any peripheral is
+ * set up, so SPI1 is left to power_init_spi.
+ */
+void power_init() {
+    power_enter_low_clock();
+    power_mode = POWER_MODE_LOW;
+    profile_clock_changed();
+}
+
+/**
+ * @brief Take over SPI1 after MX_SPI1_Init, which sets its prescaler for full
+ * speed while the core already runs in low power mode.
+ */
+void power_init_spi() {
+    power_full_spi_prescaler = READ_BIT(hspi1.Instance->CR1, SPI_CR1_BR);
+    MODIFY_REG(hspi1.Instance->CR1, SPI_CR1_BR, POWER_LOW_SPI_PRESCALER);
+}
+
+/**
+ * @brief Move the core to an operating point. The SPI1 clock is scaled with
+ * it, so no transfer may be in progress.
+ *
+ * @return the previous mode, to return to after a wait
+ */
+enum power_mode_t power_set_mode(enum power_mode_t mode) {
+    enum power_mode_t previous = power_mode;
+    if (mode == power_mode) return previous;
+
+    if (mode == POWER_MODE_FULL) {
+        power_enter_full();
+    } else {
+        power_enter_low();
+    }
+    power_mode = mode;
+    profile_clock_changed();
+
+    TRACE2(TRACE_POWER_MODE, previous, mode);
+    return previous;
+}
@@ -0,0 +1,106 @@
+#include "profile.h"
+
+#include <string.h>
+
+#include "fram.h"
+#include "main.h"
+#include "sdlog.h"
+#include "stm32l4xx_hal.h"
+
+// The cycle counter wraps after ~53 s at 80 MHz, longer phases are timed with
+// the millisecond tick instead
+#define PROFILE_CYCLES_MAX_MS 50000
+
+// cleared by profile_init
+NOINIT static struct profile_record_t profile_record;
+static uint32_t profile_start_us[PROFILE_PHASE_COUNT];
+static uint32_t profile_start_tick[PROFILE_PHASE_COUNT];
+
+// The core clock changes with the power mode, so cycles are converted to us
+// at the clock they were counted at, from the last clock change on
+static uint32_t profile_base_us;
+static uint32_t profile_base_cycles;
+static uint32_t profile_cycles_per_us;
+
+/**
+ * @brief Get the time since profile_init, in us.
+ */
+static uint32_t profile_now_us() {
+    return profile_base_us +
+           (DWT->CYCCNT - profile_base_cycles) / profile_cycles_per_us;
+}
+
+/**
+ * @brief Get the time since a start time and tick, in us.
+ */
+static uint32_t profile_elapsed_us(uint32_t start_us, uint32_t start_tick) {
+    uint32_t us = profile_now_us() - start_us;
+    uint32_t ms = HAL_GetTick() - start_tick;
+
+    if (ms >= PROFILE_CYCLES_MAX_MS) return ms * 1000;
+    return us;
+}
+
+/**
+ * @brief Start the DWT cycle counter. Called first thing in main, before the
+ * tick is running, so the boot phase is timed by cycles only. They are counted
+ * at the 4 MHz MSI clock the core comes out of reset with, until main calls
+ * profile_clock_changed after SystemClock_Config switches to the 80 MHz PLL.
+ */
+void profile_init() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    memset(&profile_record, 0, sizeof(profile_record));
+    profile_base_us = 0;
+    profile_base_cycles = DWT->CYCCNT;
+    profile_cycles_per_us = SystemCoreClock / 1000000;
+}
+
+/**
+ * @brief Count the cycles from here on at the new core clock. Called by
+ * main after SystemClock_Config, and by the power module after every clock
+ * change it makes.
+ */
+void profile_clock_changed() {
+    profile_base_us = profile_now_us();
+    profile_base_cycles = DWT->CYCCNT;
+    profile_cycles_per_us = SystemCoreClock / 1000000;
+}
+
+/**
+ * @brief Start timing a phase. Phases may overlap, e.g. busy waits within
+ * display phases, and may be entered several times per wake.
+ */
+void profile_start(enum profile_phase_t phase) {
+    profile_start_us[phase] = profile_now_us();
+    profile_start_tick[phase] = HAL_GetTick();
+}
+
+/**
+ * @brief Stop timing a phase, adding the time since profile_start to it.
+ */
+void profile_stop(enum profile_phase_t phase) {
+    profile_record.phase_us[phase] +=
+        profile_elapsed_us(profile_start_us[phase], profile_start_tick[phase]);
+    profile_record.phase_calls[phase]++;
+}
+
+/**
+ * @brief Append the timing record of this wake to the profile log on the SD
+ * card.
+ */
+bool profile_write() {
+    profile_record.version = PROFILE_VERSION;
+    profile_record.phase_count = PROFILE_PHASE_COUNT;
+    profile_record.wake_reason = wake_reason;
+    profile_record.sleep_reason = fram_get_sleep_reason();
+    profile_record.total_us = profile_elapsed_us(0, 0);
+
+    // counters cover the whole wake, as RAM is cleared in standby
+    disk_ioctl(0, USER_SPI_GET_STATS, &profile_record.disk);
+
+    return sdlog_append(SDLOG_PROFILE, &profile_record,
+                        sizeof(profile_record));
+}
@@ -0,0 +1,164 @@
+#include "retain.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "main.h"
+#include "stm32l4xx_hal.h"
+
+#define RETAIN_RECORD_SIZE(size) \
+    ((sizeof(struct retain_log_record_t) + (size) + 3) & ~3u)
+
+/**
+ * State kept in SRAM2 between wakes. SRAM2 keeps its content in standby while
+ * retention is enabled, but not through a power loss, so the record is only
+ * used when its magic, version, size and CRC all match. Otherwise it starts
+ * out empty. SRAM2 parity checking must stay disabled (the default option
+ * bytes), as reading it after power up would fault otherwise.
+ */
+struct retain_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;  // bytes covered by the record, up to the end of the stage
+    uint32_t crc;   // CRC-32 of the bytes after this field, up to size
+    struct retain_volume_t volume;
+    struct retain_library_t library;
+    uint32_t stage_used;
+    uint8_t stage[RETAIN_STAGE_SIZE] __attribute__((aligned(4)));
+};
+
+_Static_assert(sizeof(struct retain_t) <= 8 * 1024,
+               "retained record does not fit in SRAM2");
+
+RETAINED static struct retain_t retain;
+
+static uint32_t crc32(const uint8_t* data, uint32_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t retain_crc() {
+    const uint8_t* record = (const uint8_t*)&retain;
+    uint32_t start = offsetof(struct retain_t, crc) + sizeof(retain.crc);
+    return crc32(record + start, retain.size - start);
+}
+
+/**
+ * @brief Check the record left in SRAM2 by the previous wake, and clear it if
+ * it isn't valid. Must be called before any of the accessors below.
+ *
+ * @return true if a valid record was found
+ */
+bool retain_load() {
+    if (retain.magic == RETAIN_MAGIC && retain.version == RETAIN_VERSION &&
+        retain.stage_used <= RETAIN_STAGE_SIZE &&
+        retain.size == offsetof(struct retain_t, stage) + retain.stage_used &&
+        retain.crc == retain_crc()) {
+        return true;
+    }
+
+    memset(&retain, 0, offsetof(struct retain_t, stage));
+    return false;
+}
+
+/**
+ * @brief Seal the record and keep SRAM2 powered in standby. Called last
+ * thing before entering standby.
+ */
+void retain_commit() {
+    retain.magic = RETAIN_MAGIC;
+    retain.version = RETAIN_VERSION;
+    retain.size = offsetof(struct retain_t, stage) + retain.stage_used;
+    retain.crc = retain_crc();
+
+    if (SRAM2_RETENTION) HAL_PWREx_EnableSRAM2ContentRetention();
+}
+
+/**
+ * @brief Store the geometry of the mounted volume, or a zeroed one to clear
+ * it.
+ */
+void retain_set_volume(const struct retain_volume_t* volume) {
+    retain.volume = *volume;
+}
+
+/**
+ * @brief Get the geometry of the volume mounted by a previous wake.
+ *
+ * @return false if there is none
+ */
+bool retain_get_volume(struct retain_volume_t* volume) {
+    *volume = retain.volume;
+    return volume->fs_type != 0;
+}
+
+/**
+ * @brief Store the image library found by a full lookup, or a zero count to
+ * clear it.
+ */
+void retain_set_library(const struct retain_library_t* library) {
+    retain.library = *library;
+}
+
+/**
+ * @brief Get the image library found by the last full lookup.
+ *
+ * @return false if there is none
+ */
+bool retain_get_library(struct retain_library_t* library) {
+    *library = retain.library;
+    return library->count != 0;
+}
+
+/**
+ * @brief Keep a log record until the card is next mounted. Records are
+ * lost on a power loss.
+ *
+ * @param log: log the record is for
+ * @param wake: wake cycle count the record was made in
+ * @return false if there is no room left for the record, or SRAM2 isn't
+ * retained
+ */
+bool retain_stage_log(uint8_t log, uint32_t wake, const void* data,
+                      uint16_t size) {
+    uint32_t record_size = RETAIN_RECORD_SIZE(size);
+    if (!SRAM2_RETENTION) return false;
+    if (retain.stage_used + record_size > RETAIN_STAGE_SIZE) return false;
+
+    struct retain_log_record_t* record =
+        (struct retain_log_record_t*)&retain.stage[retain.stage_used];
+    record->log = log;
+    record->reserved = 0;
+    record->size = size;
+    record->wake = wake;
+    memcpy(record->data, data, size);
+
+    retain.stage_used += record_size;
+    return true;
+}
+
+/**
+ * @brief Iterate over the staged log records, oldest first.
+ *
+ * @param pos: position of the next record, start from 0
+ * @return the record at pos, or NULL after the last one
+ */
+const struct retain_log_record_t* retain_staged_log(uint32_t* pos) {
+    if (*pos >= retain.stage_used) return NULL;
+
+    const struct retain_log_record_t* record =
+        (const struct retain_log_record_t*)&retain.stage[*pos];
+    *pos += RETAIN_RECORD_SIZE(record->size);
+    return record;
+}
+
+/**
+ * @brief Drop all staged log records, once they have been written.
+ */
+void retain_clear_staged_logs() { retain.stage_used = 0; }
@@ -0,0 +1,179 @@
+#include "sched.h"
+
+#include <string.h>
+
+#include "aeon.h"
+#include "batt.h"
+#include "fram.h"
+#include "trace.h"
+
+#define SCHED_DAY_SECONDS (24UL * 60 * 60)
+#define SCHED_SLOT_SECONDS (SCHED_DAY_SECONDS / FRAM_HARVEST_SLOTS)
+#define SCHED_LEARN_MIN_SECONDS (60UL * 60)  // shorter spans are mostly noise
+#define SCHED_LEARN_MAX_SECONDS \
+    (SCHED_STRETCH_MAX * SCHED_DAY_SECONDS)  // longest stretched interval
+#define SCHED_HARVEST_WEIGHT 4  // each new span moves the slots by a quarter
+
+/**
+ * @brief Part of the day an RTC time falls in.
+ *
+ * The RTC runs from the LSI, which is only accurate to a few %, and its
+ * calendar restarts from an arbitrary date and time after power loss. The
+ * slots are therefore parts of the RTC's own day, not of the real one: which
+ * of them the daylight falls in is learnt rather than assumed, it drifts by
+ * up to about 45 minutes a day, and it is lost when the calendar restarts.
+ * SCHED_HARVEST_WEIGHT keeps the history to the last few wakes, short enough
+ * to follow the drift.
+ */
+static uint8_t sched_slot(uint32_t time) {
+    return (time % SCHED_DAY_SECONDS) / SCHED_SLOT_SECONDS;
+}
+
+/**
+ * @brief Learn the harvest history from the rest voltage measured by
+ * batt_measure.
+ *
+ * The net change of the rest voltage since the previous wake is compared to
+ * what the history predicts for the parts of the day the span covered, and
+ * the difference is shared out between them by the time the span spent in
+ * each. Spans within one part of the day set it directly, while spans of a
+ * day or more, as with the usual refresh intervals, only tell the parts
+ * apart as the time of day the wakes fall on moves, e.g. with stretched
+ * intervals and harvest waits.
+ */
+void sched_update() {
+    struct fram_sched_state_t state;
+    fram_get_sched_state(&state);
+    uint32_t now = rtc_get_seconds();
+
+    if (state.last_mv != 0 && now < state.last_time) {
+        // the calendar restarted after power loss, so the slots moved
+        memset(state.harvest_mv_per_day, 0, sizeof(state.harvest_mv_per_day));
+        state.last_mv = 0;
+    }
+
+    uint32_t span = now - state.last_time;
+    if (state.last_mv != 0 && span >= SCHED_LEARN_MIN_SECONDS &&
+        span <= SCHED_LEARN_MAX_SECONDS) {
+        // seconds of the span in each part of the day
+        int64_t covered[FRAM_HARVEST_SLOTS] = {0};
+        for (uint32_t time = state.last_time; time < now;) {
+            uint32_t next =
+                time - time % SCHED_SLOT_SECONDS + SCHED_SLOT_SECONDS;
+            if (next > now) next = now;
+            covered[sched_slot(time)] += next - time;
+            time = next;
+        }
+
+        int64_t predicted = 0, norm = 0;
+        for (uint8_t slot = 0; slot < FRAM_HARVEST_SLOTS; slot++) {
+            predicted += state.harvest_mv_per_day[slot] * covered[slot];
+            norm += covered[slot] * covered[slot];
+        }
+        int64_t error = ((int32_t)batt_status.mv - state.last_mv) -
+                        predicted / (int64_t)SCHED_DAY_SECONDS;
+
+        for (uint8_t slot = 0; slot < FRAM_HARVEST_SLOTS; slot++) {
+            if (covered[slot] == 0) continue;
+            int32_t harvest = state.harvest_mv_per_day[slot] +
+                              error * covered[slot] *
+                                  (int64_t)SCHED_DAY_SECONDS /
+                                  (norm * SCHED_HARVEST_WEIGHT);
+            if (harvest > INT16_MAX) harvest = INT16_MAX;
+            if (harvest < INT16_MIN) harvest = INT16_MIN;
+            state.harvest_mv_per_day[slot] = harvest;
+
+            TRACE2(TRACE_SCHED_HARVEST, slot, harvest);
+        }
+    }
+
+    state.last_mv = batt_status.mv;
+    state.last_time = now;
+    fram_set_sched_state(&state);
+}
+
+/**
+ * @brief Plan the refresh of this wake and the interval to the next one from
+ * the battery readings of batt_measure.
+ *
+ * While the rest voltage trend would use up the charge above the refresh
+ * threshold within SCHED_RUNWAY_DAYS, the interval is stretched in
+ * proportion, up to SCHED_STRETCH_MAX times the switch setting, so frames
+ * that harvest too little slow down instead of running flat. With little
+ * headroom left the clearing pass, a second full panel refresh, is skipped as
+ * well. A nearly full battery that is still charging would waste its harvest,
+ * so the interval is shortened instead.
+ *
+ * @param interval_sw_value: refresh interval in hours from the switches, 0 for
+ * 24 hours
+ * @param plan: set to the plan
+ */
+void sched_plan(uint16_t interval_sw_value, struct sched_plan_t* plan) {
+    uint32_t interval = (interval_sw_value == 0 ? 24 : interval_sw_value) *
+                        60UL * 60;  // as calculate_update_sleep_duration
+    uint32_t quarters = 4;          // interval scale, in quarters
+
+    int32_t above = (int32_t)batt_status.mv - batt_status.required_mv;
+    if (batt_status.trend_mv_per_day < 0 && above > 0) {
+        // days until the threshold is reached, compared to the runway wanted
+        uint32_t stretch = 4UL * SCHED_RUNWAY_DAYS *
+                           -batt_status.trend_mv_per_day / above;
+        if (stretch > quarters) quarters = stretch;
+    }
+    if (batt_status.headroom < SCHED_TIGHT_HEADROOM_PCT && quarters < 8) {
+        quarters = 8;
+    }
+    if (quarters > 4 * SCHED_STRETCH_MAX) quarters = 4 * SCHED_STRETCH_MAX;
+
+    plan->budget = SCHED_BUDGET_NORMAL;
+    if (quarters > 4) {
+        plan->budget = SCHED_BUDGET_TIGHT;
+    } else if (batt_status.soc >= SCHED_SURPLUS_SOC && batt_charging()) {
+        plan->budget = SCHED_BUDGET_SURPLUS;
+        quarters = 4 / SCHED_SHORTEN_MAX;
+    }
+
+    plan->interval = interval / 4 * quarters;
+    if (plan->interval < SCHED_INTERVAL_MIN) {
+        plan->interval = interval < SCHED_INTERVAL_MIN ? interval
+                                                       : SCHED_INTERVAL_MIN;
+    }
+    plan->clear = batt_status.headroom >= SCHED_TIGHT_HEADROOM_PCT;
+
+    TRACE3(TRACE_SCHED_PLAN, plan->budget, plan->interval, plan->clear);
+}
+
+/**
+ * @brief Check whether a due refresh should wait for a part of the day that
+ * harvests more, so its charge is put back sooner. Only waits up to a quarter
+ * of the interval, and no longer than SCHED_WAIT_MAX.
+ *
+ * @param plan: plan of this wake from sched_plan
+ * @return seconds to wait, 0 to refresh now
+ */
+uint32_t sched_harvest_wait(const struct sched_plan_t* plan) {
+    if (plan->budget == SCHED_BUDGET_SURPLUS) return 0;
+
+    struct fram_sched_state_t state;
+    fram_get_sched_state(&state);
+
+    uint32_t now = rtc_get_seconds();
+    uint8_t slot = sched_slot(now);
+    int16_t current = state.harvest_mv_per_day[slot];
+    if (current >= SCHED_HARVEST_MIN_MV_PER_DAY) return 0;
+
+    uint32_t limit = plan->interval / 4;
+    if (limit > SCHED_WAIT_MAX) limit = SCHED_WAIT_MAX;
+
+    // start of each following part of the day, earliest first
+    uint32_t wait = SCHED_SLOT_SECONDS - now % SCHED_SLOT_SECONDS;
+    for (uint8_t i = 1; i < FRAM_HARVEST_SLOTS && wait <= limit; i++) {
+        int16_t harvest =
+            state.harvest_mv_per_day[(slot + i) % FRAM_HARVEST_SLOTS];
+        if (harvest >= SCHED_HARVEST_MIN_MV_PER_DAY && harvest > current) {
+            return wait;
+        }
+        wait += SCHED_SLOT_SECONDS;
+    }
+    return 0;
+}
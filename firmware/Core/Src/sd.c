@@ -5,171 +5,825 @@
 #include <string.h>
 
 #include "aeon.h"
+#include "arena.h"
+#include "batt.h"
+#include "diskio.h"
 #include "ff.h"
 #include "fram.h"
+#include "img.h"
 #include "main.h"
+#include "retain.h"
+#include "sdlog.h"
+#include "shuffle.h"
+#include "trace.h"
+
+// fields of a FAT directory entry, as used by FatFs
+#define SD_DIR_ATTR 11
+#define SD_DIR_FSTCLUSHI 20
+#define SD_DIR_FSTCLUSLO 26
+#define SD_DIR_FILESIZE 28
+
+// volume serial number in the boot sector of FAT12/16 and of FAT32 volumes
+#define SD_BS_VOLID 39
+#define SD_BS_VOLID32 67
+
+#define SD_PREPARE_ATTEMPTS 3  // images tried when preparing the next one
+
+_Static_assert(sizeof(((struct sd_image_t*)0)->path) ==
+                   FRAM_NEXT_IMAGE_PATH_SIZE,
+               "prepared image path size differs");
+
+// sd_mount_retained sets up the FATFS object the way find_volume in ff.c does,
+// and sd_dir_entry shares its sector window. Check that FatFs and its
+// configuration are still the ones this was written against.
+_Static_assert(_FATFS == 68300, "check sd_mount_retained against ff.c");
+_Static_assert(!_FS_EXFAT && !_FS_REENTRANT && !_FS_READONLY &&
+                   _FS_RPATH != 0 && _MAX_SS == _MIN_SS && _VOLUMES == 1,
+               "sd_mount_retained doesn't set up the FATFS fields of this "
+               "configuration");
+
+#define SD_FATFS_FIELD(field, type) \
+    (sizeof(((FATFS*)0)->field) == sizeof(type))
+_Static_assert(SD_FATFS_FIELD(fs_type, BYTE) && SD_FATFS_FIELD(drv, BYTE) &&
+                   SD_FATFS_FIELD(n_fats, BYTE) &&
+                   SD_FATFS_FIELD(wflag, BYTE) &&
+                   SD_FATFS_FIELD(fsi_flag, BYTE) &&
+                   SD_FATFS_FIELD(id, WORD) &&
+                   SD_FATFS_FIELD(n_rootdir, WORD) &&
+                   SD_FATFS_FIELD(csize, WORD) &&
+                   SD_FATFS_FIELD(last_clst, DWORD) &&
+                   SD_FATFS_FIELD(free_clst, DWORD) &&
+                   SD_FATFS_FIELD(cdir, DWORD) &&
+                   SD_FATFS_FIELD(n_fatent, DWORD) &&
+                   SD_FATFS_FIELD(fsize, DWORD) &&
+                   SD_FATFS_FIELD(volbase, DWORD) &&
+                   SD_FATFS_FIELD(fatbase, DWORD) &&
+                   SD_FATFS_FIELD(dirbase, DWORD) &&
+                   SD_FATFS_FIELD(database, DWORD) &&
+                   SD_FATFS_FIELD(winsect, DWORD) &&
+                   SD_FATFS_FIELD(win, BYTE[_MIN_SS]),
+               "FATFS fields set by sd_mount_retained changed");
+
+NOINIT static FATFS sd_fs;  // set up by f_mount
+static bool sd_mounted = false;
+static uint32_t sd_serial;  // of the mounted volume, 0 if unknown
+static bool sd_next_image_checked;  // prepared image looked up in this wake
+
+/**
+ * @brief Get the volume serial number from the start of a boot sector.
+ */
+static uint32_t sd_bpb_serial(const uint8_t* bpb, uint8_t fs_type) {
+    uint32_t serial;
+    memcpy(&serial, &bpb[fs_type == FS_FAT32 ? SD_BS_VOLID32 : SD_BS_VOLID],
+           sizeof(serial));
+    return serial;
+}
+
+/**
+ * @brief Mount the volume with the geometry retained from a previous wake.
+ *
+ * Only the boot sector is read, to check it still matches, instead of the
+ * partition table, boot sector and FSInfo read by a full mount. The volume is
+ * then set up as f_mount would, which skips mounting again as long as the
+ * drive stays initialised. FSInfo is left unused, so the free cluster count
+ * is unknown and never written back. The FatFs revision and the fields this
+ * depends on are checked at compile time above.
+ */
+static bool sd_mount_retained(const struct retain_volume_t* volume) {
+    if (f_mount(&sd_fs, "", 0) != FR_OK) return false;
+
+    sd_fs.drv = 0;
+    if (disk_initialize(sd_fs.drv) & STA_NOINIT) return false;
+    if (disk_read(sd_fs.drv, sd_fs.win, volume->volbase, 1) != RES_OK ||
+        memcmp(sd_fs.win, volume->bpb, RETAIN_BPB_SIZE) != 0 ||
+        sd_fs.win[510] != 0x55 || sd_fs.win[511] != 0xAA) {
+        return false;
+    }
+
+    sd_fs.winsect = volume->volbase;
+    sd_fs.wflag = 0;
+    sd_fs.n_fats = volume->n_fats;
+    sd_fs.n_rootdir = volume->n_rootdir;
+    sd_fs.csize = volume->csize;
+    sd_fs.volbase = volume->volbase;
+    sd_fs.fatbase = volume->fatbase;
+    sd_fs.dirbase = volume->dirbase;
+    sd_fs.database = volume->database;
+    sd_fs.fsize = volume->fsize;
+    sd_fs.n_fatent = volume->n_fatent;
+    sd_fs.last_clst = sd_fs.free_clst = 0xFFFFFFFF;
+    sd_fs.fsi_flag = 0x80;  // FSInfo disabled
+    sd_fs.cdir = 0;
+    sd_fs.id = 1;
+    sd_fs.fs_type = volume->fs_type;
+    sd_serial = sd_bpb_serial(volume->bpb, volume->fs_type);
+    return true;
+}
+
+/**
+ * @brief Retain the geometry of a freshly mounted volume for later wakes, and
+ * note its serial number.
+ */
+static void sd_retain_volume() {
+    struct retain_volume_t volume = {0};
+
+    // the window holds FSInfo after mounting FAT32, load the boot sector
+    if (disk_read(sd_fs.drv, sd_fs.win, sd_fs.volbase, 1) == RES_OK) {
+        sd_fs.winsect = sd_fs.volbase;
+        sd_serial = sd_bpb_serial(sd_fs.win, sd_fs.fs_type);
+
+        memcpy(volume.bpb, sd_fs.win, RETAIN_BPB_SIZE);
+        volume.fs_type = sd_fs.fs_type;
+        volume.n_fats = sd_fs.n_fats;
+        volume.n_rootdir = sd_fs.n_rootdir;
+        volume.csize = sd_fs.csize;
+        volume.volbase = sd_fs.volbase;
+        volume.fatbase = sd_fs.fatbase;
+        volume.dirbase = sd_fs.dirbase;
+        volume.database = sd_fs.database;
+        volume.fsize = sd_fs.fsize;
+        volume.n_fatent = sd_fs.n_fatent;
+    }
+    retain_set_volume(&volume);
+}
 
 /**
  * @brief Initialise the SD card and mount the filesystem.
  *
- * @param FatFs
+ * The geometry of the volume is retained in SRAM2, so later wakes mount the
+ * same card with a single sector read. A different or reformatted card is
+ * mounted in full, and the image library retained for the old one dropped.
  */
-bool sd_init(FATFS* FatFs) {
+bool sd_init() {
     FRESULT fres;
-    fres = f_mount(FatFs, "", 1);  // 1=mount now
+    struct retain_volume_t volume;
+
+    if (sd_mounted) return true;
+
+    if (retain_get_volume(&volume) && sd_mount_retained(&volume)) {
+        TRACE0(TRACE_SD_MOUNT_RETAINED);
+        sd_mounted = true;
+        return true;
+    }
+
+    struct retain_library_t library = {0};
+    retain_set_library(&library);
+
+    fres = f_mount(&sd_fs, "", 1);  // 1=mount now
     if (fres != FR_OK) {
-        printf("f_mount error (%i)\r\n", fres);
+        TRACE1(TRACE_F_MOUNT_ERROR, fres);
         return false;
     }
+    sd_retain_volume();
+    sd_mounted = true;
     return true;
 }
 
 /**
- * @brief Unmount the filesystem.
+ * @brief Check whether the filesystem is mounted in this wake.
  */
-void sd_close() { f_mount(NULL, "", 0); }
+bool sd_is_mounted() { return sd_mounted; }
 
 /**
- * @brief Write the debug output buffer to a logfile on the SD card.
+ * @brief Get the mounted volume, for writing to preallocated files directly.
  */
-void sd_write_logfile() {
-    FIL fil;
-    FRESULT fres;
+FATFS* sd_get_fs() { return &sd_fs; }
+
+/**
+ * @brief Get the serial number of the mounted volume, 0 if unknown.
+ */
+uint32_t sd_volume_serial() { return sd_serial; }
+
+/**
+ * @brief Unmount the filesystem.
+ */
+void sd_close() {
+    if (sd_mounted) f_mount(NULL, "", 0);
+    sd_mounted = false;
+    sd_serial = 0;
+}
 
-    fres = f_mkdir("/logfiles");
-    if (fres != FR_OK && fres != FR_EXIST) return;
+/**
+ * @brief Log battery charge information to the battery ring log, as a CSV
+ * line: wake cycle, voltage, wake and sleep reasons, sleep seconds, state of
+ * charge and headroom in %, refresh load drop in mV and trend in mV/day.
+ */
+void sd_append_batt_charge_log(int sleep_seconds) {
+    enum sleep_reason_t sleep_reason = fram_get_sleep_reason();
+    const char* sleep_reason_str = sleep_reason_t_str[sleep_reason];
 
-    fres = f_chdir("/logfiles");
-    if (fres != FR_OK) return;
+    const char* wake_reason_str = wake_reason_t_str[wake_reason];
 
-    char filename[41] = {0};
-    sprintf(filename, "log_%lu.txt", wake_cycle_count);
+    // Prepare the log entry
+    // voltage formatted from an integer, so float printf support isn't needed
+    uint32_t batt_centivolts = (batt_status.mv + 5) / 10;
+    char log_entry[120];
+    snprintf(log_entry, sizeof(log_entry),
+             "%lu,%lu.%02lu,%s,%s,%d,%u,%d,%u,%d\r\n", wake_cycle_count,
+             batt_centivolts / 100, batt_centivolts % 100, wake_reason_str,
+             sleep_reason_str, sleep_seconds, batt_status.soc,
+             batt_status.headroom, batt_status.sag_mv,
+             batt_status.trend_mv_per_day);
+
+    sdlog_append(SDLOG_BATT, log_entry, strlen(log_entry));
+}
 
-    fres = f_open(&fil, filename, FA_WRITE | FA_OPEN_ALWAYS | FA_OPEN_APPEND);
-    if (fres != FR_OK) return;
+/**
+ * @brief Open the image catalog and read its header.
+ *
+ * @param catalog: file object to open the catalog with
+ * @param header: filled with the catalog header
+ * @return true if a valid catalog was opened, the file is closed otherwise
+ */
+static bool sd_catalog_open(FIL* catalog, struct sd_catalog_header_t* header) {
+    UINT bytesRead;
+
+    if (f_open(catalog, SD_CATALOG_PATH, FA_READ) != FR_OK) return false;
+
+    if (f_read(catalog, header, sizeof(*header), &bytesRead) != FR_OK ||
+        bytesRead != sizeof(*header) || header->magic != SD_CATALOG_MAGIC ||
+        header->version != SD_CATALOG_VERSION ||
+        header->entry_size < sizeof(struct sd_catalog_entry_t) ||
+        f_size(catalog) <
+            sizeof(*header) + (FSIZE_t)header->count * header->entry_size) {
+        f_close(catalog);
+        return false;
+    }
+    return true;
+}
 
-    UINT bytesWrote;
-    fres = f_write(&fil, debug_output_arr, debug_output_arr_index, &bytesWrote);
-    if (fres != FR_OK) return;
+/**
+ * @brief Read the catalog entry of an image.
+ */
+static bool sd_catalog_read_entry(FIL* catalog,
+                                  const struct sd_catalog_header_t* header,
+                                  uint32_t index,
+                                  struct sd_catalog_entry_t* entry) {
+    UINT bytesRead;
+
+    if (index >= header->count) return false;
+    if (f_lseek(catalog, sizeof(*header) + index * header->entry_size) !=
+        FR_OK)
+        return false;
+    return f_read(catalog, entry, sizeof(*entry), &bytesRead) == FR_OK &&
+           bytesRead == sizeof(*entry);
+}
 
-    fres = f_close(&fil);
-    if (fres != FR_OK) return;
+/**
+ * @brief Generate the path of an image from its index.
+ *
+ * @param path_buf: filled with the absolute path of the image
+ * @param index: image index
+ * @param sharded: images are split into subdirectories of SD_IMAGES_PER_SHARD
+ */
+static void sd_image_path(char* path_buf, uint32_t index, bool sharded) {
+    if (sharded) {
+        sprintf(path_buf, "/images/%03lu/%lu.slc", index / SD_IMAGES_PER_SHARD,
+                index);
+    } else {
+        sprintf(path_buf, "/images/%lu.slc", index);
+    }
+}
 
-    f_chdir("/");
+/**
+ * @brief Count the images in a directory by enumerating it. Only used when
+ * there is no catalog.
+ *
+ * @return number of images, or -1 if the directory can't be opened
+ */
+static int32_t sd_count_images(const char* path) {
+    DIR dir;
+    FILINFO fno;
+    int32_t count = 0;
+
+    if (f_opendir(&dir, path) != FR_OK) return -1;
+    for (;;) {
+        if (f_readdir(&dir, &fno) != FR_OK || fno.fname[0] == '\0') break;
+
+        // only count image files, not directories or the catalog
+        char* ext = strrchr(fno.fname, '.');
+        if (!(fno.fattrib & AM_DIR) && ext != NULL &&
+            strcmp(ext, ".slc") == 0) {
+            count++;
+        }
+    }
+    f_closedir(&dir);
+    return count;
 }
 
 /**
- * @brief Log battery charge information to a CSV file.
+ * @brief Count the images in every shard directory. Only used when there is
+ * no catalog.
  */
-void sd_append_batt_charge_log(int sleep_seconds) {
-    FIL fil;
-    FRESULT fres;
-    UINT bytesWrote;
+static uint32_t sd_count_sharded_images() {
+    char path[16];
+    uint32_t count = 0;
 
-    fres = f_mkdir("/logfiles");
-    if (fres != FR_OK && fres != FR_EXIST) return;
+    for (uint32_t shard = 0;; shard++) {
+        sprintf(path, "/images/%03lu", shard);
+        int32_t shard_count = sd_count_images(path);
+        if (shard_count <= 0) break;
 
-    // Check if the file exists
-    fres = f_stat("/logfiles/batt-charge.csv", NULL);
-    bool file_exists = (fres == FR_OK);
+        count += shard_count;
+        if (shard_count < SD_IMAGES_PER_SHARD) break;  // last shard
+    }
+    return count;
+}
 
-    // Open the file for appending, create if it doesn't exist
-    fres = f_open(&fil, "/logfiles/batt-charge.csv", FA_WRITE | FA_OPEN_APPEND);
-    if (fres != FR_OK) return;
+/**
+ * @brief Pick the next image to display out of count images, advancing the
+ * stored sequence or shuffle state.
+ *
+ * @param count: number of images, must not be 0
+ * @param shuffle_enabled: pick from a shuffled sequence instead of in order
+ */
+static uint32_t sd_select_index(uint32_t count, bool shuffle_enabled) {
+    uint32_t img_counter = fram_get_image_counter();
+    uint32_t index;
 
-    // If the file was just created, write the header
-    if (!file_exists) {
-        const char* header =
-            "BootIteration,BatteryVoltage,WakeReason,SleepReason,"
-            "SleepDurationSeconds\r\n";
-        fres = f_write(&fil, header, strlen(header), &bytesWrote);
-        if (fres != FR_OK) {
-            f_close(&fil);
-            return;
+    if (!shuffle_enabled) {
+        index = img_counter < count ? img_counter : 0;
+        fram_set_image_counter(index + 1);
+        return index;
+    }
+
+    // walk a seeded permutation of all images, so every image is shown once
+    // before any repeats
+    uint32_t seed, position, shuffle_count;
+    fram_get_shuffle_state(&seed, &position, &shuffle_count);
+
+    if (position >= count || shuffle_count != count) {
+        // start a new pass (or the library changed), with a new seed that
+        // doesn't start on the image currently displayed
+        for (int attempt = 0; attempt < 4; attempt++) {
+            uint32_t random;
+            if (HAL_RNG_GenerateRandomNumber(&hrng, &random) != HAL_OK) {
+                TRACE0(TRACE_RNG_ERROR);
+                random = seed + 0x9E3779B9;
+            }
+            seed = random;
+            if (count < 2 || shuffle_permute(0, count, seed) != img_counter)
+                break;
         }
+        position = 0;
     }
 
-    enum sleep_reason_t sleep_reason = fram_get_sleep_reason();
-    const char* sleep_reason_str = sleep_reason_t_str[sleep_reason];
+    index = shuffle_permute(position, count, seed);
+    fram_set_shuffle_state(seed, position + 1, count);
 
-    const char* wake_reason_str = wake_reason_t_str[wake_reason];
+    fram_set_image_counter(index);  // store the index
+    return index;
+}
 
-    // Prepare the log entry
-    char log_entry[100];
-    snprintf(log_entry, sizeof(log_entry), "%lu,%.2f,%s,%s,%d\r\n",
-             wake_cycle_count, batt_voltage, wake_reason_str, sleep_reason_str,
-             sleep_seconds);
+/**
+ * @brief Set up fast seek for the album, so seeking to a frame doesn't walk
+ * its FAT chain.
+ *
+ * Building the cluster link map walks the whole chain once. If the album
+ * turns out to be a single fragment, its start cluster and size are stored
+ * so later wakes can build the map without touching the FAT.
+ */
+static void sd_album_enable_fast_seek(FIL* fp) {
+    DWORD* album_clmt = arena.image.album_clmt;
+    uint32_t sclust, size;
+
+    fp->cltbl = album_clmt;
+
+    fram_get_album_layout(&sclust, &size);
+    if (sclust != 0 && sclust == fp->obj.sclust && size == f_size(fp)) {
+        DWORD cluster_bytes = (DWORD)fp->obj.fs->csize * _MIN_SS;
+        album_clmt[0] = 4;  // table size, then one (length, start) fragment
+        album_clmt[1] = (size + cluster_bytes - 1) / cluster_bytes;
+        album_clmt[2] = sclust;
+        album_clmt[3] = 0;  // end of table
+        return;
+    }
 
-    // Write the log entry to the file
-    fres = f_write(&fil, log_entry, strlen(log_entry), &bytesWrote);
-    f_close(&fil);
+    album_clmt[0] = SD_ALBUM_CLMT_SIZE;
+    if (f_lseek(fp, CREATE_LINKMAP) != FR_OK) {
+        // too fragmented for the table, fall back to normal seeking
+        fp->cltbl = NULL;
+        fram_set_album_layout(0, 0);
+        return;
+    }
+
+    if (album_clmt[0] == 4) {
+        fram_set_album_layout(fp->obj.sclust, f_size(fp));
+    } else {
+        fram_set_album_layout(0, 0);
+    }
 }
 
-bool sd_get_next_image_filename(char* filename_buf, bool shuffle_enabled) {
-    FRESULT fres;
+/**
+ * @brief Open the album file and read its header.
+ *
+ * @return true if a valid album was opened, the file is closed otherwise
+ */
+static bool sd_album_open(FIL* fp, struct sd_album_header_t* header) {
+    UINT bytesRead;
+
+    if (f_open(fp, SD_ALBUM_PATH, FA_READ) != FR_OK) return false;
+
+    if (f_read(fp, header, sizeof(*header), &bytesRead) != FR_OK ||
+        bytesRead != sizeof(*header) || header->magic != SD_ALBUM_MAGIC ||
+        header->version != SD_ALBUM_VERSION ||
+        header->entry_size < sizeof(struct sd_album_entry_t) ||
+        header->count == 0 ||
+        f_size(fp) <
+            sizeof(*header) + (FSIZE_t)header->count * header->entry_size) {
+        f_close(fp);
+        return false;
+    }
+
+    sd_album_enable_fast_seek(fp);
+    return true;
+}
 
-    fres = f_chdir("/images");
-    if (fres != FR_OK) return false;
+/**
+ * @brief Select the next image from the album and seek to it.
+ */
+static bool sd_album_open_next_image(FIL* fp,
+                                     const struct sd_album_header_t* header,
+                                     bool shuffle_enabled,
+                                     struct sd_image_t* image) {
+    UINT bytesRead;
+    struct sd_album_entry_t entry;
+
+    image->index = sd_select_index(header->count, shuffle_enabled);
+
+    if (f_lseek(fp, sizeof(*header) + image->index * header->entry_size) !=
+            FR_OK ||
+        f_read(fp, &entry, sizeof(entry), &bytesRead) != FR_OK ||
+        bytesRead != sizeof(entry) || entry.length == 0 ||
+        entry.offset + entry.length > f_size(fp)) {
+        return false;
+    }
+
+    strcpy(image->path, SD_ALBUM_PATH);
+    image->offset = entry.offset;
+    image->size = entry.length;
 
+    return f_lseek(fp, entry.offset) == FR_OK;
+}
+
+/**
+ * @brief Select the next image from the library retained by an earlier
+ * lookup, skipping the catalog and directory scan. The stored sequence is
+ * left unchanged if the image can't be opened.
+ */
+static bool sd_library_open_next_image(FIL* fp,
+                                       const struct retain_library_t* library,
+                                       bool shuffle_enabled,
+                                       struct sd_image_t* image) {
     uint32_t img_counter = fram_get_image_counter();
-    if (!shuffle_enabled) {
-        sprintf(filename_buf, "%lu.slc", img_counter);
+    uint32_t seed, position, shuffle_count;
+    fram_get_shuffle_state(&seed, &position, &shuffle_count);
 
-        fres = f_stat(filename_buf, NULL);
+    image->index = sd_select_index(library->count, shuffle_enabled);
+    sd_image_path(image->path, image->index,
+                  library->flags & SD_LIBRARY_FLAG_SHARDED);
+    if (f_open(fp, image->path, FA_READ) == FR_OK) return true;
 
-        if (fres == FR_OK) {
-            fram_set_image_counter(img_counter + 1);
-            return true;
-        } else if (fres == FR_NO_FILE) {
-            // if file does not exist, reset counter
-            fram_set_image_counter(1);
-            memcpy(filename_buf, "0.slc", 6);
-        } else {
+    fram_set_image_counter(img_counter);
+    fram_set_shuffle_state(seed, position, shuffle_count);
+    return false;
+}
+
+/**
+ * @brief Load a directory sector into the volume's window.
+ *
+ * @param sect: sector holding the entry
+ * @param offset: offset of the entry within the sector
+ * @return the directory entry, or NULL if the sector can't be read
+ */
+static const uint8_t* sd_dir_entry(uint32_t sect, uint16_t offset) {
+    if (offset > _MIN_SS - FRAM_DIR_ENTRY_SIZE) return NULL;
+
+    if (sd_fs.winsect != sect) {
+        if (sd_fs.wflag) return NULL;  // window holds an unwritten change
+        if (disk_read(sd_fs.drv, sd_fs.win, sect, 1) != RES_OK) {
+            sd_fs.winsect = 0xFFFFFFFF;  // invalidate the window
+            return NULL;
+        }
+        sd_fs.winsect = sect;
+    }
+    return &sd_fs.win[offset];
+}
+
+/**
+ * @brief Check that an image opened from its first cluster is the one it was
+ * listed as. A stale catalog may point at another image, which passes that
+ * image's own header and CRC checks, so its size must agree with the listed
+ * one. Images converted before the container are checked against the catalog
+ * CRC as they are read instead.
+ *
+ * @param fp: image file, at its first byte, and left there
+ * @param size: image size listed in the catalog
+ */
+static bool sd_cluster_image_matches(FIL* fp, uint32_t size) {
+    struct img_header_t header;
+    UINT bytesRead;
+
+    bool match = f_read(fp, &header, sizeof(header), &bytesRead) == FR_OK &&
+                 bytesRead == sizeof(header);
+    if (match && header.magic == IMG_MAGIC) {
+        match = header.header_size <= size &&
+                header.payload_size == size - header.header_size;
+    } else if (match) {
+        match = header.magic == SLIC_MAGIC;
+    }
+    return f_lseek(fp, 0) == FR_OK && match;
+}
+
+/**
+ * @brief Open the image picked by the previous refresh from its directory
+ * entry, without following its path. The entry must match the one seen when
+ * the image was picked, so a file that was changed, moved or deleted since
+ * isn't used. An image found through the catalog's start cluster is opened
+ * from there again, and its size checked against the catalog's.
+ */
+static bool sd_open_prepared_image(FIL* fp,
+                                   const struct fram_next_image_t* next,
+                                   struct sd_image_t* image) {
+    uint32_t sclust = next->sclust, size = next->size;
+
+    if (next->dir_sect != 0) {
+        const uint8_t* entry = sd_dir_entry(next->dir_sect, next->dir_offset);
+        if (entry == NULL ||
+            memcmp(entry, next->dir_entry, FRAM_DIR_ENTRY_SIZE) != 0 ||
+            (entry[SD_DIR_ATTR] & AM_DIR)) {
+            return false;
+        }
+
+        uint16_t clust_lo, clust_hi;
+        memcpy(&clust_lo, &entry[SD_DIR_FSTCLUSLO], sizeof(clust_lo));
+        memcpy(&clust_hi, &entry[SD_DIR_FSTCLUSHI], sizeof(clust_hi));
+        memcpy(&size, &entry[SD_DIR_FILESIZE], sizeof(size));
+        sclust = clust_lo;
+        if (sd_fs.fs_type == FS_FAT32) sclust |= (uint32_t)clust_hi << 16;
+    }
+
+    if (f_open_cluster(fp, sclust, size) != FR_OK) return false;
+    if (next->dir_sect == 0 && !sd_cluster_image_matches(fp, size)) {
+        f_close(fp);
+        return false;
+    }
+
+    image->index = next->index;
+    strcpy(image->path, next->path);
+    image->offset = next->offset;
+    image->size = next->size;
+    image->crc32 = next->crc32;
+
+    if (next->offset != 0) {
+        if (strcmp(next->path, SD_ALBUM_PATH) == 0)
+            sd_album_enable_fast_seek(fp);
+        if (f_lseek(fp, next->offset) != FR_OK) {
+            f_close(fp);
             return false;
         }
+    }
+    return true;
+}
+
+/**
+ * @brief Select the next image to display and open it, ready to read from
+ * its first byte.
+ *
+ * A packed album (/images/album.bin) is used if present: it is opened once
+ * and seeked to the selected frame. Otherwise, if the images directory has a
+ * catalog, the image count, layout and the selected image's entry are read
+ * from it directly. Without either, the layout is detected and the directory
+ * is enumerated as needed.
+ *
+ * The image count and layout found this way are retained in SRAM2. Timed
+ * wakes reuse them and go straight to the selected image, other wakes look
+ * again in case the card was changed, as do timed wakes once the selected
+ * image is missing. An image prepared by the previous refresh is opened
+ * directly instead, as long as it is on the same volume and its file is
+ * unchanged.
+ *
+ * @param fp: file object to open the image with, left open on success
+ * @param shuffle_enabled: pick a random image instead of the next one
+ * @param image: filled with the selected image's location
+ */
+bool sd_open_next_image(FIL* fp, bool shuffle_enabled,
+                        struct sd_image_t* image) {
+    FRESULT fres;
+    FIL catalog;
+    struct sd_catalog_header_t catalog_header;
+    struct sd_album_header_t album_header;
+    struct retain_library_t library;
+    struct fram_next_image_t next;
+    bool sharded;
+
+    memset(image, 0, sizeof(*image));
+
+    bool prepared = !sd_next_image_checked && fram_get_next_image(&next);
+    sd_next_image_checked = true;
+    if (prepared) {
+        // only used once, even if this refresh fails
+        fram_set_next_image(NULL);
+
+        if (next.shuffle == shuffle_enabled &&
+            next.volume == sd_volume_serial() &&
+            sd_open_prepared_image(fp, &next, image)) {
+            TRACE1(TRACE_NEXT_IMAGE_PREPARED, next.index);
+            fram_set_image_counter(next.img_counter);
+            fram_set_shuffle_state(next.shuffle_seed, next.shuffle_position,
+                                   next.shuffle_count);
+            return true;
+        }
+
+        TRACE0(TRACE_NEXT_IMAGE_STALE);
+        memset(image, 0, sizeof(*image));
+    }
+
+    if (wake_reason == WAKE_REASON_STBY_RTC && retain_get_library(&library)) {
+        TRACE1(TRACE_LIBRARY_RETAINED, library.count);
+        if (sd_library_open_next_image(fp, &library, shuffle_enabled, image))
+            return true;
+
+        TRACE0(TRACE_LIBRARY_STALE);
+        memset(image, 0, sizeof(*image));
+    }
+    memset(&library, 0, sizeof(library));
+    retain_set_library(&library);
 
-        // double check that zeroth image exists
-        fres = f_stat(filename_buf, NULL);
-        return fres == FR_OK;
+    if (sd_album_open(fp, &album_header)) {
+        if (sd_album_open_next_image(fp, &album_header, shuffle_enabled,
+                                     image))
+            return true;
+
+        f_close(fp);
+        return false;
+    }
+
+    bool have_catalog = sd_catalog_open(&catalog, &catalog_header);
+    if (have_catalog) {
+        sharded = catalog_header.flags & SD_CATALOG_FLAG_SHARDED;
     } else {
-        DIR dir;
-        FILINFO fno;
-        uint32_t count = 0;
-        FRESULT res;
+        TRACE0(TRACE_NO_CATALOG);
 
-        // count all files in the current `/images` directory
-        res = f_opendir(&dir, ".");
-        if (res != FR_OK) return false;
-        for (;;) {
-            res = f_readdir(&dir, &fno);
+        FILINFO fno;
+        sharded =
+            f_stat("/images/000", &fno) == FR_OK && (fno.fattrib & AM_DIR);
+    }
 
-            if (res != FR_OK || fno.fname[0] == '\0') break;
+    if (have_catalog) {
+        struct sd_catalog_entry_t entry;
 
-            // check that the entry is a file and not a directory
-            if (!(fno.fattrib & AM_DIR)) {
-                count++;  // increment file count
+        if (catalog_header.count == 0) {
+            f_close(&catalog);
+            return false;
+        }
+        image->index = sd_select_index(catalog_header.count, shuffle_enabled);
+
+        library.count = catalog_header.count;
+        library.flags = SD_LIBRARY_FLAG_CATALOG |
+                        (sharded ? SD_LIBRARY_FLAG_SHARDED : 0);
+
+        bool entry_ok = sd_catalog_read_entry(&catalog, &catalog_header,
+                                              image->index, &entry);
+        f_close(&catalog);
+        if (!entry_ok) return false;
+
+        image->size = entry.size;
+        image->crc32 = entry.crc32;
+
+        // the catalog of a card written by build_card.py lists where each
+        // image starts, so its directory needn't be searched, unless the
+        // cluster now holds something else
+        sd_image_path(image->path, image->index, sharded);
+        if (entry.start_cluster != 0 &&
+            f_open_cluster(fp, entry.start_cluster, entry.size) == FR_OK) {
+            if (sd_cluster_image_matches(fp, entry.size)) {
+                TRACE1(TRACE_CATALOG_CLUSTER, image->index);
+                retain_set_library(&library);
+                return true;
             }
+            TRACE1(TRACE_CATALOG_CLUSTER_STALE, image->index);
+            f_close(fp);
+        }
+    } else if (shuffle_enabled) {
+        uint32_t count;
+        if (sharded) {
+            count = sd_count_sharded_images();
+        } else {
+            int32_t flat_count = sd_count_images("/images");
+            count = flat_count > 0 ? flat_count : 0;
         }
-        f_closedir(&dir);
         if (count == 0) return false;
 
-        uint32_t random;
-        if (HAL_RNG_GenerateRandomNumber(&hrng, &random) != HAL_OK) {
-            if (DBG) printf("Error generating random number\n");
+        image->index = sd_select_index(count, shuffle_enabled);
+
+        library.count = count;
+        library.flags = sharded ? SD_LIBRARY_FLAG_SHARDED : 0;
+    } else {
+        // count unknown, try the next image and restart from the first one
+        // once it doesn't exist
+        image->index = fram_get_image_counter();
+        sd_image_path(image->path, image->index, sharded);
+
+        fres = f_open(fp, image->path, FA_READ);
+        if (fres == FR_NO_FILE || fres == FR_NO_PATH) {
+            image->index = 0;
+            sd_image_path(image->path, image->index, sharded);
+            fres = f_open(fp, image->path, FA_READ);
+        }
+        if (fres != FR_OK) {
+            TRACE1(TRACE_F_OPEN_ERROR, fres);
             return false;
         }
 
-        uint32_t index = random % count;  // select a random file index
+        fram_set_image_counter(image->index + 1);
+        return true;
+    }
 
-        if (index == img_counter)  // if the random index is the same as the
-                                   // current image index
-            index = (index + 1) % count;  // skip the current image
+    // with known naming convention, directly generate path
+    sd_image_path(image->path, image->index, sharded);
 
-        fram_set_image_counter(index);  // store the index
+    fres = f_open(fp, image->path, FA_READ);
+    if (fres != FR_OK) {
+        TRACE1(TRACE_F_OPEN_ERROR, fres);
+        return false;
+    }
 
-        // with known naming convention, directly generate filename
-        sprintf(filename_buf, "%lu.slc", index);
+    if (image->size != 0 && f_size(fp) != image->size) {
+        TRACE0(TRACE_CATALOG_STALE);
+    }
 
-        return true;
+    retain_set_library(&library);
+    return true;
+}
+
+/**
+ * @brief Close the image opened by sd_open_next_image.
+ */
+void sd_close_image(FIL* fp) { f_close(fp); }
+
+/**
+ * @brief Pick the image for the next refresh while the card is mounted, and
+ * check its header. It is stored in FRAM along with the location of its
+ * directory entry, so the next refresh opens it without a lookup. Images
+ * with a bad header are skipped.
+ *
+ * The image sequence in the state record is left as it was, and only moves
+ * on once the prepared image is shown, so nothing is skipped if the next
+ * refresh can't use it.
+ *
+ * @param fp: file object to open the image with, closed on return
+ * @param shuffle_enabled: pick a random image instead of the next one
+ */
+void sd_prepare_next_image(FIL* fp, bool shuffle_enabled) {
+    struct fram_next_image_t next = {0};
+    struct sd_image_t image;
+    uint32_t img_counter = fram_get_image_counter();
+    uint32_t seed, position, shuffle_count;
+    fram_get_shuffle_state(&seed, &position, &shuffle_count);
+
+    sd_next_image_checked = true;  // this refresh's image is already open
+
+    for (int attempt = 0; attempt < SD_PREPARE_ATTEMPTS; attempt++) {
+        if (!sd_open_next_image(fp, shuffle_enabled, &image)) break;
+
+        struct img_header_t header;
+        bool header_ok = img_read_header(fp, &image, &header);
+        uint32_t dir_sect = fp->dir_sect;  // 0 if opened by its first cluster
+        uint16_t dir_offset = dir_sect ? fp->dir_ptr - sd_fs.win : 0;
+        uint32_t sclust = dir_sect ? 0 : fp->obj.sclust;
+        sd_close_image(fp);
+
+        const uint8_t* entry = NULL;
+        if (header_ok && dir_sect != 0) {
+            entry = sd_dir_entry(dir_sect, dir_offset);
+            header_ok = entry != NULL;
+        }
+        if (!header_ok) {
+            TRACE1(TRACE_NEXT_IMAGE_BAD, image.index);
+            continue;
+        }
+
+        next.volume = sd_volume_serial();
+        next.index = image.index;
+        strcpy(next.path, image.path);
+        next.shuffle = shuffle_enabled;
+        next.offset = image.offset;
+        next.size = image.size;
+        next.crc32 = image.crc32;
+        next.sclust = sclust;
+        next.dir_sect = dir_sect;
+        next.dir_offset = dir_offset;
+        if (entry != NULL) memcpy(next.dir_entry, entry, FRAM_DIR_ENTRY_SIZE);
+        next.img_counter = fram_get_image_counter();
+        fram_get_shuffle_state(&next.shuffle_seed, &next.shuffle_position,
+                               &next.shuffle_count);
+        fram_set_next_image(&next);
+
+        TRACE1(TRACE_NEXT_IMAGE_READY, image.index);
+        break;
     }
+
+    fram_set_image_counter(img_counter);
+    fram_set_shuffle_state(seed, position, shuffle_count);
 }
@@ -0,0 +1,353 @@
+#include "sdlog.h"
+
+#include <string.h>
+
+#include "arena.h"
+#include "diskio.h"
+#include "ff.h"
+#include "fram.h"
+#include "main.h"
+#include "retain.h"
+#include "sd.h"
+#include "trace.h"
+
+#define SDLOG_FLAG_FIRST 0x01  // first sector of an appended record
+
+_Static_assert(SDLOG_COUNT <= FRAM_LOG_COUNT,
+               "not enough FRAM log state slots for all logs");
+_Static_assert(sizeof(struct sdlog_header_t) <= SDLOG_SECTOR_SIZE,
+               "log header does not fit in a sector");
+_Static_assert(sizeof(struct sdlog_sector_t) == SDLOG_SECTOR_SIZE,
+               "log sector layout must be exactly one sector");
+
+struct sdlog_config_t {
+    const char* path;
+    uint32_t sectors;  // number of data sectors in the ring
+    const char* columns;
+};
+
+static const struct sdlog_config_t sdlog_config[SDLOG_COUNT] = {
+    // the columns of sd_append_batt_charge_log; existing files keep the
+    // header they were created with, so changing them needs a new
+    // SDLOG_VERSION
+    [SDLOG_BATT] = {"/logfiles/batt.log", 2048,
+                    "BootIteration,BatteryVoltage,WakeReason,SleepReason,"
+                    "SleepDurationSeconds,StateOfChargePercent,"
+                    "HeadroomPercent,SagMillivolts,TrendMillivoltsPerDay"},
+    [SDLOG_TRACE] = {"/logfiles/trace.log", 8192, ""},
+    [SDLOG_PROFILE] = {"/logfiles/profile.log", 2048, ""},
+};
+
+static bool sdlog_checked[SDLOG_COUNT];  // file checked in this wake
+
+/**
+ * @brief Get the physical sector of the first data sector of a log file.
+ * Only valid for contiguous files.
+ */
+static DWORD sdlog_data_sector(FATFS* fs, DWORD sclust) {
+    return fs->database + (DWORD)fs->csize * (sclust - 2) + 1;
+}
+
+/**
+ * @brief Read and validate the header of an open log file.
+ */
+static bool sdlog_read_header(FIL* fil, enum sdlog_t log,
+                              struct sdlog_header_t* header) {
+    UINT bytesRead;
+
+    if (f_size(fil) !=
+        (FSIZE_t)(sdlog_config[log].sectors + 1) * SDLOG_SECTOR_SIZE)
+        return false;
+
+    if (f_read(fil, arena.log.sector, SDLOG_SECTOR_SIZE, &bytesRead) != FR_OK ||
+        bytesRead != SDLOG_SECTOR_SIZE)
+        return false;
+
+    memcpy(header, arena.log.sector, sizeof(*header));
+    return header->magic == SDLOG_MAGIC && header->version == SDLOG_VERSION &&
+           header->sector_size == SDLOG_SECTOR_SIZE &&
+           header->sectors == sdlog_config[log].sectors;
+}
+
+/**
+ * @brief Find the write position of a log file whose position isn't known,
+ * e.g. after the card was swapped.
+ *
+ * Checks the file is contiguous, then scans its data sectors for the one
+ * written last.
+ */
+static bool sdlog_recover(FIL* fil, const struct sdlog_header_t* header,
+                          struct fram_log_state_t* state) {
+    FATFS* fs = fil->obj.fs;
+    struct sdlog_sector_t* sector = (struct sdlog_sector_t*)arena.log.sector;
+
+    // a single fragment link map is (size, length, start, end)
+    DWORD clmt[4] = {4};
+    fil->cltbl = clmt;
+    FRESULT fres = f_lseek(fil, CREATE_LINKMAP);
+    fil->cltbl = NULL;
+    if (fres != FR_OK) return false;
+
+    TRACE1(TRACE_LOG_SCAN, header->sectors);
+
+    DWORD first = sdlog_data_sector(fs, fil->obj.sclust);
+    bool found = false;
+    uint32_t last = 0, last_seq = 0;
+    for (uint32_t i = 0; i < header->sectors; i++) {
+        if (disk_read(fs->drv, arena.log.sector, first + i, 1) != RES_OK) {
+            return false;
+        }
+        if (sector->id != header->id) continue;
+        if (!found || (int32_t)(sector->seq - last_seq) > 0) {
+            found = true;
+            last = i;
+            last_seq = sector->seq;
+        }
+    }
+
+    state->sclust = fil->obj.sclust;
+    state->id = header->id;
+    state->head = found ? (last + 1) % header->sectors : 0;
+    state->seq = found ? last_seq + 1 : 0;
+    return true;
+}
+
+/**
+ * @brief Create a log file, preallocated as one contiguous block.
+ */
+static bool sdlog_create(enum sdlog_t log, struct fram_log_state_t* state,
+                         FATFS** fs) {
+    const struct sdlog_config_t* config = &sdlog_config[log];
+    struct sdlog_header_t* header = (struct sdlog_header_t*)arena.log.sector;
+    FIL fil;
+    FRESULT fres;
+    UINT bytesWrote;
+    uint32_t id;
+
+    fres = f_mkdir("/logfiles");
+    if (fres != FR_OK && fres != FR_EXIST) return false;
+
+    fres = f_open(&fil, config->path, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fres != FR_OK) return false;
+
+    fres = f_expand(&fil, (FSIZE_t)(config->sectors + 1) * SDLOG_SECTOR_SIZE,
+                    1);
+    if (fres != FR_OK) {
+        TRACE2(TRACE_LOG_ALLOC_FAILED, log, fres);
+        f_close(&fil);
+        f_unlink(config->path);
+        return false;
+    }
+
+    if (HAL_RNG_GenerateRandomNumber(&hrng, &id) != HAL_OK) {
+        id = HAL_GetTick() ^ (wake_cycle_count << 16);
+    }
+
+    memset(arena.log.sector, 0, sizeof(arena.log.sector));
+    header->magic = SDLOG_MAGIC;
+    header->version = SDLOG_VERSION;
+    header->sector_size = SDLOG_SECTOR_SIZE;
+    header->id = id;
+    header->sectors = config->sectors;
+    strncpy(header->columns, config->columns, sizeof(header->columns) - 1);
+
+    fres = f_write(&fil, arena.log.sector, SDLOG_SECTOR_SIZE, &bytesWrote);
+    if (fres != FR_OK || bytesWrote != SDLOG_SECTOR_SIZE) {
+        f_close(&fil);
+        return false;
+    }
+
+    *fs = fil.obj.fs;
+    state->sclust = fil.obj.sclust;
+    state->id = id;
+    state->head = 0;  // seq carries on from any previous file
+
+    return f_close(&fil) == FR_OK;
+}
+
+/**
+ * @brief Forget the log positions stored in FRAM when they were found on
+ * another volume, e.g. after the card was swapped or reformatted. The
+ * sequence numbers carry on.
+ */
+static void sdlog_check_volume() {
+    uint32_t serial = sd_volume_serial();
+    if (serial != 0 && serial == fram_get_log_volume()) return;
+
+    for (uint8_t log = 0; log < SDLOG_COUNT; log++) {
+        struct fram_log_state_t state;
+        fram_get_log_state(log, &state);
+        state.sclust = 0;
+        fram_set_log_state(log, &state);
+        sdlog_checked[log] = false;
+    }
+    fram_set_log_volume(serial);
+}
+
+/**
+ * @brief Check whether the position stored in FRAM can be used without
+ * opening the log file. The card may have been changed while the device was
+ * in standby, so only timed wakes trust a position found on the same volume
+ * in an earlier wake; other wakes check the file once.
+ *
+ * Editing the card on a PC keeps the volume serial, so a timed wake still
+ * reads the file's header sector before its first append, and only trusts
+ * the position if the header carries the log's id. A single sector read is
+ * enough for that, where opening the file would search its directory.
+ */
+static bool sdlog_trusted(enum sdlog_t log,
+                          const struct fram_log_state_t* state) {
+    const struct sdlog_header_t* header =
+        (const struct sdlog_header_t*)arena.log.sector;
+    FATFS* fs = sd_get_fs();
+    DWORD clusters = (sdlog_config[log].sectors + 1 + fs->csize - 1) /
+                     fs->csize;
+
+    if (!sdlog_checked[log] && wake_reason != WAKE_REASON_STBY_RTC)
+        return false;
+    if (state->sclust < 2 || state->sclust + clusters > fs->n_fatent ||
+        state->head >= sdlog_config[log].sectors)
+        return false;
+    if (sdlog_checked[log]) return true;
+
+    if (disk_read(fs->drv, arena.log.sector,
+                  sdlog_data_sector(fs, state->sclust) - 1, 1) != RES_OK)
+        return false;
+    sdlog_checked[log] = header->magic == SDLOG_MAGIC &&
+                         header->version == SDLOG_VERSION &&
+                         header->id == state->id &&
+                         header->sectors == sdlog_config[log].sectors;
+    return sdlog_checked[log];
+}
+
+/**
+ * @brief Find the log file and its write position, creating it if needed.
+ * The position stored in FRAM is used as it is where it can be trusted, so
+ * an append costs a single sector write.
+ */
+static bool sdlog_open(enum sdlog_t log, struct fram_log_state_t* state,
+                       FATFS** fs) {
+    struct sdlog_header_t header;
+    FIL fil;
+    bool ok = false;
+
+    if (sdlog_trusted(log, state)) {
+        *fs = sd_get_fs();
+        return true;
+    }
+
+    TRACE1(TRACE_LOG_CHECK, log);
+    if (f_open(&fil, sdlog_config[log].path, FA_READ) == FR_OK) {
+        *fs = fil.obj.fs;
+        if (sdlog_read_header(&fil, log, &header)) {
+            // known file: the position stored in FRAM is still valid
+            ok = header.id == state->id && fil.obj.sclust == state->sclust &&
+                 state->head < header.sectors;
+            if (!ok) ok = sdlog_recover(&fil, &header, state);
+        }
+        f_close(&fil);
+    }
+
+    if (!ok) ok = sdlog_create(log, state, fs);
+    sdlog_checked[log] = ok;
+    return ok;
+}
+
+/**
+ * @brief Write a record to the next sectors of a ring log.
+ *
+ * @param wake: wake cycle count the record was made in
+ */
+static bool sdlog_write(enum sdlog_t log, uint32_t wake, const void* data,
+                        uint32_t size) {
+    struct sdlog_sector_t* sector = (struct sdlog_sector_t*)arena.log.sector;
+    struct fram_log_state_t state;
+    const uint8_t* bytes = data;
+    FATFS* fs = NULL;
+    bool ok = true;
+
+    sdlog_check_volume();
+    fram_get_log_state(log, &state);
+    if (!sdlog_open(log, &state, &fs)) {
+        TRACE1(TRACE_LOG_OPEN_FAILED, log);
+        return false;
+    }
+
+    DWORD first = sdlog_data_sector(fs, state.sclust);
+    uint16_t flags = SDLOG_FLAG_FIRST;
+    do {
+        uint16_t used =
+            size > sizeof(sector->data) ? sizeof(sector->data) : size;
+
+        memset(arena.log.sector, 0, sizeof(arena.log.sector));
+        sector->id = state.id;
+        sector->seq = state.seq;
+        sector->wake = wake;
+        sector->used = used;
+        sector->flags = flags;
+        memcpy(sector->data, bytes, used);
+
+        if (disk_write(fs->drv, arena.log.sector, first + state.head, 1) !=
+            RES_OK) {
+            ok = false;
+            break;
+        }
+
+        state.seq++;
+        state.head = (state.head + 1) % sdlog_config[log].sectors;
+        flags = 0;
+        bytes += used;
+        size -= used;
+    } while (size > 0);
+
+    fram_set_log_state(log, &state);
+    return ok;
+}
+
+/**
+ * @brief Write the log records staged by earlier wakes, in order.
+ */
+static void sdlog_write_staged() {
+    const struct retain_log_record_t* record;
+    uint32_t pos = 0;
+
+    while ((record = retain_staged_log(&pos)) != NULL) {
+        if (record->log < SDLOG_COUNT) {
+            sdlog_write(record->log, record->wake, record->data, record->size);
+        }
+    }
+    if (pos > 0) TRACE1(TRACE_LOG_STAGED_WRITE, pos);
+    retain_clear_staged_logs();
+}
+
+/**
+ * @brief Append a record to a ring log on the SD card.
+ *
+ * The log file is allocated once at its full size. Appends write the next
+ * sectors of the ring in place, directly to the card, so they cost one
+ * sector write per 496 bytes and never touch the FAT or the directory. The
+ * file's location and write position are kept in FRAM, and are committed with
+ * the rest of the persistent state. The file itself is only opened to check
+ * them on wakes that can follow a card change, timed wakes read its header
+ * sector instead, see sdlog_trusted.
+ *
+ * Wakes that don't mount the card stage the record in SRAM2 instead, until
+ * a later wake mounts it or the stage fills up.
+ *
+ * @param log: log to append to
+ * @param data: record to append
+ * @param size: size of the record in bytes
+ */
+bool sdlog_append(enum sdlog_t log, const void* data, uint32_t size) {
+    if (!sd_is_mounted()) {
+        if (size <= UINT16_MAX &&
+            retain_stage_log(log, wake_cycle_count, data, size)) {
+            TRACE2(TRACE_LOG_STAGED, size, log);
+            return true;
+        }
+        if (!sd_init()) return false;
+    }
+
+    sdlog_write_staged();
+    return sdlog_write(log, wake_cycle_count, data, size);
+}
@@ -0,0 +1,58 @@
+#include "shuffle.h"
+
+#include <stdint.h>
+
+#define SHUFFLE_ROUNDS 4
+
+/**
+ * @brief Keyed round function of the Feistel network.
+ */
+static uint32_t shuffle_round(uint32_t value, uint32_t seed, uint32_t round) {
+    uint32_t x = value ^ seed ^ (round * 0x9E3779B9);
+
+    // murmur3 finaliser, good avalanche for a handful of operations
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * @brief Map a position in a shuffled sequence to an image index.
+ *
+ * A balanced Feistel network keyed by seed is a bijection over [0, 4^half),
+ * the smallest such domain that holds count. Outputs outside [0, count) are
+ * fed back in (cycle walking) until one lands inside, which keeps the mapping
+ * a bijection over [0, count) and takes fewer than 4 iterations on average.
+ *
+ * Walking position from 0 to count - 1 therefore visits every image exactly
+ * once, in an order that only depends on seed, with O(1) time and memory.
+ *
+ * @param position: position in the shuffled sequence, must be < count
+ * @param count: number of images
+ * @param seed: key selecting the permutation
+ */
+uint32_t shuffle_permute(uint32_t position, uint32_t count, uint32_t seed) {
+    if (count <= 1) return 0;
+
+    // half width in bits, so that the domain (2 * half bits) covers count
+    uint32_t half = 1;
+    while (half < 16 && (1UL << (2 * half)) < count) half++;
+    uint32_t mask = (1UL << half) - 1;
+
+    uint32_t x = position;
+    do {
+        uint32_t left = x >> half;
+        uint32_t right = x & mask;
+        for (uint32_t round = 0; round < SHUFFLE_ROUNDS; round++) {
+            uint32_t next = left ^ (shuffle_round(right, seed, round) & mask);
+            left = right;
+            right = next;
+        }
+        x = (left << half) | right;
+    } while (x >= count);
+
+    return x;
+}
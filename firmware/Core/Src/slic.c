@@ -108,6 +108,18 @@ int i;
     return 1;
 } /* get_more_data() */
 
+//
+// Make sure the next input byte is in the buffer, reading more data if the
+// buffer has run out. Operands of an op may be split across two buffers.
+//
+#define SLIC_NEED_INPUT() \
+    if (s >= pSrcEnd) { \
+        if (get_more_data(pState) || pState->pInEnd == pState->ucFileBuf) \
+            return SLIC_DECODE_ERROR; /* the op is cut off */ \
+        s = pState->ucFileBuf; \
+        pSrcEnd = pState->pInEnd; \
+    }
+
 //
 // Decode N pixels into the user-supplied output buffer
 //
@@ -330,25 +342,40 @@ int slic_decode(SLICSTATE *pState, uint8_t *pOut, int iOutSize) {
             }
 			else if (op == SLIC_OP_RGB) {
                 px &= 0xff000000;
+                if (pSrcEnd - s >= 4) { // all operands in the buffer
 #ifdef UNALIGNED_ALLOWED
-                px |= (*(uint32_t *)s) & 0xffffff;
+                    px |= (*(uint32_t *)s) & 0xffffff;
 #else
-                px |= s[0];
-                px |= ((uint32_t)s[1] << 8);
-                px |= ((uint32_t)s[2] << 16);
+                    px |= s[0];
+                    px |= ((uint32_t)s[1] << 8);
+                    px |= ((uint32_t)s[2] << 16);
 #endif
-                s += 3;
+                    s += 3;
+                } else {
+                    for (int i = 0; i < 24; i += 8) {
+                        SLIC_NEED_INPUT();
+                        px |= ((uint32_t)*s++ << i);
+                    }
+                }
 			}
 			else if (op == SLIC_OP_RGBA) {
+                if (pSrcEnd - s >= 4) { // all operands in the buffer
 #ifdef UNALIGNED_ALLOWED
-                px = *(uint32_t *)s;
-                s += 4;
+                    px = *(uint32_t *)s;
+                    s += 4;
 #else
-                px = *s++;
-                px |= ((uint32_t)*s++ << 8);
-                px |= ((uint32_t)*s++ << 16);
-                px |= ((uint32_t)*s++ << 24);
+                    px = *s++;
+                    px |= ((uint32_t)*s++ << 8);
+                    px |= ((uint32_t)*s++ << 16);
+                    px |= ((uint32_t)*s++ << 24);
 #endif
+                } else {
+                    px = 0;
+                    for (int i = 0; i < 32; i += 8) {
+                        SLIC_NEED_INPUT();
+                        px |= ((uint32_t)*s++ << i);
+                    }
+                }
 			}
 			else if ((op & SLIC_OP_MASK) == SLIC_OP_DIFF) {
                 uint8_t r, g, b;
@@ -364,6 +391,7 @@ int slic_decode(SLICSTATE *pState, uint8_t *pOut, int iOutSize) {
                 px |= ((uint32_t)(b & 0xff) << 16);
 			}
 			else if ((op & SLIC_OP_MASK) == SLIC_OP_LUMA) {
+                SLIC_NEED_INPUT();
 				int b2 = *s++;
 				int vg = (op & 0x3f) - 32;
                 uint8_t r, g, b;
@@ -0,0 +1,76 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+#include "sdlog.h"
+#include "stm32l4xx_hal.h"
+
+#define TRACE_RECORD_SIZE(nargs) \
+    (sizeof(struct trace_record_t) + (nargs) * sizeof(uint32_t))
+
+static const char* const trace_formats[TRACE_EVENT_COUNT] = {
+#define TRACE_EVENT_FORMAT(id, format) [id] = format,
+    TRACE_EVENTS(TRACE_EVENT_FORMAT)
+#undef TRACE_EVENT_FORMAT
+};
+
+NOINIT static uint8_t trace_buf[TRACE_BUF_SIZE];  // valid up to trace_len
+static uint32_t trace_len = 0;
+static uint32_t trace_dropped = 0;
+
+/**
+ * @brief Record a trace event.
+ *
+ * Only the event id, a timestamp and the arguments are stored, formatting is
+ * left to the host. Once the buffer is full, further events are counted and
+ * dropped, keeping room for the record added on flush.
+ *
+ * @param event: event to record
+ * @param nargs: number of arguments used, up to TRACE_MAX_ARGS
+ */
+void trace_record(enum trace_event_t event, uint8_t nargs, uint32_t a0,
+                  uint32_t a1, uint32_t a2) {
+    uint32_t args[TRACE_MAX_ARGS] = {a0, a1, a2};
+
+    if (DBG_SWO_EN) {
+        printf(trace_formats[event], a0, a1, a2);
+        printf("\n");
+    }
+
+    if (nargs > TRACE_MAX_ARGS) nargs = TRACE_MAX_ARGS;
+    if (trace_len + TRACE_RECORD_SIZE(nargs) >
+        TRACE_BUF_SIZE - TRACE_RECORD_SIZE(2)) {
+        trace_dropped++;
+        return;
+    }
+
+    struct trace_record_t record = {
+        .event = event, .nargs = nargs, .tick = HAL_GetTick()};
+    memcpy(&trace_buf[trace_len], &record, sizeof(record));
+    memcpy(&trace_buf[trace_len + sizeof(record)], args,
+           nargs * sizeof(uint32_t));
+    trace_len += TRACE_RECORD_SIZE(nargs);
+}
+
+/**
+ * @brief Append the recorded trace to the trace log on the SD card, and
+ * clear the buffer.
+ */
+bool trace_flush() {
+    uint32_t dropped = trace_dropped;
+    trace_dropped = 0;
+
+    // trace_record always leaves room for this record
+    struct trace_record_t record = {
+        .event = TRACE_FLUSH, .nargs = 2, .tick = HAL_GetTick()};
+    uint32_t args[2] = {TRACE_EVENT_COUNT, dropped};
+    memcpy(&trace_buf[trace_len], &record, sizeof(record));
+    memcpy(&trace_buf[trace_len + sizeof(record)], args, sizeof(args));
+    trace_len += TRACE_RECORD_SIZE(2);
+
+    bool ok = sdlog_append(SDLOG_TRACE, trace_buf, trace_len);
+    trace_len = 0;
+    return ok;
+}
@@ -80,6 +80,23 @@ LoopCopyDataInit:
   adds r4, r0, r3
   cmp r4, r1
   bcc CopyDataInit
+
+/* Copy the code run from SRAM2 from flash */
+  ldr r0, =_sram2func
+  ldr r1, =_eram2func
+  ldr r2, =_siram2func
+  movs r3, #0
+  b LoopCopyRam2FuncInit
+
+CopyRam2FuncInit:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyRam2FuncInit:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyRam2FuncInit
   
 /* Zero fill the bss segment. */
   ldr r2, =_sbss
@@ -24,9 +24,12 @@
 
 //It is designed to be wrapped by a cubemx generated user_diskio.c file.
 
+#include "main.h"
 #include "stm32l4xx_hal.h" /* Provide the low-level HAL functions */
 #include "user_diskio_spi.h"
 
+#include <string.h>
+
 //Make sure you set #define SD_SPI_HANDLE as some hspix in main.h
 //Make sure you set #define SD_CS_GPIO_Port as some GPIO port in main.h
 //Make sure you set #define SD_CS_Pin as some GPIO pin in main.h
@@ -83,6 +86,9 @@ DSTATUS Stat = STA_NOINIT;	/* Physical drive status */
 static
 BYTE CardType;			/* Card type flags */
 
+static
+USER_SPI_StatsTypeDef Stats;	/* I/O counters */
+
 uint32_t spiTimerTickStart;
 uint32_t spiTimerTickDelay;
 
@@ -100,7 +106,7 @@ uint8_t SPI_Timer_Status() {
 /*-----------------------------------------------------------------------*/
 
 /* Exchange a byte */
-static
+RAM2FUNC static
 BYTE xchg_spi (
 	BYTE dat	/* Data to send */
 )
@@ -111,16 +117,16 @@ BYTE xchg_spi (
 }
 
 
-/* Receive multiple byte */
-static
+/* Receive multiple byte in one transfer, clocking out the 0xFF fill from the
+   buffer itself. Run from SRAM2 as it moves every byte of a block */
+RAM2FUNC static
 void rcvr_spi_multi (
 	BYTE *buff,		/* Pointer to data buffer */
 	UINT btr		/* Number of bytes to receive (even number) */
 )
 {
-	for(UINT i=0; i<btr; i++) {
-		*(buff+i) = xchg_spi(0xFF);
-	}
+	memset(buff, 0xFF, btr);
+	HAL_SPI_TransmitReceive(&SD_SPI_HANDLE, buff, buff, btr, HAL_MAX_DELAY);
 }
 
 
@@ -156,9 +162,12 @@ int wait_ready (	/* 1:Ready, 0:Timeout */
 	waitSpiTimerTickDelay = (uint32_t)wt;
 	do {
 		d = xchg_spi(0xFF);
+		Stats.ready_polls++;
 		/* This loop takes a time. Insert rot_rdq() here for multitask envilonment. */
 	} while (d != 0xFF && ((HAL_GetTick() - waitSpiTimerTickStart) < waitSpiTimerTickDelay));	/* Wait for card goes ready or timeout */
 
+	Stats.ready_ms += HAL_GetTick() - waitSpiTimerTickStart;
+	if (d != 0xFF) Stats.errors++;
 	return (d == 0xFF) ? 1 : 0;
 }
 
@@ -211,9 +220,13 @@ int rcvr_datablock (	/* 1:OK, 0:Error */
 	SPI_Timer_On(200);
 	do {							/* Wait for DataStart token in timeout of 200ms */
 		token = xchg_spi(0xFF);
+		Stats.token_polls++;
 		/* This loop will take a time. Insert rot_rdq() here for multitask envilonment. */
 	} while ((token == 0xFF) && SPI_Timer_Status());
-	if(token != 0xFE) return 0;		/* Function fails if invalid DataStart token or timeout */
+	if(token != 0xFE) {				/* Function fails if invalid DataStart token or timeout */
+		Stats.errors++;
+		return 0;
+	}
 
 	rcvr_spi_multi(buff, btr);		/* Store trailing data to the buffer */
 	xchg_spi(0xFF); xchg_spi(0xFF);			/* Discard CRC */
@@ -278,6 +291,7 @@ BYTE send_cmd (		/* Return value: R1 resp (bit7==1:Failed to send) */
 	}
 
 	/* Send command packet */
+	Stats.cmds++;
 	xchg_spi(0x40 | cmd);				/* Start + command index */
 	xchg_spi((BYTE)(arg >> 24));		/* Argument[31..24] */
 	xchg_spi((BYTE)(arg >> 16));		/* Argument[23..16] */
@@ -399,13 +413,16 @@ inline DRESULT USER_SPI_read (
 
 	if (!(CardType & CT_BLOCK)) sector *= 512;	/* LBA ot BA conversion (byte addressing cards) */
 
+	UINT requested = count;
 	if (count == 1) {	/* Single sector read */
+		Stats.rd_single++;
 		if ((send_cmd(CMD17, sector) == 0)	/* READ_SINGLE_BLOCK */
 			&& rcvr_datablock(buff, 512)) {
 			count = 0;
 		}
 	}
 	else {				/* Multiple sector read */
+		Stats.rd_multi++;
 		if (send_cmd(CMD18, sector) == 0) {	/* READ_MULTIPLE_BLOCK */
 			do {
 				if (!rcvr_datablock(buff, 512)) break;
@@ -416,6 +433,9 @@ inline DRESULT USER_SPI_read (
 	}
 	despiselect();
 
+	Stats.rd_sectors += requested - count;
+	if (count) Stats.errors++;
+
 	return count ? RES_ERROR : RES_OK;	/* Return result */
 }
 
@@ -439,13 +459,16 @@ inline DRESULT USER_SPI_write (
 
 	if (!(CardType & CT_BLOCK)) sector *= 512;	/* LBA ==> BA conversion (byte addressing cards) */
 
+	UINT requested = count;
 	if (count == 1) {	/* Single sector write */
+		Stats.wr_single++;
 		if ((send_cmd(CMD24, sector) == 0)	/* WRITE_BLOCK */
 			&& xmit_datablock(buff, 0xFE)) {
 			count = 0;
 		}
 	}
 	else {				/* Multiple sector write */
+		Stats.wr_multi++;
 		if (CardType & CT_SDC) send_cmd(ACMD23, count);	/* Predefine number of sectors */
 		if (send_cmd(CMD25, sector) == 0) {	/* WRITE_MULTIPLE_BLOCK */
 			do {
@@ -457,6 +480,9 @@ inline DRESULT USER_SPI_write (
 	}
 	despiselect();
 
+	Stats.wr_sectors += requested - count;
+	if (count) Stats.errors++;
+
 	return count ? RES_ERROR : RES_OK;	/* Return result */
 }
 #endif
@@ -479,6 +505,17 @@ inline DRESULT USER_SPI_ioctl (
 
 
 	if (drv) return RES_PARERR;					/* Check parameter */
+
+	/* Counters are available without the card */
+	if (cmd == USER_SPI_GET_STATS) {
+		*(USER_SPI_StatsTypeDef*)buff = Stats;
+		return RES_OK;
+	}
+	if (cmd == USER_SPI_RESET_STATS) {
+		memset(&Stats, 0, sizeof(Stats));
+		return RES_OK;
+	}
+
 	if (Stat & STA_NOINIT) return RES_NOTRDY;	/* Check if drive is ready */
 
 	res = RES_ERROR;
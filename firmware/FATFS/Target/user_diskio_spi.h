@@ -22,6 +22,25 @@
 #include "diskio.h" //from FatFs middleware library
 #include "ff_gen_drv.h" //from FatFs middleware library
 
+/* Driver specific ioctl codes */
+#define USER_SPI_GET_STATS		200	/* Get a copy of the I/O counters (USER_SPI_StatsTypeDef) */
+#define USER_SPI_RESET_STATS	201	/* Clear the I/O counters */
+
+/* I/O counters, accumulated since power up or the last USER_SPI_RESET_STATS */
+typedef struct {
+	DWORD cmds;				/* Commands sent, including CMD55 of ACMDs */
+	DWORD rd_sectors;		/* Sectors read */
+	DWORD wr_sectors;		/* Sectors written */
+	DWORD rd_single;		/* Single block reads (CMD17) */
+	DWORD rd_multi;			/* Multiple block reads (CMD18) */
+	DWORD wr_single;		/* Single block writes (CMD24) */
+	DWORD wr_multi;			/* Multiple block writes (CMD25) */
+	DWORD ready_polls;		/* Bytes polled waiting for the card to be ready */
+	DWORD ready_ms;			/* Time spent waiting for the card to be ready [ms] */
+	DWORD token_polls;		/* Bytes polled waiting for a data start token */
+	DWORD errors;			/* Timeouts, rejected commands and failed transfers */
+} USER_SPI_StatsTypeDef;
+
 //we define these as inline because we don't want them to be actual function calls (they get "called" from the cubemx autogenerated user_diskio file)
 //we define them as extern because they are defined in a separate .c file to user_diskio.c (which #includes this .h file)
 
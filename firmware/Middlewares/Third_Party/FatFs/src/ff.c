@@ -3504,6 +3504,77 @@ FRESULT f_open (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Open a File by its First Cluster (Aeon extension)                     */
+/*-----------------------------------------------------------------------*/
+/* Opens an existing file for reading without following a path, from the
+/  first cluster and size found by an earlier lookup or listed in a catalog.
+/  The caller must check that they are still current. The object is
+/  registered in the lock table under its first cluster, as there is no
+/  directory entry to key it on, so it counts towards _FS_LOCK and is closed
+/  with f_close, but it doesn't lock out opening the same file by its path.
+/  Images are never written, so this is only used for reading. */
+
+FRESULT f_open_cluster (
+	FIL* fp,			/* Pointer to the blank file object */
+	DWORD sclust,		/* First cluster of the file */
+	FSIZE_t size		/* Size of the file */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	const TCHAR *path = _T("");
+#if _FS_LOCK != 0
+	DIR dj;
+#endif
+
+
+	if (!fp) return FR_INVALID_OBJECT;
+
+	res = find_volume(&path, &fs, 0);
+	if (res == FR_OK && (sclust < 2 || sclust >= fs->n_fatent || size == 0)) {
+		res = FR_INVALID_PARAMETER;
+	}
+#if _FS_LOCK != 0
+	if (res == FR_OK) {
+		dj.obj.fs = fs;
+		dj.obj.sclust = sclust;
+		dj.dptr = 0xFFFFFFFF;	/* Never the offset of a directory entry */
+		res = chk_lock(&dj, 0);
+		if (res == FR_OK) {
+			fp->obj.lockid = inc_lock(&dj, 0);
+			if (!fp->obj.lockid) res = FR_INT_ERR;
+		}
+	}
+#endif
+	if (res == FR_OK) {
+		fp->obj.attr = 0;
+		fp->obj.stat = 0;
+		fp->obj.sclust = sclust;
+		fp->obj.objsize = size;
+#if _USE_FASTSEEK
+		fp->cltbl = 0;			/* Disable fast seek mode */
+#endif
+		fp->obj.fs = fs;		/* Validate the file object */
+		fp->obj.id = fs->id;
+		fp->flag = FA_READ;
+		fp->err = 0;
+		fp->sect = 0;			/* Invalidate current data sector */
+		fp->fptr = 0;			/* Set file pointer top of the file */
+#if !_FS_READONLY
+		fp->dir_sect = 0;		/* No directory entry */
+		fp->dir_ptr = 0;
+#endif
+	}
+
+	if (res != FR_OK) fp->obj.fs = 0;	/* Invalidate file object on error */
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read File                                                             */
 /*-----------------------------------------------------------------------*/
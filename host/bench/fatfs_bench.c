@@ -0,0 +1,432 @@
+/**
+ * FatFs read pattern benchmark. A FAT32 volume is formatted on a sparse
+ * file-backed disk and filled with images in several layouts, then the
+ * firmware's way of opening and reading an image is replayed for every image
+ * and read chunk size, counting the disk_read calls and sectors each wake
+ * costs. Each wake mounts the volume afresh, like the firmware after standby.
+ *
+ * usage: fatfs_bench [--images N] [--image-kb N] [--cluster-kb N]
+ *                    [--chunks N,N...]
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diskio.h"
+#include "ff.h"
+#include "sd.h"
+
+#define BENCH_DISK_SECTORS (8u * 1024 * 1024)  // 4GB, like a small SDHC card
+#define BENCH_SECTOR_SIZE 512
+#define BENCH_LIST_MAX 16
+#define BENCH_FILLER_PATH "/filler.bin"
+#define BENCH_ALBUM_FRAG_CLUSTERS 16  // album fragment length when fragmented
+
+enum bench_layout_t {
+    BENCH_FILES,            // one file per image, written one by one
+    BENCH_FILES_FRAG,       // one file per image, written interleaved
+    BENCH_ALBUM,            // packed album, images on sector boundaries
+    BENCH_ALBUM_UNALIGNED,  // packed album, images back to back
+    BENCH_ALBUM_FRAG,       // packed album, in a few fragments
+    BENCH_ALBUM_NO_SEEK,    // packed album, read without fast seek
+    BENCH_LAYOUT_COUNT,
+};
+
+static const char* bench_layout_names[] = {
+    "files", "files-frag", "album", "album-unaligned", "album-frag",
+    "album-no-seek",
+};
+
+struct bench_stats_t {
+    uint32_t reads;        // disk_read calls
+    uint32_t multi_reads;  // calls reading more than one sector
+    uint32_t sectors;
+    uint32_t fat_sectors;  // sectors read from the FAT
+};
+
+static int bench_fd = -1;
+static struct bench_stats_t bench_stats;
+static FATFS bench_fs;
+
+static uint32_t bench_image_count = 20;
+static uint32_t bench_image_size = 120 * 1024;
+
+/*------------------------------ disk --------------------------------------*/
+
+DSTATUS disk_initialize(BYTE pdrv) { return pdrv == 0 ? 0 : STA_NOINIT; }
+
+DSTATUS disk_status(BYTE pdrv) { return pdrv == 0 ? 0 : STA_NOINIT; }
+
+DRESULT disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count) {
+    bench_stats.reads++;
+    if (count > 1) bench_stats.multi_reads++;
+    bench_stats.sectors += count;
+    if (bench_fs.fs_type != 0 && sector >= bench_fs.fatbase &&
+        sector < bench_fs.database) {
+        bench_stats.fat_sectors += count;
+    }
+
+    ssize_t size = (ssize_t)count * BENCH_SECTOR_SIZE;
+    off_t offset = (off_t)sector * BENCH_SECTOR_SIZE;
+    return pread(bench_fd, buff, size, offset) == size ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count) {
+    ssize_t size = (ssize_t)count * BENCH_SECTOR_SIZE;
+    off_t offset = (off_t)sector * BENCH_SECTOR_SIZE;
+    return pwrite(bench_fd, buff, size, offset) == size ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
+    switch (cmd) {
+        case CTRL_SYNC:
+            return RES_OK;
+        case GET_SECTOR_COUNT:
+            *(DWORD*)buff = BENCH_DISK_SECTORS;
+            return RES_OK;
+        case GET_SECTOR_SIZE:
+            *(WORD*)buff = BENCH_SECTOR_SIZE;
+            return RES_OK;
+        case GET_BLOCK_SIZE:
+            *(DWORD*)buff = 1;
+            return RES_OK;
+    }
+    return RES_PARERR;
+}
+
+DWORD get_fattime(void) { return 0; }
+
+/*------------------------------ volume ------------------------------------*/
+
+static void bench_check(FRESULT fres, const char* what) {
+    if (fres != FR_OK) {
+        fprintf(stderr, "%s failed (%d)\n", what, fres);
+        exit(1);
+    }
+}
+
+static void bench_fill(uint8_t* buf, uint32_t size, uint32_t seed) {
+    for (uint32_t i = 0; i < size; i++) buf[i] = (uint8_t)(seed * 131 + i);
+}
+
+/**
+ * @brief Write files side by side, a piece of each in turn, so their
+ * clusters interleave. With a single file this writes it in one go.
+ */
+static void bench_write_interleaved(const char** paths, uint32_t count,
+                                    uint32_t size, uint32_t piece) {
+    FIL* files = calloc(count, sizeof(FIL));
+    uint8_t* buf = malloc(piece);
+    UINT written;
+
+    for (uint32_t f = 0; f < count; f++) {
+        bench_check(f_open(&files[f], paths[f], FA_WRITE | FA_CREATE_ALWAYS),
+                    paths[f]);
+    }
+    for (uint32_t pos = 0; pos < size; pos += piece) {
+        uint32_t len = size - pos < piece ? size - pos : piece;
+        for (uint32_t f = 0; f < count; f++) {
+            bench_fill(buf, len, f + pos);
+            bench_check(f_write(&files[f], buf, len, &written), paths[f]);
+        }
+    }
+    for (uint32_t f = 0; f < count; f++) f_close(&files[f]);
+    free(buf);
+    free(files);
+}
+
+static void bench_write_files(const char* dir, bool fragmented,
+                              uint32_t cluster) {
+    char(*names)[32] = calloc(bench_image_count, sizeof(*names));
+    const char** paths = calloc(bench_image_count, sizeof(char*));
+
+    bench_check(f_mkdir(dir), dir);
+    for (uint32_t i = 0; i < bench_image_count; i++) {
+        snprintf(names[i], sizeof(names[i]), "%s/%lu.slc", dir,
+                 (unsigned long)i);
+        paths[i] = names[i];
+    }
+    // FatFs keeps at most _FS_LOCK files open, so interleave them in groups
+    uint32_t group = fragmented ? _FS_LOCK : 1;
+    for (uint32_t i = 0; i < bench_image_count; i += group) {
+        uint32_t count = bench_image_count - i < group ? bench_image_count - i
+                                                       : group;
+        bench_write_interleaved(&paths[i], count, bench_image_size,
+                                fragmented ? cluster : bench_image_size);
+    }
+    free(paths);
+    free(names);
+}
+
+/**
+ * @brief Write an album like convert.py: header, entry table, then the
+ * images. When fragmented, a filler file is written alongside it.
+ */
+static void bench_write_album(const char* path, bool aligned,
+                              uint32_t fragment_size) {
+    uint32_t offset = sizeof(struct sd_album_header_t) +
+                      bench_image_count * sizeof(struct sd_album_entry_t);
+    uint32_t stride = bench_image_size;
+    if (aligned) {
+        offset = (offset + BENCH_SECTOR_SIZE - 1) & ~(BENCH_SECTOR_SIZE - 1);
+        stride = (stride + BENCH_SECTOR_SIZE - 1) & ~(BENCH_SECTOR_SIZE - 1);
+    }
+    uint32_t size = offset + stride * bench_image_count;
+
+    uint8_t* album = calloc(1, size);
+    struct sd_album_header_t header = {
+        .magic = SD_ALBUM_MAGIC,
+        .version = SD_ALBUM_VERSION,
+        .entry_size = sizeof(struct sd_album_entry_t),
+        .count = bench_image_count,
+    };
+    memcpy(album, &header, sizeof(header));
+    for (uint32_t i = 0; i < bench_image_count; i++) {
+        struct sd_album_entry_t entry = {offset + i * stride, bench_image_size};
+        memcpy(album + sizeof(header) + i * sizeof(entry), &entry,
+               sizeof(entry));
+        bench_fill(album + entry.offset, bench_image_size, i);
+    }
+
+    FIL fp, filler;
+    UINT written;
+    bench_check(f_open(&fp, path, FA_WRITE | FA_CREATE_ALWAYS), path);
+    if (fragment_size == 0) fragment_size = size;
+    if (fragment_size < size) {
+        bench_check(
+            f_open(&filler, BENCH_FILLER_PATH, FA_WRITE | FA_OPEN_APPEND),
+            BENCH_FILLER_PATH);
+    }
+    for (uint32_t pos = 0; pos < size; pos += fragment_size) {
+        uint32_t len = size - pos < fragment_size ? size - pos : fragment_size;
+        bench_check(f_write(&fp, album + pos, len, &written), path);
+        if (fragment_size < size) {
+            // the filler takes the next cluster, so the album continues after
+            bench_check(f_write(&filler, album, bench_fs.csize * 512, &written),
+                        BENCH_FILLER_PATH);
+        }
+    }
+    f_close(&fp);
+    if (fragment_size < size) f_close(&filler);
+    free(album);
+}
+
+static const char* bench_album_path(enum bench_layout_t layout) {
+    switch (layout) {
+        case BENCH_ALBUM_UNALIGNED:
+            return "/unaligned.bin";
+        case BENCH_ALBUM_FRAG:
+            return "/frag.bin";
+        default:
+            return "/album.bin";
+    }
+}
+
+/*------------------------------ replay ------------------------------------*/
+
+// Album layout remembered between wakes, like the firmware keeps it in FRAM
+static DWORD bench_album_sclust, bench_album_size;
+
+static bool bench_read_to_end(FIL* fp, uint32_t length, uint32_t chunk) {
+    static uint8_t buf[65536];
+    UINT bytes_read;
+
+    while (length > 0) {
+        uint32_t len = length < chunk ? length : chunk;
+        if (f_read(fp, buf, len, &bytes_read) != FR_OK) return false;
+        if (bytes_read == 0) break;
+        length -= bytes_read;
+    }
+    return true;
+}
+
+/**
+ * @brief Set up fast seek as sd_album_enable_fast_seek() does.
+ */
+static void bench_album_fast_seek(FIL* fp, DWORD* clmt) {
+    fp->cltbl = clmt;
+    if (bench_album_sclust != 0 && bench_album_sclust == fp->obj.sclust &&
+        bench_album_size == f_size(fp)) {
+        DWORD cluster_bytes = (DWORD)fp->obj.fs->csize * _MIN_SS;
+        clmt[0] = 4;
+        clmt[1] = (bench_album_size + cluster_bytes - 1) / cluster_bytes;
+        clmt[2] = bench_album_sclust;
+        clmt[3] = 0;
+        return;
+    }
+
+    clmt[0] = SD_ALBUM_CLMT_SIZE;
+    if (f_lseek(fp, CREATE_LINKMAP) != FR_OK) {
+        fp->cltbl = NULL;
+        bench_album_sclust = bench_album_size = 0;
+        return;
+    }
+    bool single = clmt[0] == 4;
+    bench_album_sclust = single ? fp->obj.sclust : 0;
+    bench_album_size = single ? f_size(fp) : 0;
+}
+
+/**
+ * @brief Open and read one image the way the firmware does for the layout.
+ */
+static bool bench_wake(enum bench_layout_t layout, uint32_t index,
+                       uint32_t chunk) {
+    static DWORD clmt[SD_ALBUM_CLMT_SIZE];
+    FIL fp;
+    UINT bytes_read;
+    bool ok;
+
+    if (layout == BENCH_FILES || layout == BENCH_FILES_FRAG) {
+        char path[32];
+        snprintf(path, sizeof(path), "%s/%lu.slc",
+                 layout == BENCH_FILES ? "/files" : "/frag",
+                 (unsigned long)index);
+        if (f_open(&fp, path, FA_READ) != FR_OK) return false;
+        ok = bench_read_to_end(&fp, f_size(&fp), chunk);
+        f_close(&fp);
+        return ok;
+    }
+
+    struct sd_album_header_t header;
+    struct sd_album_entry_t entry;
+    if (f_open(&fp, bench_album_path(layout), FA_READ) != FR_OK) return false;
+    ok = f_read(&fp, &header, sizeof(header), &bytes_read) == FR_OK &&
+         bytes_read == sizeof(header);
+    if (ok && layout != BENCH_ALBUM_NO_SEEK) bench_album_fast_seek(&fp, clmt);
+    ok = ok &&
+         f_lseek(&fp, sizeof(header) + index * header.entry_size) == FR_OK &&
+         f_read(&fp, &entry, sizeof(entry), &bytes_read) == FR_OK &&
+         bytes_read == sizeof(entry) && f_lseek(&fp, entry.offset) == FR_OK &&
+         bench_read_to_end(&fp, entry.length, chunk);
+    f_close(&fp);
+    return ok;
+}
+
+static int bench_parse_list(const char* arg, int* list) {
+    int count = 0;
+    while (count < BENCH_LIST_MAX && *arg != '\0') {
+        char* end;
+        list[count++] = strtol(arg, &end, 0);
+        arg = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') break;
+    }
+    return count;
+}
+
+int main(int argc, char** argv) {
+    int chunks[BENCH_LIST_MAX] = {512, 1024, 4096, 16384};
+    int chunk_count = 4;
+    uint32_t cluster_kb = 32;
+
+    static const struct option options[] = {
+        {"images", required_argument, NULL, 'n'},
+        {"image-kb", required_argument, NULL, 's'},
+        {"cluster-kb", required_argument, NULL, 'c'},
+        {"chunks", required_argument, NULL, 'k'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                bench_image_count = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                bench_image_size = strtoul(optarg, NULL, 0) * 1024;
+                break;
+            case 'c':
+                cluster_kb = strtoul(optarg, NULL, 0);
+                break;
+            case 'k':
+                chunk_count = bench_parse_list(optarg, chunks);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [--images N] [--image-kb N] "
+                        "[--cluster-kb N] [--chunks N,N...]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    for (int c = 0; c < chunk_count; c++) {
+        if (chunks[c] < 1 || chunks[c] > 65536) {
+            fprintf(stderr, "chunk sizes must be 1 to 65536 bytes\n");
+            return 1;
+        }
+    }
+
+    // sparse backing file, removed once closed
+    char disk_path[] = "/tmp/fatfs_bench_XXXXXX";
+    bench_fd = mkstemp(disk_path);
+    off_t disk_size = (off_t)BENCH_DISK_SECTORS * BENCH_SECTOR_SIZE;
+    if (bench_fd < 0 || ftruncate(bench_fd, disk_size) != 0) {
+        perror(disk_path);
+        return 1;
+    }
+    unlink(disk_path);
+
+    static BYTE work[_MAX_SS];
+    bench_check(f_mkfs("", FM_FAT32 | FM_SFD, cluster_kb * 1024, work,
+                       sizeof(work)),
+                "f_mkfs");
+    bench_check(f_mount(&bench_fs, "", 1), "f_mount");
+
+    uint32_t cluster = bench_fs.csize * BENCH_SECTOR_SIZE;
+    bench_write_files("/files", false, cluster);
+    bench_write_files("/frag", true, cluster);
+    bench_write_album(bench_album_path(BENCH_ALBUM), true, 0);
+    bench_write_album(bench_album_path(BENCH_ALBUM_UNALIGNED), false, 0);
+    bench_write_album(bench_album_path(BENCH_ALBUM_FRAG), true,
+                      BENCH_ALBUM_FRAG_CLUSTERS * cluster);
+    f_mount(NULL, "", 0);
+
+    memset(&bench_stats, 0, sizeof(bench_stats));
+    bench_check(f_mount(&bench_fs, "", 1), "f_mount");
+    printf("%lu images of %lu bytes, %lu byte clusters, mount reads %lu "
+           "sectors\n\n",
+           (unsigned long)bench_image_count, (unsigned long)bench_image_size,
+           (unsigned long)cluster, (unsigned long)bench_stats.sectors);
+    f_mount(NULL, "", 0);
+
+    uint32_t image_sectors =
+        (bench_image_size + BENCH_SECTOR_SIZE - 1) / BENCH_SECTOR_SIZE;
+    printf("per wake, after mounting:\n");
+    printf("%-16s %6s %8s %8s %8s %8s %9s\n", "layout", "chunk", "reads",
+           "multi", "sectors", "fat", "overhead");
+    for (int layout = 0; layout < BENCH_LAYOUT_COUNT; layout++) {
+        for (int c = 0; c < chunk_count; c++) {
+            struct bench_stats_t total = {0};
+            bench_album_sclust = bench_album_size = 0;
+
+            for (uint32_t i = 0; i < bench_image_count; i++) {
+                bench_check(f_mount(&bench_fs, "", 1), "f_mount");
+                memset(&bench_stats, 0, sizeof(bench_stats));
+                if (!bench_wake(layout, i, chunks[c])) {
+                    fprintf(stderr, "%s: reading image %lu failed\n",
+                            bench_layout_names[layout], (unsigned long)i);
+                    return 1;
+                }
+                total.reads += bench_stats.reads;
+                total.multi_reads += bench_stats.multi_reads;
+                total.sectors += bench_stats.sectors;
+                total.fat_sectors += bench_stats.fat_sectors;
+                f_mount(NULL, "", 0);
+            }
+
+            double n = bench_image_count;
+            printf("%-16s %6d %8.1f %8.1f %8.1f %8.1f %8.1f%%\n",
+                   bench_layout_names[layout], chunks[c], total.reads / n,
+                   total.multi_reads / n, total.sectors / n,
+                   total.fat_sectors / n,
+                   100.0 * (total.sectors / n - image_sectors) / image_sectors);
+        }
+    }
+
+    close(bench_fd);
+    return 0;
+}
@@ -0,0 +1,123 @@
+"""
+Run the Cortex-M4 SLIC decode benchmark (slic_bench_m4, built by
+`make -C host bench-m4`) under qemu-arm with the m4_cycles plugin, for every
+decode kernel, input buffer size (FILE_BUF_SIZE) and output chunk size, and
+report instructions and estimated cycles per output byte over a corpus of
+.slc frames. Flash wait state stalls are estimated with all code in flash and
+with the functions the firmware's linker script places in SRAM2, to show the
+cycles saved per frame by running them from RAM.
+"""
+
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+
+BUILD_DIR = os.path.join(os.path.dirname(__file__), "..", "build", "bench")
+LINKER_SCRIPT = os.path.join(os.path.dirname(__file__), "..", "..", "firmware", "STM32L412K8TX_FLASH.ld")
+KERNELS = ["slic_decode"]
+CHUNK_SIZES = [512, 1024, 2000, 5000, 10000]
+CPU_HZ = 80e6
+FLASH_WS = 4  # FLASH_LATENCY_4 at 80 MHz
+
+
+def find_corpus(corpus: str) -> list:
+    """
+    List the .slc frames of a corpus directory, such as the output of
+    convert.py, in either layout. The benchmark target reads the container
+    header of each frame and skips those stored with the raw codec, which
+    aren't decoded.
+    """
+    frames = sorted(glob.glob(os.path.join(corpus, "**", "*.slc"), recursive=True))
+    if not frames:
+        sys.exit(f"No .slc frames in {corpus}")
+    return frames
+
+
+def find_targets(build_dir: str) -> dict:
+    """
+    Map each FILE_BUF_SIZE built to its benchmark binary.
+    """
+    targets = {}
+    for path in glob.glob(os.path.join(build_dir, "slic_bench_m4_*")):
+        match = re.search(r"_(\d+)$", path)
+        if match:
+            targets[int(match.group(1))] = path
+    if not targets:
+        sys.exit(f"No benchmark targets in {build_dir}, run make -C host bench-m4")
+    return dict(sorted(targets.items()))
+
+
+def find_ram_functions(linker_script: str) -> list:
+    """
+    List the library functions placed in SRAM2 by name in the .ram2func
+    section of the linker script, as *(.text.name).
+    """
+    with open(linker_script) as f:
+        script = f.read()
+    match = re.search(r"\.ram2func\s*:\s*\{(.*?)\}", script, re.S)
+    if match is None:
+        sys.exit(f"No .ram2func section in {linker_script}")
+    return re.findall(r"\*\(\.text\.(\w+)\)", match.group(1))
+
+
+def run(qemu: str, plugin: str, target: str, kernel: str, chunk: int, frames: list) -> dict:
+    """
+    Decode the corpus once under the emulator and collect the counts of the
+    program and the plugin.
+    """
+    result = subprocess.run([qemu, "-plugin", plugin, "-d", "plugin", target, kernel, str(chunk)] + frames,
+                            capture_output=True, text=True)
+    if result.returncode != 0:
+        sys.exit(f"{target} {kernel} {chunk} failed:\n{result.stderr}")
+
+    counts = {}
+    for output in (result.stdout, result.stderr):
+        for name, value in re.findall(r"(\w+) (\d+)", output):
+            counts[name] = int(value)
+    return counts
+
+
+def main():
+    parser = argparse.ArgumentParser(description="SLIC decode cost on the Cortex-M4, estimated under qemu-arm")
+    parser.add_argument("corpus", help="Directory of .slc frames, e.g. image_conversion/img_out")
+    parser.add_argument("--build", default=BUILD_DIR, help="Directory holding the benchmark targets and plugin")
+    parser.add_argument("--qemu", default="qemu-arm", help="qemu-arm user mode emulator")
+    parser.add_argument("--kernels", nargs="+", default=KERNELS, help="Decode kernels to run")
+    parser.add_argument("--chunks", nargs="+", type=int, default=CHUNK_SIZES,
+                        help="Output chunk sizes in bytes (the firmware decodes 5000 at a time)")
+    parser.add_argument("--flash-ws", type=int, default=FLASH_WS, help="Flash wait states")
+    parser.add_argument("--linker-script", default=LINKER_SCRIPT,
+                        help="Firmware linker script listing the functions run from SRAM2")
+    args = parser.parse_args()
+
+    frames = find_corpus(args.corpus)
+    targets = find_targets(args.build)
+    ram_functions = find_ram_functions(args.linker_script)
+    plugin = os.path.join(args.build, "libm4_cycles.so")
+    plugin += f",flash_ws={args.flash_ws},ram={':'.join(ram_functions)}"
+
+    print(f"{len(frames)} .slc files at {CPU_HZ / 1e6:.0f} MHz, {args.flash_ws} flash wait states, "
+          f"in SRAM2: {', '.join(ram_functions)}")
+    print("cycles/B with no wait states, then flash stalls/B with all code in flash and with the SRAM2 functions\n")
+    print(f"{'kernel':<16} {'file buf':>8} {'chunk':>6} {'insn/B':>8} {'cycles/B':>9} "
+          f"{'taken br/B':>10} {'stall/B':>8} {'sram2':>8} {'saved cyc/frame':>15} {'ms/frame':>9}")
+    for kernel in args.kernels:
+        for file_buf, target in targets.items():
+            for chunk in args.chunks:
+                counts = run(args.qemu, plugin, target, kernel, chunk, frames)
+                if counts["frames"] == 0:
+                    sys.exit(f"All {counts['skipped']} frames in {args.corpus} are raw, none to decode")
+                out_bytes = counts["bytes"]
+                saved_per_frame = (counts["stalls_flash"] - counts["stalls_ram"]) / counts["frames"]
+                ms_per_frame = (counts["cycles"] + counts["stalls_ram"]) / counts["frames"] / CPU_HZ * 1000
+                print(f"{kernel:<16} {file_buf:>8} {chunk:>6} {counts['insns'] / out_bytes:>8.2f} "
+                      f"{counts['cycles'] / out_bytes:>9.2f} {counts['branches_taken'] / out_bytes:>10.3f} "
+                      f"{counts['stalls_flash'] / out_bytes:>8.3f} {counts['stalls_ram'] / out_bytes:>8.3f} "
+                      f"{saved_per_frame:>15.0f} {ms_per_frame:>9.1f}")
+
+
+if __name__ == "__main__":
+    main()
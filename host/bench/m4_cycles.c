@@ -0,0 +1,270 @@
+/**
+ * QEMU TCG plugin estimating Cortex-M4 cycles of Thumb code run under
+ * qemu-arm. Instructions executed between calls to bench_begin() and
+ * bench_end() are counted, each costed from its mnemonic using the cycle
+ * timings of the Cortex-M4 TRM, plus a pipeline refill for every taken
+ * branch. These cycles assume memory with no wait states.
+ *
+ * Flash wait states are estimated separately, from a model of the ART
+ * accelerator's instruction cache (prefetch disabled, as in the firmware):
+ * an instruction fetch stalls for the wait states when its line isn't
+ * cached, and the line is then filled. Filling the rest of a line and data
+ * reads from flash aren't modelled, so the stalls are a lower bound. Stalls
+ * are counted twice, once with all code in flash and once with the functions
+ * given by the ram=name:name... argument in zero wait state SRAM. Set the
+ * wait states with flash_ws=N (4 at 80 MHz).
+ *
+ * Prints the instruction, cycle, taken branch and stall counts when the
+ * program exits (qemu-arm -d plugin).
+ */
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qemu-plugin.h>
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+#define M4_BRANCH_REFILL 2  // taken branches cost 1 + P, with P of 1 to 3
+#define M4_DIV_CYCLES 7     // SDIV and UDIV take 2 to 12 cycles
+
+#define M4_ICACHE_LINES 32       // ART instruction cache, 32 lines of 4x64 bits
+#define M4_ICACHE_LINE_BYTES 32
+#define M4_FLASH_WORD_BYTES 8    // flash is read 64 bits at a time
+#define M4_RAM_SYMBOLS_MAX 64
+
+enum m4_marker_t {
+    M4_MARKER_NONE,
+    M4_MARKER_BEGIN,
+    M4_MARKER_END,
+};
+
+// Flash words fetched by a translation block, in order
+struct m4_fetch_t {
+    uint64_t word;  // address / M4_FLASH_WORD_BYTES
+    bool in_ram;    // part of a function placed in SRAM
+};
+
+struct m4_tb_t {
+    uint64_t start, end;  // end is the fall through address
+    uint64_t insns, cycles;
+    enum m4_marker_t marker;
+    size_t n_fetches;
+    struct m4_fetch_t* fetches;
+};
+
+// Least recently used instruction cache, fully associative
+struct m4_icache_t {
+    uint64_t tags[M4_ICACHE_LINES];
+    uint64_t used[M4_ICACHE_LINES];  // 0 if the line is empty
+    uint64_t clock;
+};
+
+static bool m4_counting;
+static const struct m4_tb_t* m4_prev_tb;
+static uint64_t m4_insns, m4_cycles, m4_branches_taken;
+
+static unsigned m4_flash_ws;
+static const char* m4_ram_symbols[M4_RAM_SYMBOLS_MAX];
+static size_t m4_n_ram_symbols;
+
+// stalls with all code in flash, and with the RAM functions in SRAM
+static struct m4_icache_t m4_icache_flash, m4_icache_ram;
+static uint64_t m4_stalls_flash, m4_stalls_ram;
+
+/**
+ * @brief Number of registers in a register list such as {r4-r7, lr}.
+ */
+static int m4_register_count(const char* disas) {
+    const char* p = strchr(disas, '{');
+    if (p == NULL) return 1;
+
+    int count = 0;
+    while (*p != '\0' && *p != '}') {
+        p++;
+        while (*p == ' ') p++;
+        int first = -1, last = -1;
+        if (p[0] == 'r' && isdigit((unsigned char)p[1])) first = atoi(p + 1);
+        const char* dash = strpbrk(p, "-,}");
+        if (dash != NULL && *dash == '-' && dash[1] == 'r') {
+            last = atoi(dash + 2);
+        }
+        count += first >= 0 && last >= first ? last - first + 1 : 1;
+        p = strpbrk(p, ",}");
+        if (p == NULL) break;
+    }
+    return count;
+}
+
+static bool m4_mnemonic_is(const char* mnemonic, const char* prefix) {
+    return strncmp(mnemonic, prefix, strlen(prefix)) == 0;
+}
+
+/**
+ * @brief Cycles of an instruction, not counting a taken branch refill.
+ */
+static unsigned m4_insn_cycles(const char* disas) {
+    char mnemonic[16] = {0};
+    sscanf(disas, "%15s", mnemonic);
+    for (char* c = mnemonic; *c != '\0'; c++) *c = tolower((unsigned char)*c);
+
+    if (m4_mnemonic_is(mnemonic, "push") || m4_mnemonic_is(mnemonic, "pop") ||
+        m4_mnemonic_is(mnemonic, "ldm") || m4_mnemonic_is(mnemonic, "stm") ||
+        m4_mnemonic_is(mnemonic, "vpush") || m4_mnemonic_is(mnemonic, "vpop")) {
+        return 1 + m4_register_count(disas);
+    }
+    if (m4_mnemonic_is(mnemonic, "ldrd") || m4_mnemonic_is(mnemonic, "strd")) {
+        return 3;
+    }
+    if (m4_mnemonic_is(mnemonic, "ldr") || m4_mnemonic_is(mnemonic, "vldr")) {
+        return 2;
+    }
+    if (m4_mnemonic_is(mnemonic, "sdiv") || m4_mnemonic_is(mnemonic, "udiv")) {
+        return M4_DIV_CYCLES;
+    }
+    if (m4_mnemonic_is(mnemonic, "mla") || m4_mnemonic_is(mnemonic, "mls")) {
+        return 2;
+    }
+    return 1;
+}
+
+static bool m4_is_ram_symbol(const char* symbol) {
+    if (symbol == NULL) return false;
+    for (size_t i = 0; i < m4_n_ram_symbols; i++) {
+        if (strcmp(m4_ram_symbols[i], symbol) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Fetch a flash word through the instruction cache.
+ *
+ * @return the stall cycles of the fetch
+ */
+static unsigned m4_icache_fetch(struct m4_icache_t* cache, uint64_t word) {
+    uint64_t tag = word * M4_FLASH_WORD_BYTES / M4_ICACHE_LINE_BYTES;
+    int victim = 0;
+
+    cache->clock++;
+    for (int i = 0; i < M4_ICACHE_LINES; i++) {
+        if (cache->used[i] != 0 && cache->tags[i] == tag) {
+            cache->used[i] = cache->clock;
+            return 0;
+        }
+        if (cache->used[i] < cache->used[victim]) victim = i;
+    }
+    cache->tags[victim] = tag;
+    cache->used[victim] = cache->clock;
+    return m4_flash_ws;
+}
+
+static void m4_tb_exec(unsigned int vcpu_index, void* udata) {
+    const struct m4_tb_t* tb = udata;
+
+    if (tb->marker == M4_MARKER_BEGIN) m4_counting = true;
+    if (m4_counting) {
+        m4_insns += tb->insns;
+        m4_cycles += tb->cycles;
+        if (m4_prev_tb != NULL && m4_prev_tb->end != tb->start) {
+            m4_cycles += M4_BRANCH_REFILL;
+            m4_branches_taken++;
+        }
+        if (m4_flash_ws != 0) {
+            for (size_t i = 0; i < tb->n_fetches; i++) {
+                const struct m4_fetch_t* fetch = &tb->fetches[i];
+                m4_stalls_flash +=
+                    m4_icache_fetch(&m4_icache_flash, fetch->word);
+                if (!fetch->in_ram) {
+                    m4_stalls_ram +=
+                        m4_icache_fetch(&m4_icache_ram, fetch->word);
+                }
+            }
+        }
+    }
+    if (tb->marker == M4_MARKER_END) m4_counting = false;
+    m4_prev_tb = tb;
+}
+
+static void m4_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb* tb) {
+    size_t n = qemu_plugin_tb_n_insns(tb);
+    struct m4_tb_t* info = calloc(1, sizeof(*info));
+    // an instruction spans at most two flash words
+    info->fetches = calloc(2 * n, sizeof(*info->fetches));
+
+    for (size_t i = 0; i < n; i++) {
+        struct qemu_plugin_insn* insn = qemu_plugin_tb_get_insn(tb, i);
+        char* disas = qemu_plugin_insn_disas(insn);
+        info->cycles += m4_insn_cycles(disas);
+        free(disas);
+
+        uint64_t vaddr = qemu_plugin_insn_vaddr(insn);
+        bool in_ram = m4_is_ram_symbol(qemu_plugin_insn_symbol(insn));
+        uint64_t first = vaddr / M4_FLASH_WORD_BYTES;
+        uint64_t last =
+            (vaddr + qemu_plugin_insn_size(insn) - 1) / M4_FLASH_WORD_BYTES;
+        for (uint64_t word = first; word <= last; word++) {
+            if (info->n_fetches == 0 ||
+                info->fetches[info->n_fetches - 1].word != word) {
+                info->fetches[info->n_fetches].word = word;
+                info->fetches[info->n_fetches].in_ram = in_ram;
+                info->n_fetches++;
+            }
+        }
+
+        if (i == 0) {
+            const char* symbol = qemu_plugin_insn_symbol(insn);
+            info->start = qemu_plugin_insn_vaddr(insn);
+            if (symbol != NULL && strcmp(symbol, "bench_begin") == 0) {
+                info->marker = M4_MARKER_BEGIN;
+            }
+            if (symbol != NULL && strcmp(symbol, "bench_end") == 0) {
+                info->marker = M4_MARKER_END;
+            }
+        }
+        if (i == n - 1) {
+            info->end =
+                qemu_plugin_insn_vaddr(insn) + qemu_plugin_insn_size(insn);
+        }
+    }
+    info->insns = n;
+
+    qemu_plugin_register_vcpu_tb_exec_cb(tb, m4_tb_exec, QEMU_PLUGIN_CB_NO_REGS,
+                                         info);
+}
+
+static void m4_exit(qemu_plugin_id_t id, void* udata) {
+    char line[192];
+    snprintf(line, sizeof(line),
+             "insns %" PRIu64 " cycles %" PRIu64 " branches_taken %" PRIu64
+             " stalls_flash %" PRIu64 " stalls_ram %" PRIu64 "\n",
+             m4_insns, m4_cycles, m4_branches_taken, m4_stalls_flash,
+             m4_stalls_ram);
+    qemu_plugin_outs(line);
+}
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
+                                           const qemu_info_t* info, int argc,
+                                           char** argv) {
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "flash_ws=", 9) == 0) {
+            m4_flash_ws = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "ram=", 4) == 0) {
+            char* names = strdup(argv[i] + 4);
+            for (char* name = strtok(names, ":"); name != NULL;
+                 name = strtok(NULL, ":")) {
+                if (m4_n_ram_symbols < M4_RAM_SYMBOLS_MAX) {
+                    m4_ram_symbols[m4_n_ram_symbols++] = name;
+                }
+            }
+        } else {
+            fprintf(stderr, "m4_cycles: unknown argument %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    qemu_plugin_register_vcpu_tb_trans_cb(id, m4_tb_trans);
+    qemu_plugin_register_atexit_cb(id, m4_exit, NULL);
+    return 0;
+}
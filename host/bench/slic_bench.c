@@ -0,0 +1,703 @@
+/**
+ * Host throughput benchmark of slic_decode. A corpus of dithered photos, flat
+ * graphics and noise is generated and encoded at 8, 16, 24 and 32 bpp, then
+ * each frame is decoded through a read callback for every output chunk size
+ * and callback latency, checking the output against the source pixels. Ops
+ * whose operands straddle an input buffer refill are checked separately.
+ * FILE_BUF_SIZE is fixed at compile time, so the Makefile builds one binary
+ * per size (make -C host bench-slic).
+ *
+ * usage: slic_bench [--chunks N,N...] [--latency-us N,N...] [--min-ms N]
+ */
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "slic.h"
+
+#define BENCH_WIDTH 400  // pixels of a frame, as packed by convert.py
+#define BENCH_HEIGHT 480
+#define BENCH_PIXELS (BENCH_WIDTH * BENCH_HEIGHT)
+#define BENCH_LIST_MAX 16
+
+// Operation classes counted by the encoders
+#define BENCH_OPS(X)                              \
+    X(BENCH_OP_RUN, "run")                        \
+    X(BENCH_OP_INDEX, "index")                    \
+    X(BENCH_OP_DIFF, "diff")                      \
+    X(BENCH_OP_LUMA, "luma")                      \
+    X(BENCH_OP_LITERAL, "literal")
+
+#define BENCH_OP_ENUM(id, name) id,
+enum bench_op_t { BENCH_OPS(BENCH_OP_ENUM) BENCH_OP_COUNT };
+#undef BENCH_OP_ENUM
+
+#define BENCH_OP_NAME(id, name) name,
+static const char* bench_op_names[] = {BENCH_OPS(BENCH_OP_NAME)};
+#undef BENCH_OP_NAME
+
+enum bench_kind_t {
+    BENCH_PHOTO,  // smooth image, dithered to the panel colours at 8 bpp
+    BENCH_FLAT,   // large areas of few colours, like graphics and text
+    BENCH_NOISE,  // random pixels, the worst case
+    BENCH_KIND_COUNT,
+};
+
+static const char* bench_kind_names[] = {"photo", "flat", "noise"};
+static const int bench_depths[] = {8, 16, 24, 32};
+
+struct bench_frame_t {
+    enum bench_kind_t kind;
+    int bpp;
+    uint8_t* pixels;  // source pixels, bpp / 8 bytes each
+    uint8_t* data;    // encoded file
+    int32_t size;
+    uint32_t ops[BENCH_OP_COUNT];    // encoded operations per class
+    uint32_t op_pixels[BENCH_OP_COUNT];  // pixels produced per class
+};
+
+struct bench_encoder_t {
+    uint8_t* out;
+    int32_t size;
+    uint32_t* ops;
+    uint32_t* op_pixels;
+};
+
+// Colours of the panel, in the order of the palette used by convert.py
+static const uint8_t bench_palette[7][3] = {
+    {0, 0, 0},   {255, 255, 255}, {0, 255, 0},   {0, 0, 255},
+    {255, 0, 0}, {255, 255, 0},   {255, 125, 0},
+};
+
+static uint32_t bench_rng = 1;
+
+static uint32_t bench_random(void) {
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 17;
+    bench_rng ^= bench_rng << 5;
+    return bench_rng;
+}
+
+static double bench_now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*------------------------------ corpus ------------------------------------*/
+
+/**
+ * @brief Colour of a synthetic photo: smooth gradients with some texture.
+ */
+static void bench_photo_rgb(int x, int y, int width, int height, int rgb[3]) {
+    int fx = x * 256 / width, fy = y * 256 / height;
+    int texture = (int)(bench_random() % 24) - 12;
+    rgb[0] = fx + texture;
+    rgb[1] = (fx + fy) / 2 + texture;
+    rgb[2] = 255 - fy + texture;
+    if ((x / 40 + y / 40) % 5 == 0) rgb[1] = 255 - rgb[1];  // some edges
+}
+
+static void bench_flat_rgb(int x, int y, int width, int height, int rgb[3]) {
+    static const int colours[4][3] = {
+        {255, 255, 255}, {0, 0, 0}, {255, 0, 0}, {0, 0, 255}};
+    int block = (x * 4 / width) + (y * 3 / height);
+    int c = block % 4;
+    if (y % 48 < 12 && x % 16 < 10 && (x / 16 + y / 48) % 3 == 0) {
+        c = 1;  // lines of "text"
+    }
+    memcpy(rgb, colours[c], sizeof(colours[c]));
+}
+
+/**
+ * @brief Dither an RGB image to the panel colours (Floyd-Steinberg) and pack
+ * two 4-bit pixels per byte, like convert.py.
+ */
+static void bench_dither_packed(enum bench_kind_t kind, uint8_t* out) {
+    int width = BENCH_WIDTH * 2, height = BENCH_HEIGHT;
+    int(*err)[3] = calloc((size_t)(width + 2) * 2, sizeof(*err));
+    int(*row)[3] = err + 1, (*next)[3] = err + width + 3;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int rgb[3];
+            if (kind == BENCH_PHOTO) {
+                bench_photo_rgb(x, y, width, height, rgb);
+            } else {
+                bench_flat_rgb(x, y, width, height, rgb);
+            }
+
+            int best = 0, best_dist = INT32_MAX;
+            for (int c = 0; c < 7; c++) {
+                int dist = 0;
+                for (int k = 0; k < 3; k++) {
+                    int d = rgb[k] + row[x][k] / 16 - bench_palette[c][k];
+                    dist += d * d;
+                }
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = c;
+                }
+            }
+            for (int k = 0; k < 3; k++) {
+                int e = rgb[k] + row[x][k] / 16 - bench_palette[best][k];
+                row[x + 1][k] += e * 7;
+                next[x - 1][k] += e * 3;
+                next[x][k] += e * 5;
+                next[x + 1][k] += e;
+            }
+
+            uint8_t* p = &out[y * BENCH_WIDTH + x / 2];
+            *p = x % 2 ? (*p | best) : (uint8_t)(best << 4);
+        }
+        memcpy(row - 1, next - 1, sizeof(*err) * (width + 2));
+        memset(next - 1, 0, sizeof(*err) * (width + 2));
+    }
+    free(err);
+}
+
+static void bench_generate(struct bench_frame_t* frame) {
+    int bytes = frame->bpp / 8;
+    frame->pixels = malloc((size_t)BENCH_PIXELS * bytes);
+
+    if (frame->kind == BENCH_NOISE) {
+        for (int i = 0; i < BENCH_PIXELS * bytes; i++) {
+            frame->pixels[i] = bench_random();
+        }
+        return;
+    }
+    if (frame->bpp == 8) {
+        bench_dither_packed(frame->kind, frame->pixels);
+        return;
+    }
+
+    for (int y = 0; y < BENCH_HEIGHT; y++) {
+        for (int x = 0; x < BENCH_WIDTH; x++) {
+            int rgb[3];
+            if (frame->kind == BENCH_PHOTO) {
+                bench_photo_rgb(x, y, BENCH_WIDTH, BENCH_HEIGHT, rgb);
+            } else {
+                bench_flat_rgb(x, y, BENCH_WIDTH, BENCH_HEIGHT, rgb);
+            }
+            for (int k = 0; k < 3; k++) {
+                rgb[k] = rgb[k] < 0 ? 0 : rgb[k] > 255 ? 255 : rgb[k];
+            }
+
+            uint8_t* p = &frame->pixels[(y * BENCH_WIDTH + x) * bytes];
+            if (frame->bpp == 16) {
+                uint16_t px = (rgb[0] >> 3) << 11 | (rgb[1] >> 2) << 5 |
+                              rgb[2] >> 3;
+                p[0] = px;
+                p[1] = px >> 8;
+            } else {
+                p[0] = rgb[0];
+                p[1] = rgb[1];
+                p[2] = rgb[2];
+                if (frame->bpp == 32) p[3] = 0xFF;
+            }
+        }
+    }
+}
+
+/*------------------------------ encoders ----------------------------------*/
+// Each encoder mirrors the decoder state of its depth (current pixel and hash
+// index), so every operation decodes to exactly the source pixels.
+
+static void bench_put(struct bench_encoder_t* enc, uint8_t value) {
+    enc->out[enc->size++] = value;
+}
+
+static void bench_count(struct bench_encoder_t* enc, enum bench_op_t op,
+                        int pixels) {
+    enc->ops[op]++;
+    enc->op_pixels[op] += pixels;
+}
+
+/**
+ * @brief Emit runs of the current pixel, with op codes base + length - 1 for
+ * up to max pixels and the 256 and 1024 pixel op codes.
+ */
+static void bench_put_run(struct bench_encoder_t* enc, int run, uint8_t base,
+                          int max, uint8_t op256, uint8_t op1024) {
+    while (run > 0) {
+        int n;
+        if (run >= 1024) {
+            bench_put(enc, op1024);
+            n = 1024;
+        } else if (run >= 256) {
+            bench_put(enc, op256);
+            n = 256;
+        } else {
+            n = run > max ? max : run;
+            bench_put(enc, base + n - 1);
+        }
+        bench_count(enc, BENCH_OP_RUN, n);
+        run -= n;
+    }
+}
+
+static int bench_run_length(const uint8_t* p, int i, int n, int bytes,
+                            const uint8_t* current) {
+    int run = 0;
+    while (i + run < n && memcmp(&p[(i + run) * bytes], current, bytes) == 0) {
+        run++;
+    }
+    return run;
+}
+
+static void bench_encode8(const uint8_t* p, int n,
+                          struct bench_encoder_t* enc) {
+    uint8_t px = 0, index[8] = {0};
+    int literals = 0, literal_pos = 0;
+
+    for (int i = 0; i < n;) {
+        int run = bench_run_length(p, i, n, 1, &px);
+        int d0 = i + 1 < n ? p[i] - px : 99;
+        int d1 = i + 1 < n ? p[i + 1] - p[i] : 99;
+        bool indexed = i + 1 < n && index[SLIC_GRAY_HASH(p[i])] == p[i] &&
+                       index[SLIC_GRAY_HASH(p[i + 1])] == p[i + 1];
+        bool diff = d0 >= -4 && d0 <= 3 && d1 >= -4 && d1 <= 3;
+
+        if (literals > 0 && (run > 0 || indexed || diff || literals == 64)) {
+            enc->out[literal_pos] = SLIC_OP_BADRUN8 | (literals - 1);
+            literals = 0;
+        }
+        if (run > 0) {
+            bench_put_run(enc, run, SLIC_OP_RUN8, 62, SLIC_OP_RUN8_256,
+                          SLIC_OP_RUN8_1024);
+            i += run;
+        } else if (indexed) {
+            bench_put(enc, SLIC_OP_INDEX8 | SLIC_GRAY_HASH(p[i]) |
+                               SLIC_GRAY_HASH(p[i + 1]) << 3);
+            bench_count(enc, BENCH_OP_INDEX, 2);
+            px = p[i + 1];
+            i += 2;
+        } else if (diff) {
+            bench_put(enc, SLIC_OP_DIFF8 | (d0 + 4) | (d1 + 4) << 3);
+            bench_count(enc, BENCH_OP_DIFF, 2);
+            index[SLIC_GRAY_HASH(p[i])] = p[i];
+            index[SLIC_GRAY_HASH(p[i + 1])] = p[i + 1];
+            px = p[i + 1];
+            i += 2;
+        } else {
+            if (literals == 0) {
+                literal_pos = enc->size;
+                bench_put(enc, 0);  // op written once the run length is known
+                bench_count(enc, BENCH_OP_LITERAL, 0);
+            }
+            bench_put(enc, p[i]);
+            enc->op_pixels[BENCH_OP_LITERAL]++;
+            literals++;
+            px = p[i];
+            index[SLIC_GRAY_HASH(px)] = px;
+            i++;
+        }
+    }
+    if (literals > 0) enc->out[literal_pos] = SLIC_OP_BADRUN8 | (literals - 1);
+}
+
+static void bench_encode16(const uint8_t* p, int n,
+                           struct bench_encoder_t* enc) {
+    uint16_t px = 0, index[8] = {0};
+    int literals = 0, literal_pos = 0;
+
+    for (int i = 0; i < n;) {
+        uint8_t current[2] = {px, px >> 8};
+        int run = bench_run_length(p, i, n, 2, current);
+        uint16_t p0 = p[i * 2] | p[i * 2 + 1] << 8;
+        uint16_t p1 = i + 1 < n ? p[i * 2 + 2] | p[i * 2 + 3] << 8 : 0;
+        bool indexed = i + 1 < n && index[SLIC_RGB565_HASH(p0)] == p0 &&
+                       index[SLIC_RGB565_HASH(p1)] == p1;
+        int dr = (p0 >> 11) - (px >> 11);
+        int dg = ((p0 >> 5) & 0x3F) - ((px >> 5) & 0x3F);
+        int db = (p0 & 0x1F) - (px & 0x1F);
+        bool diff = dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+                    db <= 1;
+
+        if (literals > 0 && (run > 0 || indexed || diff || literals == 64)) {
+            enc->out[literal_pos] = SLIC_OP_BADRUN16 | (literals - 1);
+            literals = 0;
+        }
+        if (run > 0) {
+            bench_put_run(enc, run, SLIC_OP_RUN16, 62, SLIC_OP_RUN16_256,
+                          SLIC_OP_RUN16_1024);
+            i += run;
+        } else if (indexed) {
+            bench_put(enc, SLIC_OP_INDEX16 | SLIC_RGB565_HASH(p0) |
+                               SLIC_RGB565_HASH(p1) << 3);
+            bench_count(enc, BENCH_OP_INDEX, 2);
+            px = p1;
+            i += 2;
+        } else if (diff) {
+            bench_put(enc, SLIC_OP_DIFF16 | (dr + 2) << 4 | (dg + 2) << 2 |
+                               (db + 2));
+            bench_count(enc, BENCH_OP_DIFF, 1);
+            px = p0;
+            index[SLIC_RGB565_HASH(px)] = px;
+            i++;
+        } else {
+            if (literals == 0) {
+                literal_pos = enc->size;
+                bench_put(enc, 0);
+                bench_count(enc, BENCH_OP_LITERAL, 0);
+            }
+            bench_put(enc, p0);
+            bench_put(enc, p0 >> 8);
+            enc->op_pixels[BENCH_OP_LITERAL]++;
+            literals++;
+            px = p0;
+            index[SLIC_RGB565_HASH(px)] = px;
+            i++;
+        }
+    }
+    if (literals > 0) enc->out[literal_pos] = SLIC_OP_BADRUN16 | (literals - 1);
+}
+
+static uint32_t bench_hash32(uint32_t px) {
+    return (px * 3 + (px >> 8) * 5 + (px >> 16) * 7 + (px >> 24) * 11) & 63;
+}
+
+/**
+ * @brief Encode 24 or 32 bpp pixels, with the QOI style ops of SLIC. 24 bpp
+ * pixels are handled as opaque 32 bpp ones.
+ */
+static void bench_encode32(const uint8_t* p, int n, int bytes,
+                           struct bench_encoder_t* enc) {
+    uint32_t px = 0xFF000000, index[64] = {0};
+
+    for (int i = 0; i < n;) {
+        const uint8_t* s = &p[i * bytes];
+        uint32_t next = s[0] | s[1] << 8 | s[2] << 16 |
+                        (uint32_t)(bytes == 4 ? s[3] : 0xFF) << 24;
+
+        int run = 0;
+        while (i + run < n) {
+            const uint8_t* r = &p[(i + run) * bytes];
+            uint32_t rp = r[0] | r[1] << 8 | r[2] << 16 |
+                          (uint32_t)(bytes == 4 ? r[3] : 0xFF) << 24;
+            if (rp != px) break;
+            run++;
+        }
+        if (run > 0) {
+            bench_put_run(enc, run, SLIC_OP_RUN, 60, SLIC_OP_RUN256,
+                          SLIC_OP_RUN1024);
+            i += run;
+            continue;
+        }
+
+        int dr = (int8_t)(s[0] - (uint8_t)px);
+        int dg = (int8_t)(s[1] - (uint8_t)(px >> 8));
+        int db = (int8_t)(s[2] - (uint8_t)(px >> 16));
+        int dr_dg = dr - dg, db_dg = db - dg;
+        uint32_t hash = bench_hash32(next);
+
+        if (index[hash] == next) {
+            bench_put(enc, SLIC_OP_INDEX | hash);
+            bench_count(enc, BENCH_OP_INDEX, 1);
+        } else if ((next >> 24) != (px >> 24)) {
+            bench_put(enc, SLIC_OP_RGBA);
+            for (int k = 0; k < 4; k++) bench_put(enc, next >> (k * 8));
+            bench_count(enc, BENCH_OP_LITERAL, 1);
+        } else if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+                   db <= 1) {
+            bench_put(enc, SLIC_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 |
+                               (db + 2));
+            bench_count(enc, BENCH_OP_DIFF, 1);
+        } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+                   db_dg >= -8 && db_dg <= 7) {
+            bench_put(enc, SLIC_OP_LUMA | (dg + 32));
+            bench_put(enc, (dr_dg + 8) << 4 | (db_dg + 8));
+            bench_count(enc, BENCH_OP_LUMA, 1);
+        } else {
+            bench_put(enc, SLIC_OP_RGB);
+            for (int k = 0; k < 3; k++) bench_put(enc, s[k]);
+            bench_count(enc, BENCH_OP_LITERAL, 1);
+        }
+        px = next;
+        index[hash] = px;
+        i++;
+    }
+}
+
+static void bench_encode(struct bench_frame_t* frame) {
+    int bytes = frame->bpp / 8;
+    struct bench_encoder_t enc = {
+        // worst case is a literal op per pixel, plus the header
+        .out = malloc(SLIC_HEADER_SIZE + (size_t)BENCH_PIXELS * (bytes + 1)),
+        .ops = frame->ops,
+        .op_pixels = frame->op_pixels,
+    };
+
+    slic_header hdr = {
+        .magic = SLIC_MAGIC,
+        .width = BENCH_WIDTH,
+        .height = BENCH_HEIGHT,
+        .bpp = frame->bpp,
+        .colorspace = frame->bpp == 8    ? SLIC_GRAYSCALE
+                      : frame->bpp == 16 ? SLIC_RGB565
+                                         : SLIC_SRGB,
+    };
+    memcpy(enc.out, &hdr, SLIC_HEADER_SIZE);
+    enc.size = SLIC_HEADER_SIZE;
+
+    if (frame->bpp == 8) {
+        bench_encode8(frame->pixels, BENCH_PIXELS, &enc);
+    } else if (frame->bpp == 16) {
+        bench_encode16(frame->pixels, BENCH_PIXELS, &enc);
+    } else {
+        bench_encode32(frame->pixels, BENCH_PIXELS, bytes, &enc);
+    }
+    frame->data = enc.out;
+    frame->size = enc.size;
+}
+
+/*------------------------------ decoding ----------------------------------*/
+
+static uint32_t bench_latency_ns;
+static uint32_t bench_refills;
+
+/**
+ * @brief Read callback serving the encoded frame from memory, after waiting
+ * for the configured latency like an SD card read would.
+ */
+static int bench_read_callback(SLICFILE* pFile, uint8_t* pBuf, int32_t iLen) {
+    if (bench_latency_ns > 0) {
+        double until = bench_now_s() + bench_latency_ns / 1e9;
+        while (bench_now_s() < until) {
+        }
+    }
+    bench_refills++;
+
+    if (iLen > pFile->iSize - pFile->iPos) iLen = pFile->iSize - pFile->iPos;
+    memcpy(pBuf, pFile->pData + pFile->iPos, iLen);
+    pFile->iPos += iLen;
+    return iLen;
+}
+
+/**
+ * @brief Decode a frame in output chunks of the given size.
+ *
+ * @return true if the output matches the source pixels
+ */
+static bool bench_decode(const struct bench_frame_t* frame, int chunk,
+                         uint8_t* out) {
+    SLICSTATE state;
+    int bytes = frame->bpp / 8;
+
+    if (slic_init_decode(NULL, &state, frame->data, frame->size, NULL, NULL,
+                         bench_read_callback) != SLIC_SUCCESS) {
+        return false;
+    }
+
+    int pos = 0, rc;
+    do {
+        rc = slic_decode(&state, out + pos, chunk / bytes);
+        pos += chunk / bytes * bytes;
+        if (pos > BENCH_PIXELS * bytes) pos = BENCH_PIXELS * bytes;
+    } while (rc == SLIC_SUCCESS);
+
+    return rc == SLIC_DONE &&
+           memcmp(out, frame->pixels, (size_t)BENCH_PIXELS * bytes) == 0;
+}
+
+/**
+ * @brief Check ops whose operands are split across two refills of the input
+ * buffer. For each 24 and 32 bpp op with operands, and each split point, a
+ * one row frame of zero DIFF ops is built with the op placed so its
+ * operands straddle the end of the first buffer. The output through the read
+ * callback must match a decode of the whole file from memory.
+ */
+static bool bench_check_boundaries(void) {
+    static const struct {
+        uint8_t op;
+        int operands;
+        const char* name;
+    } ops[] = {
+        {SLIC_OP_RGB, 3, "rgb"},
+        {SLIC_OP_RGBA, 4, "rgba"},
+        {SLIC_OP_LUMA | 40, 1, "luma"},
+    };
+    const uint8_t filler = SLIC_OP_DIFF | 2 << 4 | 2 << 2 | 2;  // no change
+    const int tail = 16;
+    bool all_ok = true;
+
+    for (int bpp = 24; bpp <= 32; bpp += 8) {
+        for (size_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+            for (int split = 1; split <= ops[o].operands; split++) {
+                // the op is split bytes before the end of the first buffer
+                int pos = FILE_BUF_SIZE - split;
+                int pixels = pos - SLIC_HEADER_SIZE + 1 + tail;
+                int size = pos + 1 + ops[o].operands + tail;
+                uint8_t* data = malloc(size);
+
+                slic_header hdr = {
+                    .magic = SLIC_MAGIC,
+                    .width = pixels,
+                    .height = 1,
+                    .bpp = bpp,
+                    .colorspace = SLIC_SRGB,
+                };
+                memcpy(data, &hdr, SLIC_HEADER_SIZE);
+                memset(data + SLIC_HEADER_SIZE, filler,
+                       size - SLIC_HEADER_SIZE);
+                data[pos] = ops[o].op;
+                for (int k = 0; k < ops[o].operands; k++) {
+                    data[pos + 1 + k] = 0x51 + k * 0x22;
+                }
+
+                size_t out_size = (size_t)pixels * 4 + 4;
+                uint8_t* expected = malloc(out_size);
+                uint8_t* out = malloc(out_size);
+                SLICSTATE state;
+
+                slic_init_decode(NULL, &state, data, size, NULL, NULL, NULL);
+                bool ok = slic_decode(&state, expected, pixels) == SLIC_DONE;
+
+                bench_latency_ns = 0;
+                slic_init_decode(NULL, &state, data, size, NULL, NULL,
+                                 bench_read_callback);
+                ok &= slic_decode(&state, out, pixels) == SLIC_DONE &&
+                      memcmp(out, expected, (size_t)pixels * bpp / 8) == 0;
+
+                if (!ok) {
+                    printf("%s at %d bpp, %d operand bytes before the "
+                           "buffer end: MISMATCH\n",
+                           ops[o].name, bpp, split - 1);
+                }
+                all_ok &= ok;
+                free(data);
+                free(expected);
+                free(out);
+            }
+        }
+    }
+    printf("operands across buffer refills: %s\n", all_ok ? "ok" : "MISMATCH");
+    return all_ok;
+}
+
+static int bench_parse_list(const char* arg, int* list) {
+    int count = 0;
+    while (count < BENCH_LIST_MAX && *arg != '\0') {
+        char* end;
+        list[count++] = strtol(arg, &end, 0);
+        arg = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') break;
+    }
+    return count;
+}
+
+static void bench_print_ops(const struct bench_frame_t* frames, int count) {
+    printf("%-6s %3s %7s %9s", "frame", "bpp", "ratio", "ops");
+    for (int op = 0; op < BENCH_OP_COUNT; op++) {
+        printf(" %13s", bench_op_names[op]);
+    }
+    printf("\n%-28s", "");
+    for (int op = 0; op < BENCH_OP_COUNT; op++) printf(" %13s", "% ops px/op");
+    printf("\n");
+
+    for (int f = 0; f < count; f++) {
+        const struct bench_frame_t* frame = &frames[f];
+        uint32_t ops = 0;
+        for (int op = 0; op < BENCH_OP_COUNT; op++) ops += frame->ops[op];
+
+        printf("%-6s %3d %6.1f%% %9u", bench_kind_names[frame->kind],
+               frame->bpp,
+               100.0 * frame->size / (BENCH_PIXELS * (frame->bpp / 8)), ops);
+        for (int op = 0; op < BENCH_OP_COUNT; op++) {
+            double share = ops ? 100.0 * frame->ops[op] / ops : 0;
+            double per_op = frame->ops[op]
+                                ? (double)frame->op_pixels[op] / frame->ops[op]
+                                : 0;
+            printf(" %5.1f %7.1f", share, per_op);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    int chunks[BENCH_LIST_MAX] = {500, 5000, 20000};
+    int chunk_count = 3;
+    int latencies[BENCH_LIST_MAX] = {0, 100};
+    int latency_count = 2;
+    int min_ms = 100;
+
+    static const struct option options[] = {
+        {"chunks", required_argument, NULL, 'c'},
+        {"latency-us", required_argument, NULL, 'l'},
+        {"min-ms", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                chunk_count = bench_parse_list(optarg, chunks);
+                break;
+            case 'l':
+                latency_count = bench_parse_list(optarg, latencies);
+                break;
+            case 'm':
+                min_ms = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [--chunks N,N...] [--latency-us N,N...] "
+                        "[--min-ms N]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    int frame_count = BENCH_KIND_COUNT * sizeof(bench_depths) / sizeof(int);
+    struct bench_frame_t frames[BENCH_KIND_COUNT * 4] = {0};
+    for (int f = 0; f < frame_count; f++) {
+        frames[f].kind = f / 4;
+        frames[f].bpp = bench_depths[f % 4];
+        bench_generate(&frames[f]);
+        bench_encode(&frames[f]);
+    }
+
+    printf("FILE_BUF_SIZE %d, %dx%d pixel frames\n\n", FILE_BUF_SIZE,
+           BENCH_WIDTH, BENCH_HEIGHT);
+    bool all_ok = bench_check_boundaries();
+    printf("\n");
+    bench_print_ops(frames, frame_count);
+
+    // 24 bpp output is written 4 bytes per pixel, so leave room for one more
+    uint8_t* out = malloc((size_t)BENCH_PIXELS * 4 + 4);
+
+    printf("\n%-6s %3s %6s %8s %8s %8s %s\n", "frame", "bpp", "chunk",
+           "lat us", "MB/s", "refills", "check");
+    for (int f = 0; f < frame_count; f++) {
+        const struct bench_frame_t* frame = &frames[f];
+        for (int c = 0; c < chunk_count; c++) {
+            for (int l = 0; l < latency_count; l++) {
+                bench_latency_ns = latencies[l] * 1000;
+
+                int runs = 0;
+                bool ok = true;
+                double start = bench_now_s(), elapsed;
+                bench_refills = 0;
+                do {
+                    ok &= bench_decode(frame, chunks[c], out);
+                    runs++;
+                    elapsed = bench_now_s() - start;
+                } while (elapsed * 1000 < min_ms);
+
+                double mb =
+                    (double)BENCH_PIXELS * (frame->bpp / 8) * runs / 1e6;
+                printf("%-6s %3d %6d %8d %8.1f %8u %s\n",
+                       bench_kind_names[frame->kind], frame->bpp, chunks[c],
+                       latencies[l], mb / elapsed, bench_refills / runs,
+                       ok ? "ok" : "MISMATCH");
+                all_ok &= ok;
+            }
+        }
+    }
+    free(out);
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,204 @@
+/**
+ * SLIC decode benchmark target, cross-compiled for the Cortex-M4 and run under
+ * qemu-arm with the m4_cycles plugin (see m4_bench.py). Each frame is loaded
+ * into memory first and decoded through a read callback, like the firmware
+ * reading from the SD card, with the selected kernel and output chunk size.
+ * Only the decode calls run between bench_begin() and bench_end(), which the
+ * plugin uses to count instructions and cycles.
+ *
+ * Frames are .slc files as written by convert.py: a container header followed
+ * by the payload, or a bare SLIC stream from older versions. Frames stored
+ * with the raw codec aren't decoded, so they are skipped.
+ *
+ * usage: slic_bench_m4 KERNEL CHUNK FRAME.slc...
+ * Prints the number of frames decoded and skipped, and the output bytes.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slic.h"
+
+#define BENCH_CHUNK_MAX 65536
+
+// Container header of struct img_header_t in img.h, which can't be included
+// here as it pulls in the HAL through FatFs
+#define BENCH_IMG_MAGIC 0x474D4941  // "AIMG"
+#define BENCH_IMG_CODEC_SLIC 1
+
+struct __attribute__((packed)) bench_img_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint8_t codec;
+    uint8_t bpp;
+    uint16_t width;
+    uint16_t height;
+    uint16_t flags;
+    uint32_t payload_size;
+    uint32_t payload_crc32;
+};
+_Static_assert(sizeof(struct bench_img_header_t) == 24,
+               "bench_img_header_t doesn't match struct img_header_t");
+
+typedef int(bench_kernel_t)(SLICSTATE* pState, uint8_t* pOut, int iOutSize);
+
+struct bench_kernel_entry_t {
+    const char* name;
+    bench_kernel_t* decode;
+};
+
+// Decode kernels to compare, add alternative implementations here
+static const struct bench_kernel_entry_t bench_kernels[] = {
+    {"slic_decode", slic_decode},
+};
+
+static uint8_t bench_out[BENCH_CHUNK_MAX];
+
+// Region markers, found by name by the plugin, so they must not be inlined
+void __attribute__((noinline)) bench_begin(void) { __asm__ volatile(""); }
+void __attribute__((noinline)) bench_end(void) { __asm__ volatile(""); }
+
+static int bench_read_callback(SLICFILE* pFile, uint8_t* pBuf, int32_t iLen) {
+    if (iLen > pFile->iSize - pFile->iPos) iLen = pFile->iSize - pFile->iPos;
+    memcpy(pBuf, pFile->pData + pFile->iPos, iLen);
+    pFile->iPos += iLen;
+    return iLen;
+}
+
+static uint8_t* bench_load(const char* path, int32_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* data = malloc(*size);
+    if (data == NULL || fread(data, 1, *size, f) != (size_t)*size) {
+        fprintf(stderr, "%s: read failed\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+/**
+ * @brief Find the SLIC payload of a frame, after its container header if it
+ * has one.
+ *
+ * @return 1 with the payload and its size set, 0 if the frame isn't SLIC
+ * coded, or -1 if its header is bad
+ */
+static int bench_payload(uint8_t* data, int32_t size, uint8_t** payload,
+                         int32_t* payload_size) {
+    struct bench_img_header_t header;
+    *payload = data;
+    *payload_size = size;
+    if (size < (int32_t)sizeof(header)) return 1;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != BENCH_IMG_MAGIC) return 1;  // bare SLIC stream
+
+    if (header.header_size < sizeof(header) || header.header_size > size ||
+        header.payload_size > (uint32_t)(size - header.header_size)) {
+        return -1;
+    }
+    if (header.codec != BENCH_IMG_CODEC_SLIC) return 0;
+    *payload = data + header.header_size;
+    *payload_size = header.payload_size;
+    return 1;
+}
+
+/**
+ * @brief Decode a frame in chunks of the given size.
+ *
+ * @return output bytes decoded, or -1 on a decode error
+ */
+static int64_t bench_decode(bench_kernel_t* decode, int chunk, uint8_t* data,
+                            int32_t size) {
+    SLICSTATE state;
+    if (slic_init_decode(NULL, &state, data, size, NULL, NULL,
+                         bench_read_callback) != SLIC_SUCCESS) {
+        return -1;
+    }
+    int pixel_bytes = state.bpp / 8;
+    int pixels = chunk / pixel_bytes;
+    int64_t total = (int64_t)state.iPixelCount * pixel_bytes;
+
+    int rc;
+    bench_begin();
+    do {
+        rc = decode(&state, bench_out, pixels);
+    } while (rc == SLIC_SUCCESS);
+    bench_end();
+
+    return rc == SLIC_DONE ? total : -1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s KERNEL CHUNK FRAME.slc...\n", argv[0]);
+        return 1;
+    }
+
+    const struct bench_kernel_entry_t* kernel = NULL;
+    for (size_t i = 0; i < sizeof(bench_kernels) / sizeof(bench_kernels[0]);
+         i++) {
+        if (strcmp(bench_kernels[i].name, argv[1]) == 0) {
+            kernel = &bench_kernels[i];
+        }
+    }
+    if (kernel == NULL) {
+        fprintf(stderr, "unknown kernel %s, one of:", argv[1]);
+        for (size_t i = 0;
+             i < sizeof(bench_kernels) / sizeof(bench_kernels[0]); i++) {
+            fprintf(stderr, " %s", bench_kernels[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    int chunk = atoi(argv[2]);
+    if (chunk < 4 || chunk > BENCH_CHUNK_MAX) {
+        fprintf(stderr, "chunk size must be 4 to %d bytes\n", BENCH_CHUNK_MAX);
+        return 1;
+    }
+
+    int frames = 0, skipped = 0;
+    int64_t bytes = 0;
+    for (int i = 3; i < argc; i++) {
+        int32_t size;
+        uint8_t* data = bench_load(argv[i], &size);
+        if (data == NULL) return 1;
+
+        uint8_t* payload;
+        int32_t payload_size;
+        int found = bench_payload(data, size, &payload, &payload_size);
+        if (found <= 0) {
+            free(data);
+            if (found < 0) {
+                fprintf(stderr, "%s: bad container header\n", argv[i]);
+                return 1;
+            }
+            skipped++;
+            continue;
+        }
+        int64_t decoded =
+            bench_decode(kernel->decode, chunk, payload, payload_size);
+        free(data);
+        if (decoded < 0) {
+            fprintf(stderr, "%s: decode failed\n", argv[i]);
+            return 1;
+        }
+        frames++;
+        bytes += decoded;
+    }
+
+    printf("frames %d skipped %d bytes %lld file_buf %d\n", frames, skipped,
+           (long long)bytes, FILE_BUF_SIZE);
+    return 0;
+}
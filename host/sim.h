@@ -0,0 +1,173 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SIM_NS_PER_MS 1000000ULL
+#define SIM_NS_PER_S 1000000000ULL
+
+#define SIM_FRAM_SIZE 512
+#define SIM_SRAM2_SIZE 0x2000
+#define SIM_PRESS_MAX 32
+#define SIM_RANGE2_MAX_HZ 26000000  // highest core clock in voltage range 2
+
+/**
+ * Parameters of the current and timing model, as X(name, default, comment).
+ * Every parameter can be overridden in the model file given with --model, one
+ * "name = value" per line. The defaults are typical datasheet values and
+ * should be calibrated against measurements of a real board.
+ */
+#define SIM_MODEL_PARAMS(X)                                                  \
+    X(boot_us, 2000, "reset to main(), running from MSI at 4 MHz")           \
+    X(vos_settle_us, 20, "regulator settling time into voltage range 1")     \
+    X(pll_lock_us, 40, "time for the PLL to lock")                           \
+    X(mcu_range1_ua_per_mhz, 84, "run current in voltage range 1")           \
+    X(mcu_range2_ua_per_mhz, 71, "run current in voltage range 2")           \
+    X(mcu_standby_ua, 0.45, "MCU standby current with the RTC running")      \
+    X(mcu_sram2_ua, 0.2,  "extra standby current while SRAM2 is retained")  \
+    X(board_standby_ua, 0.5, "leakage of the rest of the board in standby")  \
+    X(hal_call_cycles, 120, "CPU cycles of overhead per HAL SPI call")       \
+    X(spi_byte_cycles, 16, "minimum CPU cycles per byte in HAL SPI loops")   \
+    X(gpio_write_cycles, 30, "CPU cycles per HAL_GPIO_WritePin call")        \
+    X(aux_ua, 50, "AUX regulator quiescent current while AUX is on")         \
+    X(vdiv_ua, 20, "battery voltage divider current while enabled")          \
+    X(vdiv_ratio, 1.861, "battery voltage over the divider output")          \
+    X(vdda_v, 3.3, "3.3 V regulator output, supplying the ADC")              \
+    X(vrefint_v, 1.212, "internal reference, stored as VREFINT_CAL")         \
+    X(led_ua, 2000, "debug LED current while lit")                           \
+    X(sd_idle_ua, 1000, "SD card current while powered and idle")            \
+    X(sd_active_ua, 25000, "SD card current while transferring or busy")     \
+    X(sd_init_ms, 20, "time ACMD41 reports the card as still initialising")  \
+    X(sd_read_latency_us, 150, "command to data token delay of a read")      \
+    X(sd_read_gap_us, 20, "delay between blocks of a multiple block read")   \
+    X(sd_write_busy_us, 600, "card busy time after each written block")      \
+    X(fram_standby_ua, 6, "FRAM current while powered and deselected")       \
+    X(fram_active_ua, 200, "FRAM current while selected")                    \
+    X(disp_idle_ua, 150, "panel current while powered and not busy")         \
+    X(disp_busy_ua, 9000, "panel current while BUSY is asserted")            \
+    X(disp_reset_ms, 10, "BUSY time after a panel reset")                    \
+    X(disp_power_on_ms, 120, "BUSY time of POWER_ON")                        \
+    X(disp_refresh_ms, 16000, "BUSY time of DISPLAY_REFRESH")                \
+    X(disp_power_off_ms, 40, "BUSY time of POWER_OFF")                       \
+    X(batt_mah, 2000, "battery capacity")                                    \
+    X(batt_v_full, 4.1, "battery voltage when full")                         \
+    X(batt_v_empty, 3.3, "battery voltage when empty")                       \
+    X(batt_charge_pct, 100, "battery charge when the simulation starts")     \
+    X(batt_r_ohm, 1.0, "resistance of the cell, PPTC and wiring")            \
+    X(harvest_ua, 0, "average charge current from the energy harvester")     \
+    X(harvest_day_ua, 0, "extra harvester current in daylight")              \
+    X(harvest_day_start_h, 8, "hour of the simulated day daylight starts")   \
+    X(harvest_day_hours, 10, "hours of daylight")
+
+struct sim_model_t {
+#define SIM_MODEL_FIELD(name, value, comment) double name;
+    SIM_MODEL_PARAMS(SIM_MODEL_FIELD)
+#undef SIM_MODEL_FIELD
+};
+
+// Consumers the charge of a wake is broken down into
+enum sim_rail_t {
+    SIM_RAIL_MCU,
+    SIM_RAIL_SD,
+    SIM_RAIL_DISP,
+    SIM_RAIL_FRAM,
+    SIM_RAIL_BOARD,  // AUX regulator, battery divider and LED
+    SIM_RAIL_COUNT,
+};
+
+enum sim_wake_t {
+    SIM_WAKE_RESET,
+    SIM_WAKE_ALARM,
+    SIM_WAKE_TIMER,
+    SIM_WAKE_BUTTON,
+};
+
+// Button press, at a time from the start of the simulation
+struct sim_press_t {
+    uint64_t at_ns;
+    uint64_t hold_ns;
+};
+
+/**
+ * State shared between the simulator and the forked process running each wake
+ * cycle. Everything else in the wake process is discarded when it enters
+ * standby, like the RAM of the real device.
+ */
+struct sim_state_t {
+    // configuration
+    struct sim_model_t model;
+    uint16_t switches;  // toggle switch bits as returned by get_toggle_sw_bits
+    struct sim_press_t presses[SIM_PRESS_MAX];
+    int press_count;
+    char png_dir[256];
+
+    // time since the start of the simulation
+    uint64_t now_ns;
+
+    // backup domain, SRAM2 (when retained) and FRAM survive standby
+    bool rtc_initialised;
+    int64_t rtc_offset_s;  // calendar seconds since 2000-01-01 at now_ns = 0
+    bool alarm_armed;
+    uint64_t alarm_ns;
+    bool timer_armed;
+    uint64_t timer_ns;
+    bool wakeup_pin_enabled;
+    uint8_t fram[SIM_FRAM_SIZE];
+    bool sram2_retained;
+    uint8_t sram2[SIM_SRAM2_SIZE];  // the firmware's .retained section
+    uint32_t rng;
+
+    // battery charge drawn so far
+    double used_uah;
+
+    // results of the last wake, filled in by the wake process
+    uint32_t wake;
+    enum sim_wake_t wake_cause;
+    bool standby;  // the wake ended by entering standby
+    uint64_t wake_start_ns;
+    double wake_uah[SIM_RAIL_COUNT];
+    uint32_t spi_bytes;
+    uint32_t refreshes;
+};
+
+extern struct sim_state_t* sim;
+
+// sim_energy.c
+bool sim_model_load(struct sim_model_t* model, const char* path);
+void sim_model_defaults(struct sim_model_t* model);
+void sim_advance(uint64_t ns);
+void sim_advance_cycles(uint64_t cycles);
+uint32_t sim_cpu_hz();
+void sim_set_cpu_clock(uint32_t hz, int voltage_range);
+double sim_batt_voltage();
+double sim_batt_terminal_voltage();
+
+// sim_hal.c
+void sim_hal_reset(enum sim_wake_t cause);
+uint64_t sim_wake_ns();
+bool sim_aux_on();
+bool sim_vdiv_on();
+bool sim_led_on();
+void sim_spi_active(int rail);
+
+// sim_sd.c
+bool sim_sd_open(const char* path);
+void sim_sd_power(bool on);
+void sim_sd_select(bool selected);
+uint8_t sim_sd_exchange(uint8_t in);
+bool sim_sd_busy();
+uint64_t sim_sd_next_event();
+
+// sim_fram.c
+void sim_fram_select(bool selected);
+uint8_t sim_fram_exchange(uint8_t in);
+
+// sim_panel.c
+void sim_panel_power(bool on);
+void sim_panel_reset(bool level);
+void sim_panel_exchange(uint8_t in, bool data);
+bool sim_panel_busy();
+uint64_t sim_panel_next_event();
+
+#endif  // SIM_H
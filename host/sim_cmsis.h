@@ -0,0 +1,59 @@
+/**
+ * Host replacement for cmsis_gcc.h, force included before every firmware
+ * source. It defines the include guard of the real header, whose inline
+ * assembly only assembles for Arm, and provides the compiler macros and
+ * intrinsics the CMSIS and HAL headers use as host equivalents.
+ */
+#ifndef SIM_CMSIS_H
+#define SIM_CMSIS_H
+
+#define __CMSIS_GCC_H
+
+#include <stdint.h>
+
+#define __ASM __asm
+#define __INLINE inline
+#define __STATIC_INLINE static inline
+#define __STATIC_FORCEINLINE __attribute__((always_inline)) static inline
+#define __NO_RETURN __attribute__((__noreturn__))
+#define __USED __attribute__((used))
+#define __WEAK __attribute__((weak))
+#define __PACKED __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x) __attribute__((aligned(x)))
+#define __RESTRICT __restrict
+#define __COMPILER_BARRIER() __ASM volatile("" ::: "memory")
+
+#define __NOP() __COMPILER_BARRIER()
+#define __WFI() __COMPILER_BARRIER()
+#define __WFE() __COMPILER_BARRIER()
+#define __SEV() __COMPILER_BARRIER()
+
+__STATIC_FORCEINLINE void __ISB(void) { __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __DSB(void) { __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __DMB(void) { __COMPILER_BARRIER(); }
+
+// interrupts are never raised on the host, masking them has no effect
+__STATIC_FORCEINLINE void __enable_irq(void) {}
+__STATIC_FORCEINLINE void __disable_irq(void) {}
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void) { return 0; }
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t priMask) { (void)priMask; }
+
+__STATIC_FORCEINLINE uint32_t __REV(uint32_t value) {
+    return __builtin_bswap32(value);
+}
+
+__STATIC_FORCEINLINE uint32_t __RBIT(uint32_t value) {
+    uint32_t result = 0;
+    for (int i = 0; i < 32; i++) {
+        result = (result << 1) | ((value >> i) & 1);
+    }
+    return result;
+}
+
+__STATIC_FORCEINLINE uint8_t __CLZ(uint32_t value) {
+    return value == 0 ? 32 : (uint8_t)__builtin_clz(value);
+}
+
+#endif  // SIM_CMSIS_H
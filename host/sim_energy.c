@@ -0,0 +1,176 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "stm32l4xx_hal.h"
+
+#define SIM_UA_NS_PER_UAH 3.6e12
+
+static uint32_t cpu_hz = 4000000;  // MSI after reset
+static int cpu_voltage_range = 1;
+static double cycle_remainder;
+static int spi_rail = -1;  // rail of the device currently clocking SPI data
+
+/**
+ * @brief Set every model parameter to its default value.
+ */
+void sim_model_defaults(struct sim_model_t* model) {
+#define SIM_MODEL_DEFAULT(name, value, comment) model->name = value;
+    SIM_MODEL_PARAMS(SIM_MODEL_DEFAULT)
+#undef SIM_MODEL_DEFAULT
+}
+
+/**
+ * @brief Override model parameters from a file of "name = value" lines. Text
+ * after a # is ignored.
+ */
+bool sim_model_load(struct sim_model_t* model, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char name[64];
+        double value;
+        char rest;
+        int fields =
+            sscanf(line, " %63[a-z0-9_] = %lf %c", name, &value, &rest);
+        if (fields <= 0) continue;  // blank line
+        if (fields != 2) {
+            fprintf(stderr, "%s:%d: expected name = value\n", path,
+                    line_number);
+            ok = false;
+            continue;
+        }
+
+        bool found = false;
+#define SIM_MODEL_SET(param, default_value, comment) \
+    if (strcmp(name, #param) == 0) {                 \
+        model->param = value;                        \
+        found = true;                                \
+    }
+        SIM_MODEL_PARAMS(SIM_MODEL_SET)
+#undef SIM_MODEL_SET
+        if (!found) {
+            fprintf(stderr, "%s:%d: unknown parameter %s\n", path, line_number,
+                    name);
+            ok = false;
+        }
+    }
+
+    fclose(f);
+    return ok;
+}
+
+uint32_t sim_cpu_hz() { return cpu_hz; }
+
+/**
+ * @brief Set the core clock and regulator voltage range the run current is
+ * taken from.
+ */
+void sim_set_cpu_clock(uint32_t hz, int voltage_range) {
+    cpu_hz = hz;
+    cpu_voltage_range = voltage_range;
+}
+
+/**
+ * @brief Mark the device on the given rail as clocking SPI data, which draws
+ * its active current, until called again with -1.
+ */
+void sim_spi_active(int rail) { spi_rail = rail; }
+
+/**
+ * @brief Battery voltage, falling linearly with the charge drawn.
+ */
+double sim_batt_voltage() {
+    const struct sim_model_t* m = &sim->model;
+    double v = m->batt_v_full -
+               (m->batt_v_full - m->batt_v_empty) * sim->used_uah /
+                   (m->batt_mah * 1000);
+    return v < 0 ? 0 : v;
+}
+
+/**
+ * @brief Current drawn from each rail in the present state, in uA.
+ */
+static void sim_currents(double ua[SIM_RAIL_COUNT]) {
+    const struct sim_model_t* m = &sim->model;
+
+    memset(ua, 0, sizeof(double) * SIM_RAIL_COUNT);
+    ua[SIM_RAIL_MCU] = cpu_hz / 1e6 * (cpu_voltage_range == 1
+                                           ? m->mcu_range1_ua_per_mhz
+                                           : m->mcu_range2_ua_per_mhz);
+
+    if (sim_aux_on()) {
+        ua[SIM_RAIL_SD] = spi_rail == SIM_RAIL_SD || sim_sd_busy()
+                              ? m->sd_active_ua
+                              : m->sd_idle_ua;
+        ua[SIM_RAIL_DISP] =
+            sim_panel_busy() ? m->disp_busy_ua : m->disp_idle_ua;
+        ua[SIM_RAIL_FRAM] =
+            spi_rail == SIM_RAIL_FRAM ? m->fram_active_ua : m->fram_standby_ua;
+        ua[SIM_RAIL_BOARD] = m->aux_ua;
+    }
+    if (sim_vdiv_on()) ua[SIM_RAIL_BOARD] += m->vdiv_ua;
+    if (sim_led_on()) ua[SIM_RAIL_BOARD] += m->led_ua;
+}
+
+/**
+ * @brief Battery voltage at the terminals, below sim_batt_voltage by the drop
+ * the present load causes across batt_r_ohm.
+ */
+double sim_batt_terminal_voltage() {
+    double ua[SIM_RAIL_COUNT];
+    double total_ua = 0;
+
+    sim_currents(ua);
+    for (int rail = 0; rail < SIM_RAIL_COUNT; rail++) total_ua += ua[rail];
+    return sim_batt_voltage() - total_ua / 1e6 * sim->model.batt_r_ohm;
+}
+
+/**
+ * @brief Let time pass with the MCU running, charging every rail for the
+ * current it draws. Intervals are split where a device changes state, e.g.
+ * the panel releasing BUSY.
+ */
+void sim_advance(uint64_t ns) {
+    uint64_t end = sim->now_ns + ns;
+
+    while (sim->now_ns < end) {
+        uint64_t next = end;
+        uint64_t event = sim_sd_next_event();
+        if (event > sim->now_ns && event < next) next = event;
+        event = sim_panel_next_event();
+        if (event > sim->now_ns && event < next) next = event;
+
+        double ua[SIM_RAIL_COUNT];
+        sim_currents(ua);
+        for (int rail = 0; rail < SIM_RAIL_COUNT; rail++) {
+            sim->wake_uah[rail] +=
+                ua[rail] * (next - sim->now_ns) / SIM_UA_NS_PER_UAH;
+        }
+        sim->now_ns = next;
+    }
+
+    // keep the cycle counter used by profile.c running
+    double cycles = cycle_remainder + (double)ns * cpu_hz / 1e9;
+    DWT->CYCCNT += (uint32_t)fmod(floor(cycles), 4294967296.0);
+    cycle_remainder = cycles - floor(cycles);
+}
+
+/**
+ * @brief Let the time of a number of CPU cycles pass.
+ */
+void sim_advance_cycles(uint64_t cycles) {
+    sim_advance(cycles * SIM_NS_PER_S / cpu_hz);
+}
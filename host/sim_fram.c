@@ -0,0 +1,73 @@
+/**
+ * 4kbit SPI FRAM (FM25L04B style), held in the shared simulator state so its
+ * contents survive standby. Address bit 8 is carried in bit 3 of the READ and
+ * WRITE opcodes.
+ */
+#include "sim.h"
+
+#define FRAM_WREN 0x06
+#define FRAM_WRDI 0x04
+#define FRAM_RDSR 0x05
+#define FRAM_WRSR 0x01
+#define FRAM_READ 0x03
+#define FRAM_WRITE 0x02
+#define FRAM_OPCODE_MASK 0xF7
+#define FRAM_STATUS_WEL 0x02
+
+enum fram_phase_t {
+    FRAM_OPCODE,
+    FRAM_ADDRESS,
+    FRAM_DATA,
+    FRAM_IGNORE,
+};
+
+static enum fram_phase_t fram_phase;
+static uint8_t fram_opcode;
+static uint16_t fram_address;
+static bool fram_wel;  // write enable latch, cleared at the end of a write
+
+void sim_fram_select(bool selected) {
+    if (!selected && fram_phase == FRAM_DATA && fram_opcode == FRAM_WRITE) {
+        fram_wel = false;
+    }
+    fram_phase = FRAM_OPCODE;
+}
+
+uint8_t sim_fram_exchange(uint8_t in) {
+    uint8_t out = 0xFF;
+
+    switch (fram_phase) {
+        case FRAM_OPCODE:
+            fram_opcode = in & FRAM_OPCODE_MASK;
+            fram_address = (in & 0x08) << 5;
+            fram_phase = FRAM_IGNORE;
+            if (in == FRAM_WREN) fram_wel = true;
+            if (in == FRAM_WRDI) fram_wel = false;
+            if (in == FRAM_RDSR || in == FRAM_WRSR) {
+                fram_opcode = in;
+                fram_phase = FRAM_DATA;
+            }
+            if (fram_opcode == FRAM_READ || fram_opcode == FRAM_WRITE) {
+                fram_phase = FRAM_ADDRESS;
+            }
+            break;
+        case FRAM_ADDRESS:
+            fram_address |= in;
+            fram_phase = FRAM_DATA;
+            break;
+        case FRAM_DATA:
+            if (fram_opcode == FRAM_RDSR) {
+                out = fram_wel ? FRAM_STATUS_WEL : 0;
+            } else if (fram_opcode == FRAM_READ) {
+                out = sim->fram[fram_address];
+                fram_address = (fram_address + 1) % SIM_FRAM_SIZE;
+            } else if (fram_opcode == FRAM_WRITE) {
+                if (fram_wel) sim->fram[fram_address] = in;
+                fram_address = (fram_address + 1) % SIM_FRAM_SIZE;
+            }
+            break;
+        case FRAM_IGNORE:
+            break;
+    }
+    return out;
+}
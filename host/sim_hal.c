@@ -0,0 +1,680 @@
+/**
+ * Simulated HAL. The firmware is compiled against the real HAL headers, and
+ * the peripheral register blocks they address are backed by anonymous memory
+ * mapped at the device addresses, so register macros like __HAL_PWR_GET_FLAG
+ * or DWT->CYCCNT work unchanged. The HAL functions the firmware calls are
+ * implemented here on top of the simulated devices.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "crc.h"
+#include "main.h"
+#include "sim.h"
+
+#define SIM_DAYS_PER_ALARM_SEARCH 62
+
+uint32_t SystemCoreClock = 4000000;
+const uint8_t AHBPrescTable[16] = {0, 0, 0, 0, 0, 0, 0, 0,
+                                   1, 2, 3, 4, 6, 7, 8, 9};
+
+static const struct {
+    uintptr_t base;
+    size_t size;
+} sim_regions[] = {
+    {0x1FFF0000, 0x10000},     // system memory, factory calibration values
+    {PERIPH_BASE, 0x10061000}, // APB, AHB1 and AHB2 peripherals up to RNG
+    {0xE0000000, 0x100000},    // Cortex-M4 private peripherals
+};
+
+// bounds of the firmware's SRAM2 variables, see sim_retained.ld
+extern uint8_t _sretained[], _eretained[];
+
+static RCC_OscInitTypeDef sim_osc;
+static uint32_t sim_voltage_scaling = PWR_REGULATOR_VOLTAGE_SCALE1;
+static ADC_InitTypeDef sim_adc_init;
+static uint32_t sim_adc_channel;
+static uint32_t sim_adc_sampling_time;
+
+/**
+ * @brief Map zeroed memory at the peripheral addresses, which is the reset
+ * state of the registers as far as the firmware can tell.
+ */
+static void sim_map_registers() {
+    for (size_t i = 0; i < sizeof(sim_regions) / sizeof(sim_regions[0]); i++) {
+        void* p = mmap((void*)sim_regions[i].base, sim_regions[i].size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                           MAP_FIXED_NOREPLACE,
+                       -1, 0);
+        if (p != (void*)sim_regions[i].base) {
+            fprintf(stderr, "could not map registers at 0x%08lx\n",
+                    (unsigned long)sim_regions[i].base);
+            exit(2);
+        }
+    }
+}
+
+/**
+ * @brief Bring the simulated MCU out of reset or standby, with the wake up
+ * flags of the cause set.
+ */
+void sim_hal_reset(enum sim_wake_t cause) {
+    sim_map_registers();
+
+    SystemCoreClock = 4000000;
+    sim_set_cpu_clock(SystemCoreClock, 1);
+
+    if (cause == SIM_WAKE_BUTTON) PWR->SR1 |= PWR_SR1_WUF1;
+    if (cause == SIM_WAKE_ALARM) RTC->SR |= RTC_SR_ALRAF;
+    if (cause == SIM_WAKE_TIMER) EXTI->PR1 |= RTC_EXTI_LINE_WAKEUPTIMER_EVENT;
+    if (sim->rtc_initialised) RTC->ICSR |= RTC_ICSR_INITS;
+
+    // factory calibration of VREFINT, converted at a 3.0 V supply
+    *VREFINT_CAL_ADDR = (uint16_t)(sim->model.vrefint_v * 4095 /
+                                       (VREFINT_CAL_VREF / 1000.0) +
+                                   0.5);
+
+    // SRAM2 holds random data after power up, or if it wasn't retained
+    size_t sram2_size = _eretained - _sretained;
+    if (sram2_size > SIM_SRAM2_SIZE) {
+        fprintf(stderr, ".retained is larger than SRAM2\n");
+        exit(2);
+    }
+    if (sim->sram2_retained && cause != SIM_WAKE_RESET) {
+        memcpy(_sretained, sim->sram2, sram2_size);
+    } else {
+        for (size_t i = 0; i < sram2_size; i++) _sretained[i] = rand();
+    }
+}
+
+uint64_t sim_wake_ns() { return sim->now_ns - sim->wake_start_ns; }
+
+/**
+ * @brief Whether a pin is configured as an output and driven low.
+ */
+static bool sim_pin_low(GPIO_TypeDef* port, uint16_t pin) {
+    int index = __builtin_ctz(pin);
+    bool output = ((port->MODER >> (index * 2)) & 3) == 1;
+    return output && !(port->ODR & pin);
+}
+
+static bool sim_pin_high(GPIO_TypeDef* port, uint16_t pin) {
+    int index = __builtin_ctz(pin);
+    bool output = ((port->MODER >> (index * 2)) & 3) == 1;
+    return output && (port->ODR & pin);
+}
+
+bool sim_aux_on() { return sim_pin_low(AUX_PWR_EN_GPIO_Port, AUX_PWR_EN_Pin); }
+
+bool sim_vdiv_on() {
+    return sim_pin_high(BATT_VDIV_EN_GPIO_Port, BATT_VDIV_EN_Pin);
+}
+
+bool sim_led_on() { return sim_pin_high(DEBUG_LED_GPIO_Port, DEBUG_LED_Pin); }
+
+static bool sim_sd_selected() {
+    return sim_aux_on() && sim_pin_low(SD_CS_GPIO_Port, SD_CS_Pin);
+}
+
+static bool sim_fram_selected() {
+    return sim_aux_on() && sim_pin_low(FRAM_CS_GPIO_Port, FRAM_CS_Pin);
+}
+
+static bool sim_panel_selected() {
+    return sim_aux_on() && sim_pin_low(DISP_CS_GPIO_Port, DISP_CS_Pin);
+}
+
+/**
+ * @brief Tell the devices about edges on the power, chip select and reset
+ * lines, after any change to the GPIO configuration or outputs.
+ */
+static void sim_gpio_changed() {
+    static bool aux, sd_cs, fram_cs, disp_rst;
+
+    if (sim_aux_on() != aux) {
+        aux = !aux;
+        sim_sd_power(aux);
+        sim_panel_power(aux);
+    }
+    if (sim_sd_selected() != sd_cs) {
+        sd_cs = !sd_cs;
+        sim_sd_select(sd_cs);
+    }
+    if (sim_fram_selected() != fram_cs) {
+        fram_cs = !fram_cs;
+        sim_fram_select(fram_cs);
+    }
+    bool rst = sim_pin_high(DISP_RST_GPIO_Port, DISP_RST_Pin);
+    if (rst != disp_rst) {
+        disp_rst = rst;
+        sim_panel_reset(rst);
+    }
+}
+
+/**
+ * @brief Whether the refresh button is held at the current time.
+ */
+static bool sim_button_held() {
+    for (int i = 0; i < sim->press_count; i++) {
+        const struct sim_press_t* press = &sim->presses[i];
+        if (sim->now_ns >= press->at_ns &&
+            sim->now_ns < press->at_ns + press->hold_ns) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Level of a toggle switch matrix column. The rows PA12, PA11 and PA10
+ * select bits 11-8, 7-4 and 3-0, and a closed switch pulls its column low
+ * while its row is driven low.
+ */
+static GPIO_PinState sim_switch_column(int column) {
+    static const uint16_t rows[] = {GPIO_PIN_10, GPIO_PIN_11, GPIO_PIN_12};
+
+    for (int row = 0; row < 3; row++) {
+        if (sim_pin_low(GPIOA, rows[row]) &&
+            (sim->switches & (1 << (row * 4 + column)))) {
+            return GPIO_PIN_RESET;
+        }
+    }
+    return GPIO_PIN_SET;
+}
+
+HAL_StatusTypeDef HAL_Init(void) { return HAL_OK; }
+
+uint32_t HAL_GetTick(void) { return sim_wake_ns() / SIM_NS_PER_MS; }
+
+void HAL_Delay(uint32_t Delay) {
+    // HAL_Delay waits for Delay + 1 tick edges, half a tick more than asked
+    // on average
+    sim_advance(Delay * SIM_NS_PER_MS + SIM_NS_PER_MS / 2);
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef* GPIOx, GPIO_InitTypeDef* GPIO_Init) {
+    for (int index = 0; index < 16; index++) {
+        if (!(GPIO_Init->Pin & (1 << index))) continue;
+        GPIOx->MODER &= ~(3u << (index * 2));
+        GPIOx->MODER |= (GPIO_Init->Mode & GPIO_MODE) << (index * 2);
+    }
+    sim_gpio_changed();
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin,
+                       GPIO_PinState PinState) {
+    sim_advance_cycles(sim->model.gpio_write_cycles);
+    if (PinState == GPIO_PIN_SET) {
+        GPIOx->ODR |= GPIO_Pin;
+    } else {
+        GPIOx->ODR &= ~GPIO_Pin;
+    }
+    sim_gpio_changed();
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin) {
+    if (GPIOx == BTN_IN_GPIO_Port && GPIO_Pin == BTN_IN_Pin) {
+        return sim_button_held() ? GPIO_PIN_SET : GPIO_PIN_RESET;
+    }
+    if (GPIOx == DISP_BUSY_GPIO_Port && GPIO_Pin == DISP_BUSY_Pin) {
+        return sim_panel_busy() ? GPIO_PIN_RESET : GPIO_PIN_SET;
+    }
+    if (GPIOx == SW_IN_GPIO_Port && GPIO_Pin == SW_IN_Pin) {
+        return sim_switch_column(0);
+    }
+    if (GPIOx == SW_INB4_GPIO_Port && GPIO_Pin == SW_INB4_Pin) {
+        return sim_switch_column(1);
+    }
+    if (GPIOx == SW_INB5_GPIO_Port && GPIO_Pin == SW_INB5_Pin) {
+        return sim_switch_column(2);
+    }
+    if (GPIOx == SW_INB6_GPIO_Port && GPIO_Pin == SW_INB6_Pin) {
+        return sim_switch_column(3);
+    }
+    return (GPIOx->ODR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef* hspi) {
+    hspi->Instance->CR1 = hspi->Init.BaudRatePrescaler | SPI_CR1_SPE;
+    return HAL_OK;
+}
+
+/**
+ * @brief Clock bytes over SPI1 to whichever devices are selected. Each byte
+ * takes the longer of its SPI clock time and the CPU time of the HAL loop.
+ */
+static void sim_spi_transfer(const uint8_t* tx, uint8_t* rx, uint16_t size) {
+    uint32_t prescaler =
+        2u << ((SPI1->CR1 & SPI_CR1_BR_Msk) >> SPI_CR1_BR_Pos);
+    uint64_t byte_cycles = 8 * prescaler;
+    if (byte_cycles < sim->model.spi_byte_cycles) {
+        byte_cycles = sim->model.spi_byte_cycles;
+    }
+
+    bool sd = sim_sd_selected();
+    bool fram = sim_fram_selected();
+    bool panel = sim_panel_selected();
+    bool panel_data = sim_pin_high(DISP_DC_GPIO_Port, DISP_DC_Pin);
+
+    sim_advance_cycles(sim->model.hal_call_cycles);
+    sim_spi_active(sd     ? SIM_RAIL_SD
+                   : fram ? SIM_RAIL_FRAM
+                   : panel ? SIM_RAIL_DISP
+                           : -1);
+    for (uint16_t i = 0; i < size; i++) {
+        sim_advance_cycles(byte_cycles);
+
+        uint8_t out = tx != NULL ? tx[i] : 0xFF;
+        uint8_t in = 0xFF;
+        if (sd) in &= sim_sd_exchange(out);
+        if (fram) in &= sim_fram_exchange(out);
+        if (panel) sim_panel_exchange(out, panel_data);
+        if (rx != NULL) rx[i] = in;
+    }
+    sim_spi_active(-1);
+    sim->spi_bytes += size;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi,
+                                   const uint8_t* pData, uint16_t Size,
+                                   uint32_t Timeout) {
+    sim_spi_transfer(pData, NULL, Size);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* hspi, uint8_t* pData,
+                                  uint16_t Size, uint32_t Timeout) {
+    sim_spi_transfer(NULL, pData, Size);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* hspi,
+                                          const uint8_t* pTxData,
+                                          uint8_t* pRxData, uint16_t Size,
+                                          uint32_t Timeout) {
+    sim_spi_transfer(pTxData, pRxData, Size);
+    return HAL_OK;
+}
+
+/**
+ * @brief Stop the run on a clock setting the real MCU doesn't allow.
+ */
+static void sim_clock_error(const char* message) {
+    fprintf(stderr, "clock error: %s at %u Hz in voltage range %d\n", message,
+            (unsigned)SystemCoreClock,
+            sim_voltage_scaling == PWR_REGULATOR_VOLTAGE_SCALE2 ? 2 : 1);
+    exit(2);
+}
+
+HAL_StatusTypeDef HAL_PWREx_ControlVoltageScaling(uint32_t VoltageScaling) {
+    if (VoltageScaling == PWR_REGULATOR_VOLTAGE_SCALE2 &&
+        SystemCoreClock > SIM_RANGE2_MAX_HZ) {
+        sim_clock_error("range 2 selected");
+    }
+
+    // raising the voltage waits for the regulator to settle
+    if (VoltageScaling == PWR_REGULATOR_VOLTAGE_SCALE1 &&
+        sim_voltage_scaling != PWR_REGULATOR_VOLTAGE_SCALE1) {
+        sim_advance(sim->model.vos_settle_us * 1000);
+    }
+
+    sim_voltage_scaling = VoltageScaling;
+    sim_set_cpu_clock(
+        SystemCoreClock,
+        sim_voltage_scaling == PWR_REGULATOR_VOLTAGE_SCALE2 ? 2 : 1);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef* RCC_OscInitStruct) {
+    // only the oscillators named in OscillatorType and a PLLState other than
+    // RCC_PLL_NONE are changed, like the real HAL
+    uint32_t type = RCC_OscInitStruct->OscillatorType;
+    if (type & RCC_OSCILLATORTYPE_HSI) {
+        sim_osc.HSIState = RCC_OscInitStruct->HSIState;
+    }
+    if (type & RCC_OSCILLATORTYPE_LSI) {
+        sim_osc.LSIState = RCC_OscInitStruct->LSIState;
+    }
+    if (type & RCC_OSCILLATORTYPE_MSI) {
+        sim_osc.MSIState = RCC_OscInitStruct->MSIState;
+        sim_osc.MSIClockRange = RCC_OscInitStruct->MSIClockRange;
+    }
+    if (RCC_OscInitStruct->PLL.PLLState == RCC_PLL_ON) {
+        sim_osc.PLL = RCC_OscInitStruct->PLL;
+        sim_advance(sim->model.pll_lock_us * 1000);
+    } else if (RCC_OscInitStruct->PLL.PLLState == RCC_PLL_OFF) {
+        sim_osc.PLL.PLLState = RCC_PLL_OFF;
+    }
+    return HAL_OK;
+}
+
+/**
+ * @brief Frequency of the MSI oscillator for an RCC_MSIRANGE_x value.
+ */
+static uint32_t sim_msi_hz(uint32_t range) {
+    static const uint32_t hz[] = {100000,   200000,   400000,   800000,
+                                  1000000,  2000000,  4000000,  8000000,
+                                  16000000, 24000000, 32000000, 48000000};
+    uint32_t index = range >> RCC_CR_MSIRANGE_Pos;
+    return index < sizeof(hz) / sizeof(hz[0]) ? hz[index] : 4000000;
+}
+
+/**
+ * @brief Flash wait states needed at a clock in the present voltage range.
+ */
+static uint32_t sim_flash_latency(uint32_t hz) {
+    // highest clock for 0, 1, 2, ... wait states, from the reference manual
+    static const uint32_t range1_hz[] = {16000000, 32000000, 48000000,
+                                         64000000, 80000000};
+    static const uint32_t range2_hz[] = {6000000, 12000000, 18000000,
+                                         26000000};
+    bool range2 = sim_voltage_scaling == PWR_REGULATOR_VOLTAGE_SCALE2;
+    const uint32_t* max_hz = range2 ? range2_hz : range1_hz;
+    uint32_t count = range2 ? 4 : 5;
+
+    for (uint32_t ws = 0; ws < count; ws++) {
+        if (hz <= max_hz[ws]) return ws;
+    }
+    return UINT32_MAX;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef* RCC_ClkInitStruct,
+                                      uint32_t FLatency) {
+    uint32_t hz;
+    switch (RCC_ClkInitStruct->SYSCLKSource) {
+        case RCC_SYSCLKSOURCE_HSI:
+            if (sim_osc.HSIState != RCC_HSI_ON) {
+                sim_clock_error("HSI selected while off");
+            }
+            hz = HSI_VALUE;
+            break;
+        case RCC_SYSCLKSOURCE_PLLCLK: {
+            if (sim_osc.PLL.PLLState != RCC_PLL_ON) {
+                sim_clock_error("PLL selected while off");
+            }
+            uint32_t source = sim_osc.PLL.PLLSource == RCC_PLLSOURCE_HSI
+                                  ? HSI_VALUE
+                                  : sim_msi_hz(sim_osc.MSIClockRange);
+            hz = source / sim_osc.PLL.PLLM * sim_osc.PLL.PLLN /
+                 sim_osc.PLL.PLLR;
+            break;
+        }
+        default:
+            hz = sim_msi_hz(sim_osc.MSIClockRange);
+            break;
+    }
+    hz >>= AHBPrescTable[(RCC_ClkInitStruct->AHBCLKDivider & RCC_CFGR_HPRE) >>
+                         RCC_CFGR_HPRE_Pos];
+
+    SystemCoreClock = hz;
+    if (sim_flash_latency(hz) == UINT32_MAX) {
+        sim_clock_error("clock too fast");
+    }
+    if (FLatency < sim_flash_latency(hz)) {
+        sim_clock_error("too few flash wait states");
+    }
+
+    sim_set_cpu_clock(
+        hz, sim_voltage_scaling == PWR_REGULATOR_VOLTAGE_SCALE2 ? 2 : 1);
+    return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetHCLKFreq(void) { return SystemCoreClock; }
+
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef* hadc) {
+    sim_adc_init = hadc->Init;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADCEx_Calibration_Start(ADC_HandleTypeDef* hadc,
+                                              uint32_t SingleDiff) {
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADCEx_MultiModeConfigChannel(
+    ADC_HandleTypeDef* hadc, const ADC_MultiModeTypeDef* multimode) {
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef* hadc,
+                                        const ADC_ChannelConfTypeDef* sConfig) {
+    sim_adc_channel = sConfig->Channel;
+    sim_adc_sampling_time = sConfig->SamplingTime;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Start(ADC_HandleTypeDef* hadc) { return HAL_OK; }
+
+/**
+ * @brief Number of conversions summed for one result.
+ */
+static uint32_t sim_adc_ratio() {
+    if (sim_adc_init.OversamplingMode != ENABLE) return 1;
+    return 2u << ((sim_adc_init.Oversampling.Ratio & ADC_CFGR2_OVSR) >>
+                  ADC_CFGR2_OVSR_Pos);
+}
+
+HAL_StatusTypeDef HAL_ADC_PollForConversion(ADC_HandleTypeDef* hadc,
+                                            uint32_t Timeout) {
+    // sampling time plus 12.5 cycles of conversion, for every oversample
+    static const double sampling_cycles[] = {2.5,  6.5,  12.5,  24.5,
+                                             47.5, 92.5, 247.5, 640.5};
+    double adc_hz = SystemCoreClock;
+    if (sim_adc_init.ClockPrescaler == ADC_CLOCK_SYNC_PCLK_DIV2) adc_hz /= 2;
+    if (sim_adc_init.ClockPrescaler == ADC_CLOCK_SYNC_PCLK_DIV4) adc_hz /= 4;
+
+    double cycles = (sampling_cycles[sim_adc_sampling_time & 7] + 12.5) *
+                    sim_adc_ratio();
+    sim_advance((uint64_t)(cycles / adc_hz * 1e9) + 1000);
+    return HAL_OK;
+}
+
+uint32_t HAL_ADC_GetValue(const ADC_HandleTypeDef* hadc) {
+    const struct sim_model_t* m = &sim->model;
+    double volts = 0;
+    if (sim_adc_channel == ADC_CHANNEL_VREFINT) {
+        volts = m->vrefint_v;
+    } else if (sim_adc_channel == ADC_CHANNEL_16 && sim_vdiv_on()) {
+        volts = sim_batt_terminal_voltage() / m->vdiv_ratio;
+    }
+
+    double code = volts / m->vdda_v * 4095;
+    if (code > 4095) code = 4095;
+
+    // the oversamples are summed, then shifted right
+    uint32_t shift =
+        (sim_adc_init.Oversampling.RightBitShift & ADC_CFGR2_OVSS) >>
+        ADC_CFGR2_OVSS_Pos;
+    if (sim_adc_init.OversamplingMode != ENABLE) shift = 0;
+    return (uint32_t)(code * sim_adc_ratio() + 0.5) >> shift;
+}
+
+HAL_StatusTypeDef HAL_ADC_Stop(ADC_HandleTypeDef* hadc) { return HAL_OK; }
+
+HAL_StatusTypeDef HAL_RNG_Init(RNG_HandleTypeDef* hrng) { return HAL_OK; }
+
+HAL_StatusTypeDef HAL_RNG_GenerateRandomNumber(RNG_HandleTypeDef* hrng,
+                                               uint32_t* random32bit) {
+    // xorshift32, seeded from the command line for repeatable runs
+    uint32_t x = sim->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim->rng = x;
+    *random32bit = x;
+    return HAL_OK;
+}
+
+/**
+ * @brief Days since 2000-01-01 of a calendar date, year 0-99.
+ */
+static int64_t sim_days_from_date(int year, int month, int day) {
+    static const int days_before[12] = {0,   31,  59,  90,  120, 151,
+                                        181, 212, 243, 273, 304, 334};
+    int64_t days =
+        year * 365 + (year + 3) / 4 + days_before[month - 1] + day - 1;
+    if (month > 2 && year % 4 == 0) days++;
+    return days;
+}
+
+static void sim_date_from_days(int64_t days, RTC_DateTypeDef* date) {
+    int year = 0;
+    while (days >= (year % 4 == 0 ? 366 : 365)) {
+        days -= year % 4 == 0 ? 366 : 365;
+        year++;
+    }
+    int month = 1;
+    while (month < 12 && days >= sim_days_from_date(year, month + 1, 1) -
+                                     sim_days_from_date(year, 1, 1)) {
+        month++;
+    }
+    date->Year = year % 100;
+    date->Month = month;
+    date->Date = days - (sim_days_from_date(year, month, 1) -
+                         sim_days_from_date(year, 1, 1)) + 1;
+}
+
+static int64_t sim_rtc_seconds() {
+    return sim->rtc_offset_s + (int64_t)(sim->now_ns / SIM_NS_PER_S);
+}
+
+HAL_StatusTypeDef HAL_RTC_Init(RTC_HandleTypeDef* hrtc) { return HAL_OK; }
+
+HAL_StatusTypeDef HAL_RTC_WaitForSynchro(RTC_HandleTypeDef* hrtc) {
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTC_SetTime(RTC_HandleTypeDef* hrtc,
+                                  RTC_TimeTypeDef* sTime, uint32_t Format) {
+    int64_t now = sim_rtc_seconds();
+    int64_t day_start = now - now % 86400;
+    int64_t seconds =
+        day_start + sTime->Hours * 3600 + sTime->Minutes * 60 + sTime->Seconds;
+    sim->rtc_offset_s += seconds - now;
+    sim->rtc_initialised = true;
+    RTC->ICSR |= RTC_ICSR_INITS;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTC_SetDate(RTC_HandleTypeDef* hrtc,
+                                  RTC_DateTypeDef* sDate, uint32_t Format) {
+    int64_t now = sim_rtc_seconds();
+    int64_t seconds =
+        sim_days_from_date(sDate->Year, sDate->Month, sDate->Date) * 86400 +
+        now % 86400;
+    sim->rtc_offset_s += seconds - now;
+    sim->rtc_initialised = true;
+    RTC->ICSR |= RTC_ICSR_INITS;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTC_GetTime(RTC_HandleTypeDef* hrtc,
+                                  RTC_TimeTypeDef* sTime, uint32_t Format) {
+    int64_t seconds = sim_rtc_seconds() % 86400;
+    sTime->Hours = seconds / 3600;
+    sTime->Minutes = (seconds / 60) % 60;
+    sTime->Seconds = seconds % 60;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTC_GetDate(RTC_HandleTypeDef* hrtc,
+                                  RTC_DateTypeDef* sDate, uint32_t Format) {
+    int64_t days = sim_rtc_seconds() / 86400;
+    sim_date_from_days(days, sDate);
+    sDate->WeekDay = (days + 5) % 7 + 1;  // 2000-01-01 was a Saturday
+    return HAL_OK;
+}
+
+/**
+ * @brief Arm alarm A at the first time after now matching its time and, unless
+ * masked, its day of the month. Only binary format alarms on the date are
+ * supported, which is what the firmware sets.
+ */
+HAL_StatusTypeDef HAL_RTC_SetAlarm_IT(RTC_HandleTypeDef* hrtc,
+                                      RTC_AlarmTypeDef* sAlarm,
+                                      uint32_t Format) {
+    int64_t now = sim_rtc_seconds();
+    int64_t time_of_day = sAlarm->AlarmTime.Hours * 3600 +
+                          sAlarm->AlarmTime.Minutes * 60 +
+                          sAlarm->AlarmTime.Seconds;
+    bool any_day = sAlarm->AlarmMask & RTC_ALARMMASK_DATEWEEKDAY;
+
+    for (int64_t day = now / 86400;
+         day <= now / 86400 + SIM_DAYS_PER_ALARM_SEARCH; day++) {
+        RTC_DateTypeDef date;
+        sim_date_from_days(day, &date);
+        int64_t at = day * 86400 + time_of_day;
+        if (at > now && (any_day || date.Date == sAlarm->AlarmDateWeekDay)) {
+            sim->alarm_armed = true;
+            sim->alarm_ns = (uint64_t)(at - sim->rtc_offset_s) * SIM_NS_PER_S;
+            return HAL_OK;
+        }
+    }
+    return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_RTCEx_SetWakeUpTimer_IT(RTC_HandleTypeDef* hrtc,
+                                              uint32_t WakeUpCounter,
+                                              uint32_t WakeUpClock,
+                                              uint32_t WakeUpAutoClr) {
+    // only the 1 Hz clock the firmware uses is modelled
+    sim->timer_armed = true;
+    sim->timer_ns = sim->now_ns + (WakeUpCounter + 1) * SIM_NS_PER_S;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTCEx_DeactivateWakeUpTimer(RTC_HandleTypeDef* hrtc) {
+    sim->timer_armed = false;
+    return HAL_OK;
+}
+
+void HAL_PWR_EnableWakeUpPin(uint32_t WakeUpPinPolarity) {
+    sim->wakeup_pin_enabled = true;
+}
+
+void HAL_PWR_DisableWakeUpPin(uint32_t WakeUpPinx) {
+    sim->wakeup_pin_enabled = false;
+}
+
+void HAL_PWREx_EnableSRAM2ContentRetention(void) {
+    SET_BIT(PWR->CR3, PWR_CR3_RRS);
+}
+
+/**
+ * @brief End the wake cycle. The process exits, discarding RAM, and the
+ * simulator schedules the next wake from the armed alarms and button presses.
+ * SRAM2 is kept if its retention was enabled.
+ */
+void HAL_PWR_EnterSTANDBYMode(void) {
+    sim->sram2_retained = READ_BIT(PWR->CR3, PWR_CR3_RRS);
+    if (sim->sram2_retained) {
+        memcpy(sim->sram2, _sretained, _eretained - _sretained);
+    }
+    sim->standby = true;
+    fflush(stdout);
+    _exit(0);
+}
+
+/**
+ * @brief The CRC unit computes as its data register is written, which plain
+ * memory can't, so the sim builds this in place of crc.c, computing the same
+ * CRC (as zlib) in software.
+ */
+static uint32_t sim_crc;
+
+void crc_start() { sim_crc = 0xFFFFFFFF; }
+
+void crc_update(const uint8_t* data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        sim_crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            sim_crc = (sim_crc >> 1) ^ (0xEDB88320 & -(sim_crc & 1));
+        }
+    }
+}
+
+uint32_t crc_result() { return ~sim_crc; }
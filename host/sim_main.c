@@ -0,0 +1,341 @@
+/**
+ * Host simulation of the Aeon firmware. Each wake cycle runs the real
+ * firmware main() in a forked process against the simulated HAL, so RAM
+ * starts out cleared on every wake like after standby, while the RTC, FRAM,
+ * retained SRAM2 and SD card image persist in the simulator. Time and charge
+ * are reported per wake, followed by the projected battery life.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define SIM_WAKE_TIMEOUT_S 60  // host time limit of a single wake
+#define SIM_UA_NS_PER_UAH 3.6e12
+#define SIM_DEFAULT_HOLD_MS 200
+
+int firmware_main(void);
+
+struct sim_state_t* sim;
+
+static const char* sim_wake_names[] = {"reset", "alarm", "timer", "button"};
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s --card IMAGE [options]\n"
+            "  --card IMAGE      SD card image, written in place\n"
+            "  --model FILE      override model parameters, name = value\n"
+            "  --wakes N         wake cycles to run (default 10)\n"
+            "  --days D          run for D simulated days instead\n"
+            "  --switches BITS   toggle switch bits (default 0x818: refresh\n"
+            "                    on, shuffle off, 24 hour interval)\n"
+            "  --press S[:MS]    press the refresh button S seconds into the\n"
+            "                    run for MS milliseconds, can be repeated\n"
+            "  --fram FILE       load FRAM from FILE and save it at the end\n"
+            "  --png DIR         write each refreshed frame to DIR\n"
+            "  --seed N          seed of the simulated RNG\n"
+            "  --print-model     print the model parameters and exit\n"
+            "  -v                show the firmware debug output\n",
+            name);
+}
+
+static void print_model(const struct sim_model_t* model) {
+#define SIM_MODEL_PRINT(name, value, comment) \
+    printf("%-24s = %-10g # %s\n", #name, model->name, comment);
+    SIM_MODEL_PARAMS(SIM_MODEL_PRINT)
+#undef SIM_MODEL_PRINT
+}
+
+static bool load_fram(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return errno == ENOENT;  // new FRAM, saved at the end
+    size_t size = fread(sim->fram, 1, SIM_FRAM_SIZE, f);
+    fclose(f);
+    if (size != SIM_FRAM_SIZE) {
+        fprintf(stderr, "%s: expected %d bytes\n", path, SIM_FRAM_SIZE);
+        return false;
+    }
+    return true;
+}
+
+static void save_fram(const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL || fwrite(sim->fram, 1, SIM_FRAM_SIZE, f) != SIM_FRAM_SIZE) {
+        perror(path);
+    }
+    if (f != NULL) fclose(f);
+}
+
+/**
+ * @brief Run one wake cycle in a child process, until the firmware enters
+ * standby. Returns false if it crashed, hung or returned instead.
+ */
+static bool run_wake(enum sim_wake_t cause, bool verbose) {
+    sim->wake_cause = cause;
+    sim->standby = false;
+    sim->wake_start_ns = sim->now_ns;
+    memset(sim->wake_uah, 0, sizeof(sim->wake_uah));
+    sim->spi_bytes = 0;
+    sim->refreshes = 0;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!verbose) freopen("/dev/null", "w", stdout);
+        alarm(SIM_WAKE_TIMEOUT_S);
+        sim_hal_reset(cause);
+        sim_advance(sim->model.boot_us * 1000);
+        firmware_main();
+        _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "wake %u: firmware killed by signal %d%s\n", sim->wake,
+                WTERMSIG(status),
+                WTERMSIG(status) == SIGALRM ? " (hung)" : "");
+        return false;
+    }
+    if (!sim->standby) {
+        fprintf(stderr, "wake %u: firmware did not enter standby\n", sim->wake);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Time of a period that falls in daylight, with days counted from the
+ * start of the simulation.
+ */
+static double daylight_ns(uint64_t from_ns, uint64_t ns) {
+    const struct sim_model_t* m = &sim->model;
+    const double day_ns = 86400.0 * SIM_NS_PER_S;
+    double start = m->harvest_day_start_h * 3600 * SIM_NS_PER_S;
+    double end = start + m->harvest_day_hours * 3600 * SIM_NS_PER_S;
+    double total = 0;
+
+    for (double day = floor(from_ns / day_ns) * day_ns; day < from_ns + ns;
+         day += day_ns) {
+        double lo = fmax(day + start, from_ns);
+        double hi = fmin(day + end, (double)from_ns + ns);
+        if (hi > lo) total += hi - lo;
+    }
+    return total;
+}
+
+/**
+ * @brief Take charge drawn over a period from the battery, net of what the
+ * energy harvester puts back. The battery can't charge beyond full.
+ */
+static void sim_charge(double uah, uint64_t from_ns, uint64_t ns) {
+    const struct sim_model_t* m = &sim->model;
+    sim->used_uah += uah - m->harvest_ua * ns / SIM_UA_NS_PER_UAH -
+                     m->harvest_day_ua * daylight_ns(from_ns, ns) /
+                         SIM_UA_NS_PER_UAH;
+    if (sim->used_uah < 0) sim->used_uah = 0;
+}
+
+/**
+ * @brief Find what ends standby first: the RTC alarm, the wakeup timer or a
+ * button press on the wake up pin.
+ */
+static bool next_wake(uint64_t* at_ns, enum sim_wake_t* cause) {
+    bool found = false;
+    if (sim->alarm_armed && sim->alarm_ns > sim->now_ns) {
+        *at_ns = sim->alarm_ns;
+        *cause = SIM_WAKE_ALARM;
+        found = true;
+    }
+    if (sim->timer_armed && (!found || sim->timer_ns < *at_ns)) {
+        *at_ns = sim->timer_ns;
+        *cause = SIM_WAKE_TIMER;
+        found = true;
+    }
+    for (int i = 0; sim->wakeup_pin_enabled && i < sim->press_count; i++) {
+        uint64_t at = sim->presses[i].at_ns;
+        if (at > sim->now_ns && (!found || at < *at_ns)) {
+            *at_ns = at;
+            *cause = SIM_WAKE_BUTTON;
+            found = true;
+        }
+    }
+    return found;
+}
+
+int main(int argc, char** argv) {
+    sim = mmap(NULL, sizeof(*sim), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sim == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(sim, 0, sizeof(*sim));
+    sim_model_defaults(&sim->model);
+    sim->switches = 0x818;
+    sim->rng = 1;
+
+    static const struct option options[] = {
+        {"card", required_argument, NULL, 'c'},
+        {"model", required_argument, NULL, 'm'},
+        {"wakes", required_argument, NULL, 'w'},
+        {"days", required_argument, NULL, 'd'},
+        {"switches", required_argument, NULL, 's'},
+        {"press", required_argument, NULL, 'p'},
+        {"fram", required_argument, NULL, 'f'},
+        {"png", required_argument, NULL, 'o'},
+        {"seed", required_argument, NULL, 'r'},
+        {"print-model", no_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0},
+    };
+
+    const char* card = NULL;
+    const char* fram = NULL;
+    uint32_t wakes = 10;
+    double days = 0;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "v", options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                card = optarg;
+                break;
+            case 'm':
+                if (!sim_model_load(&sim->model, optarg)) return 1;
+                break;
+            case 'w':
+                wakes = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                days = strtod(optarg, NULL);
+                break;
+            case 's':
+                sim->switches = strtoul(optarg, NULL, 0) & 0xFFF;
+                break;
+            case 'p': {
+                if (sim->press_count == SIM_PRESS_MAX) {
+                    fprintf(stderr, "at most %d presses\n", SIM_PRESS_MAX);
+                    return 1;
+                }
+                char* end;
+                struct sim_press_t* press = &sim->presses[sim->press_count++];
+                press->at_ns = strtod(optarg, &end) * SIM_NS_PER_S;
+                press->hold_ns = (*end == ':' ? strtod(end + 1, NULL)
+                                              : SIM_DEFAULT_HOLD_MS) *
+                                 SIM_NS_PER_MS;
+                break;
+            }
+            case 'f':
+                fram = optarg;
+                break;
+            case 'o':
+                snprintf(sim->png_dir, sizeof(sim->png_dir), "%s", optarg);
+                break;
+            case 'r':
+                sim->rng = strtoul(optarg, NULL, 0) | 1;
+                break;
+            case 'P':
+                print_model(&sim->model);
+                return 0;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (card == NULL || optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!sim_sd_open(card)) return 1;
+    if (fram != NULL && !load_fram(fram)) return 1;
+    if (sim->png_dir[0] != '\0' && mkdir(sim->png_dir, 0777) != 0 &&
+        errno != EEXIST) {
+        perror(sim->png_dir);
+        return 1;
+    }
+
+    const struct sim_model_t* m = &sim->model;
+    sim->used_uah = m->batt_mah * 1000 * (100 - m->batt_charge_pct) / 100;
+    double active_total = 0, standby_total = 0;
+    uint32_t refresh_total = 0;
+    enum sim_wake_t cause = SIM_WAKE_RESET;
+
+    printf("%5s %-6s %11s %10s %8s %8s %8s %8s %8s %7s %10s %10s %6s\n",
+           "wake", "cause", "active ms", "uAh", "mcu", "sd", "disp", "fram",
+           "board", "spi kB", "sleep s", "sleep uAh", "batt V");
+
+    for (sim->wake = 1; days > 0 || sim->wake <= wakes; sim->wake++) {
+        double batt_v = sim_batt_voltage();
+        if (!run_wake(cause, verbose)) break;
+
+        double active_uah = 0;
+        for (int rail = 0; rail < SIM_RAIL_COUNT; rail++) {
+            active_uah += sim->wake_uah[rail];
+        }
+        sim_charge(active_uah, sim->wake_start_ns,
+                   sim->now_ns - sim->wake_start_ns);
+        active_total += active_uah;
+        refresh_total += sim->refreshes;
+
+        uint64_t wake_at = 0;
+        bool wakes_again = next_wake(&wake_at, &cause);
+        uint64_t sleep_ns = wakes_again ? wake_at - sim->now_ns : 0;
+        double standby_ua = m->mcu_standby_ua + m->board_standby_ua +
+                            (sim->sram2_retained ? m->mcu_sram2_ua : 0);
+        double sleep_uah = standby_ua * sleep_ns / SIM_UA_NS_PER_UAH;
+
+        printf("%5u %-6s %11.1f %10.2f %8.2f %8.2f %8.2f %8.2f %8.2f %7.1f "
+               "%10.0f %10.2f %6.3f%s\n",
+               sim->wake, sim_wake_names[sim->wake_cause],
+               (sim->now_ns - sim->wake_start_ns) / 1e6, active_uah,
+               sim->wake_uah[SIM_RAIL_MCU], sim->wake_uah[SIM_RAIL_SD],
+               sim->wake_uah[SIM_RAIL_DISP], sim->wake_uah[SIM_RAIL_FRAM],
+               sim->wake_uah[SIM_RAIL_BOARD], sim->spi_bytes / 1024.0,
+               sleep_ns / 1e9, sleep_uah, batt_v,
+               sim->refreshes ? " refresh" : "");
+
+        if (!wakes_again) {
+            fprintf(stderr,
+                    "no alarm armed, the device would not wake again\n");
+            break;
+        }
+        if (days > 0 && wake_at >= days * 86400 * SIM_NS_PER_S) {
+            sleep_ns = days * 86400 * SIM_NS_PER_S - sim->now_ns;
+            sleep_uah = standby_ua * sleep_ns / SIM_UA_NS_PER_UAH;
+            wake_at = sim->now_ns + sleep_ns;
+            days = -1;  // stop after charging the last standby period
+        }
+
+        sim_charge(sleep_uah, sim->now_ns, sleep_ns);
+        standby_total += sleep_uah;
+        sim->now_ns = wake_at;
+        if (cause == SIM_WAKE_ALARM) sim->alarm_armed = false;
+        if (cause == SIM_WAKE_TIMER) sim->timer_armed = false;
+        if (days < 0) break;
+    }
+
+    double hours = sim->now_ns / 1e9 / 3600;
+    double average_ua = hours > 0 ? (active_total + standby_total) / hours : 0;
+    printf("\n%.2f days, %u refreshes: %.1f uAh awake, %.1f uAh in standby, "
+           "average %.2f uA\n",
+           hours / 24, refresh_total, active_total, standby_total, average_ua);
+    if (average_ua > 0) {
+        printf("projected battery life with %.0f mAh: %.0f days\n", m->batt_mah,
+               m->batt_mah * 1000 / average_ua / 24);
+    }
+
+    if (fram != NULL) save_fram(fram);
+    return 0;
+}
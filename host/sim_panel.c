@@ -0,0 +1,201 @@
+/**
+ * 7.3" 800x480 colour e-paper panel. Data bytes following command 0x10 fill
+ * the framebuffer, two 4-bit pixels per byte, and each DISPLAY_REFRESH writes
+ * the framebuffer to a PNG file when an output directory is given. The BUSY
+ * line is held for the modelled duration of resets and power and refresh
+ * commands.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define PANEL_WIDTH 800
+#define PANEL_HEIGHT 480
+#define PANEL_STRIDE (PANEL_WIDTH / 2)
+
+#define PANEL_DATA_START 0x10
+#define PANEL_POWER_OFF 0x02
+#define PANEL_POWER_ON 0x04
+#define PANEL_DEEP_SLEEP 0x07
+#define PANEL_REFRESH 0x12
+
+#define PNG_STORED_BLOCK_MAX 65535
+
+// Colours of the panel, in the order of the palette used by convert.py
+static const uint8_t panel_palette[16][3] = {
+    {0, 0, 0},     {255, 255, 255}, {0, 255, 0},   {0, 0, 255},
+    {255, 0, 0},   {255, 255, 0},   {255, 125, 0}, {255, 255, 255},
+};
+
+static uint8_t panel_fb[PANEL_HEIGHT][PANEL_STRIDE];
+static uint32_t panel_fb_pos;
+static uint8_t panel_command;
+static bool panel_powered, panel_asleep, panel_reset_low;
+static uint64_t panel_busy_end_ns;
+
+static uint32_t png_crc_table[256];
+
+static uint32_t png_crc(uint32_t crc, const uint8_t* data, size_t size) {
+    if (png_crc_table[1] == 0) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            png_crc_table[n] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = png_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void png_put32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void png_chunk(FILE* f, const char* type, const uint8_t* data,
+                      uint32_t size) {
+    uint8_t header[8];
+    png_put32(header, size);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = png_crc(png_crc(0, header + 4, 4), data, size);
+    uint8_t trailer[4];
+    png_put32(trailer, crc);
+
+    fwrite(header, 1, sizeof(header), f);
+    fwrite(data, 1, size, f);
+    fwrite(trailer, 1, sizeof(trailer), f);
+}
+
+/**
+ * @brief Write the framebuffer as a 4-bit palette PNG. The pixel packing of
+ * the panel is the same as PNG's, so rows are stored as received, in
+ * uncompressed deflate blocks.
+ */
+static void panel_write_png(const char* path) {
+    static uint8_t raw[PANEL_HEIGHT * (PANEL_STRIDE + 1)];
+    // zlib header, stored blocks of 5 header bytes each, Adler-32
+    static uint8_t idat[2 + sizeof(raw) +
+                        5 * (sizeof(raw) / PNG_STORED_BLOCK_MAX + 1) + 4];
+
+    for (int y = 0; y < PANEL_HEIGHT; y++) {
+        raw[y * (PANEL_STRIDE + 1)] = 0;  // no filter
+        memcpy(&raw[y * (PANEL_STRIDE + 1) + 1], panel_fb[y], PANEL_STRIDE);
+    }
+
+    uint32_t size = 0, a = 1, b = 0;
+    idat[size++] = 0x78;  // zlib header, no compression
+    idat[size++] = 0x01;
+    for (uint32_t pos = 0; pos < sizeof(raw); pos += PNG_STORED_BLOCK_MAX) {
+        uint32_t len = sizeof(raw) - pos;
+        if (len > PNG_STORED_BLOCK_MAX) len = PNG_STORED_BLOCK_MAX;
+        idat[size++] = pos + len == sizeof(raw);  // final block flag
+        idat[size++] = len;
+        idat[size++] = len >> 8;
+        idat[size++] = ~len;
+        idat[size++] = ~len >> 8;
+        memcpy(&idat[size], &raw[pos], len);
+        size += len;
+    }
+    for (uint32_t i = 0; i < sizeof(raw); i++) {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    png_put32(&idat[size], b << 16 | a);
+    size += 4;
+
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+
+    uint8_t ihdr[13] = {0};
+    png_put32(ihdr, PANEL_WIDTH);
+    png_put32(ihdr + 4, PANEL_HEIGHT);
+    ihdr[8] = 4;  // bit depth
+    ihdr[9] = 3;  // palette colour
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, f);
+    png_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+    png_chunk(f, "PLTE", &panel_palette[0][0], sizeof(panel_palette));
+    png_chunk(f, "IDAT", idat, size);
+    png_chunk(f, "IEND", NULL, 0);
+    fclose(f);
+}
+
+static void panel_busy_for(double ms) {
+    panel_busy_end_ns = sim->now_ns + (uint64_t)(ms * SIM_NS_PER_MS);
+}
+
+void sim_panel_power(bool on) {
+    panel_powered = on;
+    panel_asleep = false;
+    panel_busy_end_ns = 0;
+}
+
+/**
+ * @brief Level of the reset line. The panel resets on the rising edge after
+ * reset was held low, and is busy while it initialises.
+ */
+void sim_panel_reset(bool level) {
+    if (!level) {
+        panel_reset_low = true;
+        return;
+    }
+    if (panel_reset_low && panel_powered) {
+        panel_asleep = false;
+        panel_busy_for(sim->model.disp_reset_ms);
+    }
+    panel_reset_low = false;
+}
+
+bool sim_panel_busy() {
+    return panel_powered && sim->now_ns < panel_busy_end_ns;
+}
+
+uint64_t sim_panel_next_event() {
+    return sim_panel_busy() ? panel_busy_end_ns : UINT64_MAX;
+}
+
+void sim_panel_exchange(uint8_t in, bool data) {
+    if (!panel_powered || panel_asleep) return;
+
+    if (!data) {
+        panel_command = in;
+        switch (in) {
+            case PANEL_DATA_START:
+                panel_fb_pos = 0;
+                break;
+            case PANEL_POWER_ON:
+                panel_busy_for(sim->model.disp_power_on_ms);
+                break;
+            case PANEL_POWER_OFF:
+                panel_busy_for(sim->model.disp_power_off_ms);
+                break;
+            case PANEL_REFRESH:
+                sim->refreshes++;
+                panel_busy_for(sim->model.disp_refresh_ms);
+                if (sim->png_dir[0] != '\0') {
+                    char path[300];
+                    snprintf(path, sizeof(path), "%s/wake_%05u.png",
+                             sim->png_dir, sim->wake);
+                    panel_write_png(path);
+                }
+                break;
+        }
+        return;
+    }
+
+    if (panel_command == PANEL_DATA_START &&
+        panel_fb_pos < sizeof(panel_fb)) {
+        (&panel_fb[0][0])[panel_fb_pos++] = in;
+    }
+    if (panel_command == PANEL_DEEP_SLEEP && in == 0xA5) panel_asleep = true;
+}
@@ -0,0 +1,302 @@
+/**
+ * SD card in SPI mode, backed by a card image file. It answers the command set
+ * the FatFs SPI driver uses (CMD0, 8, 9, 12, 16, 17, 18, 24, 25, 55, 58 and
+ * ACMD13, 23, 41) with block addressing, and models the read latency and
+ * write busy time of the card. Writes go straight to the image.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define SD_BLOCK_SIZE 512
+#define SD_TOKEN_SINGLE 0xFE
+#define SD_TOKEN_MULTI 0xFC
+#define SD_TOKEN_STOP 0xFD
+#define SD_R1_IDLE 0x01
+#define SD_R1_ILLEGAL 0x04
+#define SD_DATA_ACCEPTED 0x05
+
+enum sd_write_t {
+    SD_WRITE_NONE,
+    SD_WRITE_SINGLE,  // waiting for the token of a CMD24 block
+    SD_WRITE_MULTI,   // waiting for the next token of a CMD25 transfer
+    SD_WRITE_DATA,    // receiving block data and CRC
+};
+
+static int sd_fd = -1;
+static uint32_t sd_blocks;
+
+static bool sd_powered, sd_selected, sd_idle, sd_app_cmd;
+static uint64_t sd_init_start_ns;
+
+static uint8_t sd_cmd[6];
+static int sd_cmd_len;
+
+// bytes the card sends next
+static uint8_t sd_out[SD_BLOCK_SIZE + 80];
+static int sd_out_len, sd_out_pos;
+
+static uint64_t sd_busy_end_ns;
+
+static uint32_t sd_read_block, sd_read_count;  // pending blocks of a read
+static uint64_t sd_read_ready_ns;
+
+static enum sd_write_t sd_write, sd_write_after;  // state after the block
+static uint32_t sd_write_block;
+static uint8_t sd_write_buf[SD_BLOCK_SIZE + 2];
+static int sd_write_len;
+
+/**
+ * @brief Open the card image. Its size, rounded down to whole 512kB units, is
+ * reported as the card capacity.
+ */
+bool sim_sd_open(const char* path) {
+    sd_fd = open(path, O_RDWR);
+    struct stat st;
+    if (sd_fd < 0 || fstat(sd_fd, &st) != 0) {
+        perror(path);
+        return false;
+    }
+    sd_blocks = st.st_size / SD_BLOCK_SIZE / 1024 * 1024;
+    if (sd_blocks == 0) {
+        fprintf(stderr, "%s: card image smaller than 512kB\n", path);
+        return false;
+    }
+    return true;
+}
+
+static void sd_queue(const uint8_t* data, int size) {
+    if (sd_out_pos == sd_out_len) sd_out_pos = sd_out_len = 0;
+    memcpy(sd_out + sd_out_len, data, size);
+    sd_out_len += size;
+}
+
+static void sd_queue_byte(uint8_t value) { sd_queue(&value, 1); }
+
+/**
+ * @brief Queue a data block read from the image: start token, data and CRC.
+ */
+static void sd_queue_block(uint32_t block) {
+    uint8_t data[SD_BLOCK_SIZE] = {0};
+    if (block < sd_blocks) {
+        pread(sd_fd, data, SD_BLOCK_SIZE, (off_t)block * SD_BLOCK_SIZE);
+    }
+    sd_queue_byte(SD_TOKEN_SINGLE);
+    sd_queue(data, SD_BLOCK_SIZE);
+    sd_queue_byte(0xFF);
+    sd_queue_byte(0xFF);
+}
+
+/**
+ * @brief Queue a 16 byte register (CSD) or partial status block.
+ */
+static void sd_queue_register(const uint8_t* data, int size) {
+    sd_queue_byte(SD_TOKEN_SINGLE);
+    sd_queue(data, size);
+    sd_queue_byte(0xFF);
+    sd_queue_byte(0xFF);
+}
+
+static void sd_reset() {
+    sd_idle = true;
+    sd_app_cmd = false;
+    sd_init_start_ns = 0;
+    sd_cmd_len = 0;
+    sd_out_len = sd_out_pos = 0;
+    sd_read_count = 0;
+    sd_write = SD_WRITE_NONE;
+    sd_busy_end_ns = 0;
+}
+
+void sim_sd_power(bool on) {
+    sd_powered = on;
+    sd_reset();
+}
+
+/**
+ * @brief Chip select edge. Deselecting drops any response not read yet.
+ */
+void sim_sd_select(bool selected) {
+    sd_selected = selected;
+    if (!selected) {
+        sd_cmd_len = 0;
+        sd_out_len = sd_out_pos = 0;
+    }
+}
+
+bool sim_sd_busy() {
+    return sim->now_ns < sd_busy_end_ns ||
+           (sd_read_count > 0 && sim->now_ns < sd_read_ready_ns);
+}
+
+uint64_t sim_sd_next_event() {
+    if (sim->now_ns < sd_busy_end_ns) return sd_busy_end_ns;
+    if (sd_read_count > 0 && sim->now_ns < sd_read_ready_ns) {
+        return sd_read_ready_ns;
+    }
+    return UINT64_MAX;
+}
+
+static void sd_command(uint8_t cmd, uint32_t arg) {
+    const struct sim_model_t* m = &sim->model;
+    bool app = sd_app_cmd;
+    uint8_t r1 = sd_idle ? SD_R1_IDLE : 0;
+
+    sd_app_cmd = false;
+
+    if (app && cmd == 41) {  // SD_SEND_OP_COND
+        if (sd_init_start_ns == 0) sd_init_start_ns = sim->now_ns;
+        if (sim->now_ns - sd_init_start_ns >= m->sd_init_ms * SIM_NS_PER_MS) {
+            sd_idle = false;
+        }
+        sd_queue_byte(sd_idle ? SD_R1_IDLE : 0);
+        return;
+    }
+    if (app && cmd == 13) {  // SD_STATUS, AU size of 4MB
+        uint8_t status[64] = {0};
+        status[10] = 0x90;
+        sd_queue_byte(r1);
+        sd_queue_byte(0);  // second byte of R2
+        sd_queue_register(status, sizeof(status));
+        return;
+    }
+    if (app && cmd == 23) {  // SET_WR_BLK_ERASE_COUNT
+        sd_queue_byte(r1);
+        return;
+    }
+
+    switch (cmd) {
+        case 0:  // GO_IDLE_STATE
+            sd_reset();
+            sd_queue_byte(SD_R1_IDLE);
+            break;
+        case 8: {  // SEND_IF_COND, echo the voltage range and check pattern
+            uint8_t r7[] = {r1, 0, 0, (arg >> 8) & 0x0F, arg & 0xFF};
+            sd_queue(r7, sizeof(r7));
+            break;
+        }
+        case 9: {  // SEND_CSD, version 2.0
+            uint32_t c_size = sd_blocks / 1024 - 1;
+            uint8_t csd[16] = {0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00,
+                               (c_size >> 16) & 0x3F, (c_size >> 8) & 0xFF,
+                               c_size & 0xFF, 0x7F, 0x80, 0x0A, 0x40, 0x00,
+                               0x01};
+            sd_queue_byte(r1);
+            sd_queue_register(csd, sizeof(csd));
+            break;
+        }
+        case 12:  // STOP_TRANSMISSION, a stuff byte precedes R1
+            sd_read_count = 0;
+            sd_out_len = sd_out_pos = 0;
+            sd_queue_byte(0xFF);
+            sd_queue_byte(r1);
+            break;
+        case 16:  // SET_BLOCKLEN
+            sd_queue_byte(r1);
+            break;
+        case 17:  // READ_SINGLE_BLOCK
+        case 18:  // READ_MULTIPLE_BLOCK
+            sd_queue_byte(arg < sd_blocks ? r1 : r1 | 0x40);
+            if (arg >= sd_blocks) break;
+            sd_read_block = arg;
+            sd_read_count = cmd == 17 ? 1 : UINT32_MAX;
+            sd_read_ready_ns =
+                sim->now_ns + (uint64_t)(m->sd_read_latency_us * 1000);
+            break;
+        case 24:  // WRITE_BLOCK
+        case 25:  // WRITE_MULTIPLE_BLOCK
+            sd_queue_byte(arg < sd_blocks ? r1 : r1 | 0x40);
+            if (arg >= sd_blocks) break;
+            sd_write_block = arg;
+            sd_write = cmd == 24 ? SD_WRITE_SINGLE : SD_WRITE_MULTI;
+            break;
+        case 55:  // APP_CMD
+            sd_app_cmd = true;
+            sd_queue_byte(r1);
+            break;
+        case 58: {  // READ_OCR, powered up and high capacity
+            uint8_t r3[] = {r1, 0xC0, 0xFF, 0x80, 0x00};
+            sd_queue(r3, sizeof(r3));
+            break;
+        }
+        default:
+            sd_queue_byte(r1 | SD_R1_ILLEGAL);
+            break;
+    }
+}
+
+/**
+ * @brief Receive a byte of a write transfer: data tokens, block data and CRC.
+ */
+static void sd_write_byte(uint8_t in) {
+    const struct sim_model_t* m = &sim->model;
+
+    if (sd_write == SD_WRITE_DATA) {
+        sd_write_buf[sd_write_len++] = in;
+        if (sd_write_len < (int)sizeof(sd_write_buf)) return;
+
+        if (sd_write_block < sd_blocks) {
+            pwrite(sd_fd, sd_write_buf, SD_BLOCK_SIZE,
+                   (off_t)sd_write_block * SD_BLOCK_SIZE);
+        }
+        sd_write_block++;
+        sd_queue_byte(SD_DATA_ACCEPTED);
+        sd_busy_end_ns = sim->now_ns + (uint64_t)(m->sd_write_busy_us * 1000);
+        sd_write = sd_write_after;
+        return;
+    }
+
+    if (in == 0xFF) return;  // waiting for a token
+    if (sd_write == SD_WRITE_MULTI && in == SD_TOKEN_STOP) {
+        sd_write = SD_WRITE_NONE;
+        sd_busy_end_ns = sim->now_ns + (uint64_t)(m->sd_write_busy_us * 1000);
+        return;
+    }
+    if ((sd_write == SD_WRITE_SINGLE && in == SD_TOKEN_SINGLE) ||
+        (sd_write == SD_WRITE_MULTI && in == SD_TOKEN_MULTI)) {
+        sd_write_after =
+            sd_write == SD_WRITE_SINGLE ? SD_WRITE_NONE : SD_WRITE_MULTI;
+        sd_write = SD_WRITE_DATA;
+        sd_write_len = 0;
+    }
+}
+
+/**
+ * @brief Exchange a byte with the card. What the card sends depends only on
+ * the bytes received before, so the reply is chosen before handling the byte
+ * being received.
+ */
+uint8_t sim_sd_exchange(uint8_t in) {
+    if (!sd_powered || !sd_selected) return 0xFF;
+
+    uint8_t out = 0xFF;
+    if (sd_out_pos < sd_out_len) {
+        out = sd_out[sd_out_pos++];
+    } else if (sim->now_ns < sd_busy_end_ns) {
+        out = 0x00;  // busy programming
+    } else if (sd_read_count > 0 && sim->now_ns >= sd_read_ready_ns) {
+        sd_queue_block(sd_read_block++);
+        sd_read_count--;
+        sd_read_ready_ns =
+            sim->now_ns + (uint64_t)(sim->model.sd_read_gap_us * 1000);
+        out = sd_out[sd_out_pos++];
+    }
+
+    if (sd_write != SD_WRITE_NONE) {
+        sd_write_byte(in);
+    } else if (sd_cmd_len > 0 || (in & 0xC0) == 0x40) {
+        sd_cmd[sd_cmd_len++] = in;
+        if (sd_cmd_len == sizeof(sd_cmd)) {
+            sd_cmd_len = 0;
+            sd_command(sd_cmd[0] & 0x3F, (uint32_t)sd_cmd[1] << 24 |
+                                             (uint32_t)sd_cmd[2] << 16 |
+                                             (uint32_t)sd_cmd[3] << 8 |
+                                             sd_cmd[4]);
+        }
+    }
+    return out;
+}
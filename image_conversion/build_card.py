@@ -0,0 +1,456 @@
+"""
+Build a FAT32 SD card image holding the converted images, with every file
+stored contiguously and the images in index order, so the firmware always
+gets sequential multi-block reads. Unlike copying files by hand, the layout
+does not depend on the host OS.
+
+The image can be written to a card with e.g. `dd if=card.img of=/dev/sdX
+bs=4M`, or tested through a loop device. --verify checks an existing card
+image (or card) for the same layout.
+"""
+
+import os
+import re
+import struct
+import argparse
+import time
+
+SECTOR_SIZE = 512
+PARTITION_START = 2048  # first sector of the partition, 1MiB aligned
+RESERVED_SECTORS = 32
+NUM_FATS = 2
+ROOT_CLUSTER = 2
+MIN_CLUSTERS = 65525  # fewer clusters than this is FAT16, not FAT32
+FAT_EOC = 0x0FFFFFFF
+MIN_CARD_SIZE = 64 << 20
+
+ATTR_VOLUME_ID = 0x08
+ATTR_DIRECTORY = 0x10
+ATTR_ARCHIVE = 0x20
+ATTR_LFN = 0x0F
+NTRES_LOWER_BASE = 0x08
+NTRES_LOWER_EXT = 0x10
+
+DIR_ENTRY = struct.Struct("<11sBBBHHHHHHHI")
+
+# must match the catalog written by convert.py and read by the firmware
+CATALOG_FILENAME = "catalog.bin"
+CATALOG_MAGIC = 0x54414341  # "ACAT"
+CATALOG_HEADER = struct.Struct("<IHHII")  # magic, version, entry size, count, flags
+CATALOG_FLAG_SHARDED = 0x01
+IMAGES_PER_SHARD = 1000
+
+IMAGE_NAME = re.compile(r"^(\d+)\.slc$")
+
+
+class Node:
+    """
+    A file or directory to be placed on the card.
+    """
+    def __init__(self, name: str, host_path: str = None, is_dir: bool = False):
+        self.name = name
+        self.host_path = host_path
+        self.is_dir = is_dir
+        self.children = []
+        self.size = 0 if is_dir else os.path.getsize(host_path)
+        self.cluster = 0
+        self.clusters = 0
+        self.data = None  # contents to write instead of host_path
+
+
+def short_name(name: str) -> tuple:
+    """
+    Convert a file name to its 8.3 directory entry name and case flags.
+
+    Only names that fit in 8.3 (with an all lower or all upper case base and
+    extension) are supported, so no long file name entries are needed.
+    """
+    base, _, ext = name.partition('.')
+    if not (1 <= len(base) <= 8 and len(ext) <= 3 and '.' not in ext and
+            re.fullmatch(r"[A-Za-z0-9_\-~!#$%&'()@^`{}]*", base + ext)):
+        raise ValueError(f"'{name}' is not a valid 8.3 file name")
+
+    ntres = 0
+    for part, flag in ((base, NTRES_LOWER_BASE), (ext, NTRES_LOWER_EXT)):
+        if part != part.upper() and part != part.lower():
+            raise ValueError(f"'{name}' mixes upper and lower case")
+        if part != part.upper():
+            ntres |= flag
+
+    return (base.upper().ljust(8) + ext.upper().ljust(3)).encode('ascii'), ntres
+
+
+def fat_timestamp(t: float) -> tuple:
+    """
+    Convert a host timestamp to FAT date and time fields.
+    """
+    lt = time.localtime(t)
+    date = ((max(lt.tm_year, 1980) - 1980) << 9) | (lt.tm_mon << 5) | lt.tm_mday
+    tm = (lt.tm_hour << 11) | (lt.tm_min << 5) | (lt.tm_sec // 2)
+    return date, tm
+
+
+def image_sort_key(node: Node) -> tuple:
+    """
+    Order images by index, after any other files (catalog, album).
+    """
+    match = IMAGE_NAME.match(node.name.lower())
+    return (1, int(match.group(1))) if match else (0, node.name)
+
+
+def load_tree(path: str, name: str) -> Node:
+    """
+    Load the host directory at 'path' as a directory node named 'name'.
+    """
+    node = Node(name, path, is_dir=True)
+    for entry in sorted(os.listdir(path)):
+        host_path = os.path.join(path, entry)
+        short_name(entry)  # reject unsupported names early
+        if os.path.isdir(host_path):
+            node.children.append(load_tree(host_path, entry))
+        else:
+            node.children.append(Node(entry, host_path))
+    return node
+
+
+def walk(node: Node):
+    yield node
+    for child in node.children:
+        yield from walk(child)
+
+
+def cluster_size_for(total_sectors: int) -> int:
+    """
+    Pick the number of sectors per cluster: the largest up to 32KB (the usual
+    SD card cluster size) that still leaves enough clusters for FAT32.
+    """
+    spc = 64
+    while spc > 1 and fat_geometry(total_sectors, spc)[1] < MIN_CLUSTERS:
+        spc //= 2
+    return spc
+
+
+def fat_geometry(total_sectors: int, sectors_per_cluster: int) -> tuple:
+    """
+    Compute the FAT size and cluster count for a volume.
+    """
+    fat_sectors = 1
+    while True:
+        data_sectors = total_sectors - RESERVED_SECTORS - NUM_FATS * fat_sectors
+        clusters = data_sectors // sectors_per_cluster
+        needed = -(-(clusters + 2) * 4 // SECTOR_SIZE)
+        if needed <= fat_sectors:
+            return fat_sectors, clusters
+        fat_sectors = needed
+
+
+def allocate(root: Node, cluster_bytes: int) -> int:
+    """
+    Assign clusters to every file and directory, in order: directories first,
+    then other files, then the images in index order, each one contiguous.
+
+    @return the next free cluster
+    """
+    nodes = list(walk(root))
+    dirs = [n for n in nodes if n.is_dir]
+    files = [n for n in nodes if not n.is_dir]
+    files.sort(key=image_sort_key)
+
+    next_cluster = ROOT_CLUSTER
+    for node in dirs:
+        # entries for children, '.' and '..' (or the volume label in root),
+        # and the zero entry terminating the directory
+        node.size = (len(node.children) + 3) * DIR_ENTRY.size
+    for node in dirs + files:
+        node.clusters = -(-node.size // cluster_bytes)
+        if node.clusters:
+            node.cluster = next_cluster
+            next_cluster += node.clusters
+    return next_cluster
+
+
+def patch_catalog(images: Node) -> None:
+    """
+    Fill in the start cluster of every image in the catalog, now that the
+    layout on the card is known.
+    """
+    catalog = next((n for n in images.children if n.name == CATALOG_FILENAME), None)
+    if catalog is None:
+        return
+
+    with open(catalog.host_path, 'rb') as f:
+        data = bytearray(f.read())
+    magic, _, entry_size, count, flags = CATALOG_HEADER.unpack_from(data)
+    if magic != CATALOG_MAGIC:
+        raise ValueError(f"{catalog.host_path} is not an image catalog")
+
+    for index in range(count):
+        node = images
+        if flags & CATALOG_FLAG_SHARDED:
+            shard = f"{index // IMAGES_PER_SHARD:03d}"
+            node = next((n for n in node.children if n.name == shard), None)
+        node = node and next((n for n in node.children if n.name == f"{index}.slc"), None)
+        if node is None:
+            raise ValueError(f"image {index} listed in the catalog is missing")
+        struct.pack_into("<I", data, CATALOG_HEADER.size + index * entry_size + 8, node.cluster)
+
+    catalog.data = bytes(data)
+
+
+def dir_entry(name: bytes, attr: int, ntres: int, cluster: int, size: int, stamp: tuple) -> bytes:
+    date, tm = stamp
+    return DIR_ENTRY.pack(name, attr, ntres, 0, tm, date, date, cluster >> 16,
+                          tm, date, cluster & 0xFFFF, size)
+
+
+def dir_contents(node: Node, parent: Node, stamp: tuple, label: bytes) -> bytes:
+    """
+    Build the directory entries of a directory node.
+    """
+    entries = []
+    if parent is None:
+        entries.append(dir_entry(label, ATTR_VOLUME_ID, 0, 0, 0, stamp))
+    else:
+        parent_cluster = 0 if parent.cluster == ROOT_CLUSTER else parent.cluster
+        entries.append(dir_entry(b".          ", ATTR_DIRECTORY, 0, node.cluster, 0, stamp))
+        entries.append(dir_entry(b"..         ", ATTR_DIRECTORY, 0, parent_cluster, 0, stamp))
+    for child in node.children:
+        name, ntres = short_name(child.name)
+        attr = ATTR_DIRECTORY if child.is_dir else ATTR_ARCHIVE
+        size = 0 if child.is_dir else child.size
+        entries.append(dir_entry(name, attr, ntres, child.cluster, size, stamp))
+    return b"".join(entries)
+
+
+def build(source_dir: str, output: str, total_bytes: int, sectors_per_cluster: int, label: str) -> None:
+    """
+    Build a card image at 'output' with the contents of 'source_dir' placed
+    in /images.
+    """
+    root = Node("", is_dir=True)
+    images = load_tree(source_dir, "images")
+    root.children.append(images)
+
+    stamp = fat_timestamp(time.time())
+    label_bytes = label.upper().ljust(11)[:11].encode('ascii')
+
+    data_size = sum(n.size for n in walk(root))
+    if total_bytes is None:
+        # fit the contents with some room for log files
+        total_bytes = max(data_size * 2, MIN_CARD_SIZE) + PARTITION_START * SECTOR_SIZE
+    total_sectors = total_bytes // SECTOR_SIZE
+    part_sectors = total_sectors - PARTITION_START
+
+    spc = sectors_per_cluster or cluster_size_for(part_sectors)
+    fat_sectors, clusters = fat_geometry(part_sectors, spc)
+    if clusters < MIN_CLUSTERS:
+        raise ValueError("card image too small for FAT32 with this cluster size")
+
+    cluster_bytes = spc * SECTOR_SIZE
+    next_cluster = allocate(root, cluster_bytes)
+    if next_cluster > clusters + 2:
+        raise ValueError("card image too small for the images")
+    patch_catalog(images)
+
+    data_start = PARTITION_START + RESERVED_SECTORS + NUM_FATS * fat_sectors
+
+    def cluster_offset(cluster: int) -> int:
+        return (data_start + (cluster - 2) * spc) * SECTOR_SIZE
+
+    is_device = output.startswith('/dev/')
+    with open(output, 'r+b' if is_device else 'wb') as card:
+        if not is_device:
+            card.truncate(total_sectors * SECTOR_SIZE)
+
+        # MBR with a single FAT32 (LBA) partition
+        mbr = bytearray(SECTOR_SIZE)
+        mbr[446:462] = struct.pack("<B3sB3sII", 0, b"\xfe\xff\xff", 0x0C, b"\xfe\xff\xff",
+                                   PARTITION_START, part_sectors)
+        mbr[510:512] = b"\x55\xaa"
+        card.seek(0)
+        card.write(mbr)
+
+        # boot sector, FSInfo and their backups
+        boot = bytearray(SECTOR_SIZE)
+        boot[0:3] = b"\xeb\x58\x90"
+        boot[3:11] = b"MSWIN4.1"
+        struct.pack_into("<HBHBHHBHHHIIIHHIHH", boot, 11, SECTOR_SIZE, spc, RESERVED_SECTORS,
+                         NUM_FATS, 0, 0, 0xF8, 0, 63, 255, PARTITION_START, part_sectors,
+                         fat_sectors, 0, 0, ROOT_CLUSTER, 1, 6)
+        struct.pack_into("<BBBI11s8s", boot, 64, 0x80, 0, 0x29, int(time.time()) & 0xFFFFFFFF,
+                         label_bytes, b"FAT32   ")
+        boot[510:512] = b"\x55\xaa"
+
+        fsinfo = bytearray(SECTOR_SIZE)
+        struct.pack_into("<I", fsinfo, 0, 0x41615252)
+        struct.pack_into("<III", fsinfo, 484, 0x61417272, clusters + 2 - next_cluster, next_cluster)
+        struct.pack_into("<I", fsinfo, 508, 0xAA550000)
+
+        for base in (0, 6):
+            card.seek((PARTITION_START + base) * SECTOR_SIZE)
+            card.write(boot)
+            card.write(fsinfo)
+
+        # FATs, with each chain running through consecutive clusters
+        fat = bytearray(fat_sectors * SECTOR_SIZE)
+        struct.pack_into("<II", fat, 0, 0x0FFFFFF8, FAT_EOC)
+        for node in walk(root):
+            for i in range(node.clusters):
+                cluster = node.cluster + i
+                value = FAT_EOC if i == node.clusters - 1 else cluster + 1
+                struct.pack_into("<I", fat, cluster * 4, value)
+        for i in range(NUM_FATS):
+            card.seek((PARTITION_START + RESERVED_SECTORS + i * fat_sectors) * SECTOR_SIZE)
+            card.write(fat)
+
+        # directories and files
+        parents = {id(child): node for node in walk(root) for child in node.children}
+        for node in walk(root):
+            if node.clusters == 0:
+                continue
+            if node.is_dir:
+                data = dir_contents(node, parents.get(id(node)), stamp, label_bytes)
+            elif node.data is not None:
+                data = node.data
+            else:
+                with open(node.host_path, 'rb') as f:
+                    data = f.read()
+            data += bytes(node.clusters * cluster_bytes - len(data))
+            card.seek(cluster_offset(node.cluster))
+            card.write(data)
+
+    print(f"Wrote {output}: {total_sectors * SECTOR_SIZE} bytes, {clusters} clusters of "
+          f"{cluster_bytes} bytes, {next_cluster - ROOT_CLUSTER} used")
+
+
+def verify(card_path: str) -> bool:
+    """
+    Check that every file in /images of a card image is contiguous, that the
+    images are stored in index order, and that the catalog start clusters
+    match the files.
+    """
+    with open(card_path, 'rb') as card:
+        def read(sector: int, count: int = 1) -> bytes:
+            card.seek(sector * SECTOR_SIZE)
+            return card.read(count * SECTOR_SIZE)
+
+        part_start = 0
+        mbr = read(0)
+        if mbr[0] not in (0xEB, 0xE9) and mbr[450] in (0x0B, 0x0C):
+            part_start = struct.unpack_from("<I", mbr, 454)[0]
+
+        boot = read(part_start)
+        spc = boot[13]
+        reserved, num_fats = struct.unpack_from("<HB", boot, 14)
+        fat_sectors, _, _, root_cluster = struct.unpack_from("<IHHI", boot, 36)
+        fat = read(part_start + reserved, fat_sectors)
+        data_start = part_start + reserved + num_fats * fat_sectors
+
+        def chain(cluster: int) -> list:
+            clusters = []
+            while 2 <= cluster < 0x0FFFFFF8:
+                clusters.append(cluster)
+                cluster = struct.unpack_from("<I", fat, cluster * 4)[0] & 0x0FFFFFFF
+            return clusters
+
+        def read_chain(cluster: int, size: int = None) -> bytes:
+            data = b"".join(read(data_start + (c - 2) * spc, spc) for c in chain(cluster))
+            return data if size is None else data[:size]
+
+        def list_dir(cluster: int) -> dict:
+            entries = {}
+            data = read_chain(cluster)
+            for offset in range(0, len(data), DIR_ENTRY.size):
+                fields = DIR_ENTRY.unpack_from(data, offset)
+                name, attr, ntres = fields[0], fields[1], fields[2]
+                if name[0] == 0:
+                    break
+                if name[0] == 0xE5 or attr == ATTR_LFN or attr & ATTR_VOLUME_ID or name[0] == 0x2E:
+                    continue
+                base = name[:8].decode('ascii').rstrip()
+                ext = name[8:].decode('ascii').rstrip()
+                base = base.lower() if ntres & NTRES_LOWER_BASE else base
+                ext = ext.lower() if ntres & NTRES_LOWER_EXT else ext
+                entries[base + ('.' + ext if ext else '')] = (
+                    attr, (fields[7] << 16) | fields[10], fields[11])
+            return entries
+
+        ok = True
+        root = {k.lower(): v for k, v in list_dir(root_cluster).items()}
+        if "images" not in root:
+            print("no /images directory")
+            return False
+
+        files = {}
+        def collect(cluster: int, path: str) -> None:
+            for name, (attr, first, size) in list_dir(cluster).items():
+                if attr & ATTR_DIRECTORY:
+                    collect(first, f"{path}/{name}")
+                else:
+                    files[f"{path}/{name}"] = (first, size)
+        collect(root["images"][1], "/images")
+
+        cluster_bytes = spc * SECTOR_SIZE
+        for path, (first, size) in files.items():
+            clusters = chain(first)
+            if len(clusters) != -(-size // cluster_bytes):
+                print(f"{path}: chain length does not match file size")
+                ok = False
+            if clusters != list(range(first, first + len(clusters))):
+                print(f"{path}: fragmented")
+                ok = False
+
+        images = sorted((int(IMAGE_NAME.match(p.rsplit('/', 1)[1]).group(1)), c)
+                        for p, (c, _) in files.items() if IMAGE_NAME.match(p.rsplit('/', 1)[1]))
+        if [c for _, c in images] != sorted(c for _, c in images):
+            print("images are not stored in index order")
+            ok = False
+
+        catalog = files.get(f"/images/{CATALOG_FILENAME}")
+        if catalog is not None:
+            data = read_chain(*catalog)
+            magic, _, entry_size, count, flags = CATALOG_HEADER.unpack_from(data)
+            for index, cluster in images:
+                if index >= count:
+                    continue
+                entry_cluster = struct.unpack_from("<I", data, CATALOG_HEADER.size + index * entry_size + 8)[0]
+                if entry_cluster not in (0, cluster):
+                    print(f"catalog start cluster of image {index} is wrong")
+                    ok = False
+
+        print(f"{card_path}: {len(files)} files, {len(images)} images, "
+              f"{'contiguous and in order' if ok else 'layout problems found'}")
+        return ok
+
+
+def parse_size(size: str) -> int:
+    units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+    if size[-1].upper() in units:
+        return int(float(size[:-1]) * units[size[-1].upper()])
+    return int(size)
+
+
+def main():
+    """
+    Build or verify a FAT32 card image with contiguous image files.
+    """
+    parser = argparse.ArgumentParser(description="Build a FAT32 SD card image with contiguous image files")
+    parser.add_argument("output", help="Card image file (or card device) to write, or to check with --verify")
+    parser.add_argument("--input", default="./img_out", help="Converted images to place in /images")
+    parser.add_argument("--size", type=parse_size,
+                        help="Card image size, e.g. 4G. Defaults to just fitting the images")
+    parser.add_argument("--cluster-sectors", type=int, choices=[1, 2, 4, 8, 16, 32, 64, 128],
+                        help="Sectors per cluster. Defaults to the usual SD card cluster size")
+    parser.add_argument("--label", default="AEON", help="Volume label")
+    parser.add_argument("--verify", action="store_true", help="Check the layout of an existing card image")
+    args = parser.parse_args()
+
+    if args.verify:
+        raise SystemExit(0 if verify(args.output) else 1)
+
+    build(args.input, args.output, args.size, args.cluster_sectors, args.label)
+    verify(args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,7 +1,9 @@
 import os
+import struct
 import subprocess
 import argparse
 import random
+import zlib
 
 from PIL import Image, ImageEnhance, ImageOps
 
@@ -166,14 +168,77 @@ def process_images(input_dir: str, intermediary_dir: str, packed_dir: str, rando
         pack_image(output_path, packed_output_path)
 
 
-def run_slic_conv(input_dir: str, output_dir: str) -> None:
+IMAGES_PER_SHARD = 1000
+
+
+def image_relpath(index: int, sharded: bool) -> str:
+    """
+    Path of an image relative to the images directory. In the sharded layout
+    images are split into subdirectories of IMAGES_PER_SHARD, named by the
+    zero padded shard number (e.g. 12345 -> 012/12345.slc), so no directory
+    gets large enough to make FatFs lookups slow or hit the FAT entry limit.
+    """
+    if sharded:
+        return os.path.join(f"{index // IMAGES_PER_SHARD:03d}", f"{index}.slc")
+    return f"{index}.slc"
+
+
+IMAGE_MAGIC = 0x474D4941  # "AIMG"
+IMAGE_VERSION = 1
+IMAGE_HEADER = struct.Struct("<IHHBBHHHII")  # magic, version, header size, codec, bpp,
+                                              # width, height, flags, payload size, CRC32
+IMAGE_CODEC_SLIC = 1
+IMAGE_CODEC_RAW = 2
+SECTOR_SIZE = 512
+
+# Estimated charge per byte on the device, in nC, at 80 MHz with the SD card
+# on a 10 MHz SPI clock: reading a byte from the card keeps both the card and
+# the MCU busy, decoding a SLIC output byte only the MCU
+SD_READ_NC_PER_BYTE = 26.6
+SLIC_DECODE_NC_PER_BYTE = 2.1
+
+
+def wrap_image(path: str, codec: int, payload: bytes) -> None:
+    """
+    Write an image in the container read by the firmware: a header naming the
+    codec and geometry of the payload, so the firmware can reject an image it
+    can't show before touching the panel, and holding the CRC32 of the payload,
+    which the firmware checks as it decodes.
+
+    Raw payloads are padded to start on a sector boundary, so the firmware can
+    read them from the card straight into the panel's transfer buffer.
+    """
+    header_size = SECTOR_SIZE if codec == IMAGE_CODEC_RAW else IMAGE_HEADER.size
+    header = IMAGE_HEADER.pack(IMAGE_MAGIC, IMAGE_VERSION, header_size, codec,
+                               4, 800, 480, 0, len(payload), zlib.crc32(payload))
+    with open(path, 'wb') as f:
+        f.write(header.ljust(header_size, b'\0') + payload)
+
+
+def choose_codec(slic: bytes, raw: bytes) -> tuple:
+    """
+    Pick the payload that costs the device less charge to show. A raw frame
+    needs no decoding, but is read from the card in full, so it only pays off
+    for images SLIC barely compresses, such as noisy dithered photos.
+    """
+    slic_cost = len(slic) * SD_READ_NC_PER_BYTE + len(raw) * SLIC_DECODE_NC_PER_BYTE
+    raw_cost = len(raw) * SD_READ_NC_PER_BYTE
+    if raw_cost < slic_cost:
+        return IMAGE_CODEC_RAW, raw
+    return IMAGE_CODEC_SLIC, slic
+
+
+def run_slic_conv(input_dir: str, output_dir: str, sharded: bool) -> None:
     """
     Convert intermediary images to slic format:
 
     1. Ensure the output directory exists.
     2. For each image file in the input directory, call the external command 'slic_conv'
        to perform the conversion.
-    3. Name the output files with sequential numbering.
+    3. Name the output files with sequential numbering, in shard subdirectories
+       if the sharded layout is used.
+    4. Keep either the SLIC data or the packed pixels themselves, whichever
+       the device shows for less charge, and wrap it in the image container.
     """
     ensure_directory(output_dir)
 
@@ -184,12 +249,100 @@ def run_slic_conv(input_dir: str, output_dir: str) -> None:
 
     for file in files:
         infile = os.path.join(input_dir, file)
-        basename = os.path.splitext(file)[0].split('_')[0]
-        outfile = os.path.join(output_dir, f"{basename}.slc")
+        index = int(os.path.splitext(file)[0].split('_')[0])
+        outfile = os.path.join(output_dir, image_relpath(index, sharded))
+        ensure_directory(os.path.dirname(outfile))
         
         print(f"Running slic_conv: {infile} -> {outfile}")
         subprocess.run(['slic_conv', infile, outfile], check=True)
 
+        with open(outfile, 'rb') as f:
+            slic = f.read()
+        raw = Image.open(infile).tobytes()  # the panel's frame data, row by row
+        codec, payload = choose_codec(slic, raw)
+        print(f"{'Raw' if codec == IMAGE_CODEC_RAW else 'SLIC'} payload: "
+              f"{len(payload)} bytes (SLIC {len(slic)} bytes)")
+        wrap_image(outfile, codec, payload)
+
+
+CATALOG_FILENAME = "catalog.bin"
+CATALOG_MAGIC = 0x54414341  # "ACAT"
+CATALOG_VERSION = 1
+CATALOG_HEADER = struct.Struct("<IHHII")  # magic, version, entry size, count, flags
+CATALOG_ENTRY = struct.Struct("<III")  # file size, CRC32, start cluster
+CATALOG_FLAG_SHARDED = 0x01
+
+
+def write_catalog(output_dir: str, count: int, sharded: bool) -> None:
+    """
+    Write the image catalog read by the firmware:
+
+    1. Write a fixed size header holding the image count and layout.
+    2. Write one fixed size entry per image, in index order, holding the file
+       size and CRC32. The start cluster is left as 0 (unknown) since it is
+       only known once the files are placed on the card. build_card.py fills
+       it in, and the firmware then opens images from it without searching
+       the images directory.
+
+    The firmware uses this to get the image count and look up an image with
+    one or two sector reads, instead of enumerating the images directory.
+    """
+    flags = CATALOG_FLAG_SHARDED if sharded else 0
+    with open(os.path.join(output_dir, CATALOG_FILENAME), 'wb') as catalog:
+        catalog.write(CATALOG_HEADER.pack(CATALOG_MAGIC, CATALOG_VERSION,
+                                          CATALOG_ENTRY.size, count, flags))
+        for index in range(count):
+            path = os.path.join(output_dir, image_relpath(index, sharded))
+            with open(path, 'rb') as f:
+                data = f.read()
+            catalog.write(CATALOG_ENTRY.pack(len(data), zlib.crc32(data), 0))
+
+    print(f"Wrote catalog of {count} images")
+
+
+ALBUM_FILENAME = "album.bin"
+ALBUM_MAGIC = 0x424C4141  # "AALB"
+ALBUM_VERSION = 1
+ALBUM_HEADER = struct.Struct("<IHHII")  # magic, version, entry size, count, flags
+ALBUM_ENTRY = struct.Struct("<II")  # image offset, image length
+ALBUM_ALIGN = 512  # SD sector size
+
+
+def write_album(slc_dir: str, output_dir: str, count: int) -> None:
+    """
+    Pack the converted images into a single album file read by the firmware:
+
+    1. Write a fixed size header holding the image count.
+    2. Write one fixed size entry per image, in index order, holding the
+       offset and length of the image within the album.
+    3. Write the images back to back, each padded to start on a sector
+       boundary so reads of an image stay aligned to whole sectors.
+
+    The firmware opens the album once and seeks straight to the selected
+    image, without any directory lookups.
+    """
+    ensure_directory(output_dir)
+
+    offset = ALBUM_HEADER.size + ALBUM_ENTRY.size * count
+    images = []
+    for index in range(count):
+        with open(os.path.join(slc_dir, image_relpath(index, False)), 'rb') as f:
+            data = f.read()
+        offset += -offset % ALBUM_ALIGN
+        images.append((offset, data))
+        offset += len(data)
+
+    with open(os.path.join(output_dir, ALBUM_FILENAME), 'wb') as album:
+        album.write(ALBUM_HEADER.pack(ALBUM_MAGIC, ALBUM_VERSION,
+                                      ALBUM_ENTRY.size, count, 0))
+        for image_offset, data in images:
+            album.write(ALBUM_ENTRY.pack(image_offset, len(data)))
+        for image_offset, data in images:
+            album.write(b'\0' * (image_offset - album.tell()))
+            album.write(data)
+
+    print(f"Wrote album of {count} images ({offset} bytes)")
+
 
 def main():
     """
@@ -198,11 +351,17 @@ def main():
     parser = argparse.ArgumentParser(description="Convert images for the e-ink display")
     parser.add_argument("input_dir", help="Input images directory")
     parser.add_argument("--random", action="store_true", help="Randomise order of images when converting")
+    parser.add_argument("--layout", choices=["auto", "flat", "sharded"], default="auto",
+                        help="Store images directly in /images (flat) or in subdirectories of "
+                             f"{IMAGES_PER_SHARD} (sharded). auto shards only large libraries")
+    parser.add_argument("--album", action="store_true",
+                        help=f"Pack all images into a single {ALBUM_FILENAME} instead of one file per image")
     args = parser.parse_args()
 
     input_img_dir = args.input_dir
     intermediary_dir = './img_intermediary'
     packed_dir = './img_packed'
+    slc_dir = './img_slc'
     output_dir = './img_out'
 
     # clear intermediary and output directories
@@ -211,11 +370,25 @@ def main():
     if os.path.exists(packed_dir):
         os.system(f'rm -r {packed_dir}')
 
+    if os.path.exists(slc_dir):
+        os.system(f'rm -r {slc_dir}')
+
     if os.path.exists(output_dir):
         os.system(f'rm -r {output_dir}')
 
     process_images(input_img_dir, intermediary_dir, packed_dir, args.random)
-    run_slic_conv(packed_dir, output_dir)
+
+    count = len(os.listdir(packed_dir))
+
+    if args.album:
+        run_slic_conv(packed_dir, slc_dir, False)
+        write_album(slc_dir, output_dir, count)
+        return
+
+    sharded = args.layout == "sharded" or (args.layout == "auto" and count > IMAGES_PER_SHARD)
+
+    run_slic_conv(packed_dir, output_dir, sharded)
+    write_catalog(output_dir, count, sharded)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,107 @@
+"""
+Decode the binary trace log written by the firmware in debug mode
+(/logfiles/trace.log on the SD card) into text, using the event table in
+firmware/Core/Inc/trace.h.
+"""
+
+import argparse
+import os
+import re
+import struct
+
+from read_sdlog import LOG_FLAG_FIRST, read_sectors
+
+TRACE_HEADER = os.path.join(os.path.dirname(__file__), "..", "firmware", "Core", "Inc", "trace.h")
+TRACE_RECORD = struct.Struct("<BBI")  # event, number of arguments, tick
+TRACE_FLUSH = 0
+
+
+def load_events(path: str) -> list:
+    """
+    Parse the X(id, format) entries of the TRACE_EVENTS table, in order.
+    """
+    with open(path) as f:
+        source = f.read()
+
+    table = source[source.index("#define TRACE_EVENTS(X)"):]
+    table = table[:table.index("enum trace_event_t")]
+    table = table.replace("\\\n", "\n")
+
+    events = []
+    for match in re.finditer(r'X\(\s*(\w+)\s*,((?:\s*"(?:[^"\\]|\\.)*")+)\s*\)', table):
+        fmt = "".join(re.findall(r'"((?:[^"\\]|\\.)*)"', match.group(2)))
+        events.append((match.group(1), fmt))
+    return events
+
+
+def format_event(fmt: str, args: list) -> str:
+    """
+    Apply a C printf format with integer conversions to the raw arguments.
+    """
+    args = iter(args)
+
+    def convert(match: re.Match) -> str:
+        spec = match.group(0)
+        if spec == "%%":
+            return "%"
+        value = next(args, 0)
+        conversion = spec[-1]
+        if conversion in "di":
+            value = value - (1 << 32) if value & 0x80000000 else value
+        return ("%" + match.group(1) + conversion) % value
+
+    return re.sub(r"%([-+ #0-9.]*)(?:hh|h|ll|l|z)?[diuxXc%]", convert, fmt)
+
+
+def decode(data: bytes, events: list) -> list:
+    """
+    Decode the records of one flushed trace into (tick, text) lines.
+    """
+    lines = []
+    offset = 0
+    while offset + TRACE_RECORD.size <= len(data):
+        event, nargs, tick = TRACE_RECORD.unpack_from(data, offset)
+        offset += TRACE_RECORD.size
+        args = list(struct.unpack_from(f"<{nargs}I", data, offset))
+        offset += nargs * 4
+
+        if event < len(events):
+            text = format_event(events[event][1], args)
+        else:
+            text = f"unknown event {event} {args}"
+        if event == TRACE_FLUSH and args and args[0] != len(events):
+            text += f" (trace.h has {len(events)} event types, decoding may be wrong)"
+        lines.append((tick, text))
+    return lines
+
+
+def main():
+    """
+    Print a decoded trace log, one block per wake cycle.
+    """
+    parser = argparse.ArgumentParser(description="Decode an Aeon binary trace log")
+    parser.add_argument("log_file", help="trace.log copied from /logfiles on the SD card")
+    parser.add_argument("--wake", type=int, help="Only print the trace of this wake cycle")
+    parser.add_argument("--events", default=TRACE_HEADER, help="trace.h holding the event table")
+    args = parser.parse_args()
+
+    events = load_events(args.events)
+    _, sectors = read_sectors(args.log_file)
+
+    # join the sectors of each flush, which start with a FIRST flagged sector
+    traces = []
+    for seq, wake, flags, data in sectors:
+        if flags & LOG_FLAG_FIRST or not traces:
+            traces.append((wake, bytearray()))
+        traces[-1][1].extend(data)
+
+    for wake, data in traces:
+        if args.wake is not None and wake != args.wake:
+            continue
+        print(f"===== wake {wake} =====")
+        for tick, text in decode(bytes(data), events):
+            print(f"[{tick / 1000:9.3f}] {text}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,148 @@
+"""
+Aggregate the per-wake phase timings written by the firmware
+(/logfiles/profile.log on the SD card), using the phase table in
+firmware/Core/Inc/profile.h.
+"""
+
+import argparse
+import csv
+import os
+import re
+import struct
+import sys
+
+from read_sdlog import read_sectors
+
+PROFILE_HEADER = os.path.join(os.path.dirname(__file__), "..", "firmware", "Core", "Inc", "profile.h")
+PROFILE_RECORD_HEADER = struct.Struct("<BBBBI")  # version, phases, wake reason, sleep reason, total us
+
+# SD card I/O counters following the phases since version 2, in the order of
+# USER_SPI_StatsTypeDef in firmware/FATFS/Target/user_diskio_spi.h
+DISK_COUNTERS = ["cmds", "rd_sectors", "wr_sectors", "rd_single", "rd_multi", "wr_single",
+                 "wr_multi", "ready_polls", "ready_ms", "token_polls", "errors"]
+
+
+def load_phases(path: str) -> list:
+    """
+    Parse the X(id, name) entries of the PROFILE_PHASES table, in order.
+    """
+    with open(path) as f:
+        source = f.read()
+    table = source[source.index("#define PROFILE_PHASES(X)"):source.index("enum profile_phase_t")]
+    return re.findall(r'X\(\s*\w+\s*,\s*"([^"]*)"\s*\)', table)
+
+
+def parse_records(sectors: list, phases: list) -> list:
+    """
+    Decode the timing record held in each log sector.
+    """
+    records = []
+    for seq, wake, flags, data in sectors:
+        version, count, wake_reason, sleep_reason, total_us = PROFILE_RECORD_HEADER.unpack_from(data)
+        offset = PROFILE_RECORD_HEADER.size
+        phase_us = struct.unpack_from(f"<{count}I", data, offset)
+        phase_calls = struct.unpack_from(f"<{count}H", data, offset + count * 4)
+
+        disk = {}
+        if version >= 2:
+            values = struct.unpack_from(f"<{len(DISK_COUNTERS)}I", data, offset + count * 6)
+            disk = dict(zip(DISK_COUNTERS, values))
+
+        names = phases + [f"phase_{i}" for i in range(len(phases), count)]
+        records.append({
+            "wake": wake,
+            "wake_reason": wake_reason,
+            "sleep_reason": sleep_reason,
+            "total_us": total_us,
+            "phases": {names[i]: (phase_us[i], phase_calls[i]) for i in range(count)},
+            "disk": disk,
+        })
+    return records
+
+
+def percentile(values: list, fraction: float) -> float:
+    values = sorted(values)
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def histogram(values: list) -> str:
+    """
+    Render a histogram of durations in power of two millisecond buckets.
+    """
+    buckets = {}
+    for us in values:
+        bucket = 0
+        while (1 << bucket) * 1000 <= us:
+            bucket += 1
+        buckets[bucket] = buckets.get(bucket, 0) + 1
+
+    lines = []
+    for bucket in range(min(buckets), max(buckets) + 1):
+        label = f"< {1 << bucket} ms"
+        lines.append(f"    {label:>12} {'#' * buckets.get(bucket, 0)} {buckets.get(bucket, 0)}")
+    return "\n".join(lines)
+
+
+def main():
+    """
+    Print per-phase timing statistics across wakes.
+    """
+    parser = argparse.ArgumentParser(description="Summarise Aeon wake phase timings")
+    parser.add_argument("log_file", help="profile.log copied from /logfiles on the SD card")
+    parser.add_argument("--last", type=int, help="Only use the last N wakes")
+    parser.add_argument("--refresh-only", action="store_true",
+                        help="Only use wakes that refreshed the display")
+    parser.add_argument("--histogram", action="store_true", help="Print a histogram of each phase")
+    parser.add_argument("--csv", action="store_true", help="Print one CSV row per wake instead")
+    parser.add_argument("--phases", default=PROFILE_HEADER, help="profile.h holding the phase table")
+    args = parser.parse_args()
+
+    phases = load_phases(args.phases)
+    _, sectors = read_sectors(args.log_file)
+    records = parse_records(sectors, phases)
+
+    if args.refresh_only:
+        records = [r for r in records if r["phases"].get("disp_transfer", (0, 0))[1]]
+    if args.last:
+        records = records[-args.last:]
+    if not records:
+        print("no records")
+        return
+
+    if args.csv:
+        writer = csv.writer(sys.stdout)
+        writer.writerow(["wake", "wake_reason", "sleep_reason", "total_us"] + phases + DISK_COUNTERS)
+        for r in records:
+            writer.writerow([r["wake"], r["wake_reason"], r["sleep_reason"], r["total_us"]] +
+                            [r["phases"].get(p, (0, 0))[0] for p in phases] +
+                            [r["disk"].get(c, "") for c in DISK_COUNTERS])
+        return
+
+    print(f"{len(records)} wakes, {records[0]['wake']} to {records[-1]['wake']}")
+    print(f"{'phase':<16}{'wakes':>7}{'calls':>7}{'mean ms':>10}{'p50 ms':>10}{'p95 ms':>10}{'max ms':>10}")
+    for phase in phases + ["total"]:
+        if phase == "total":
+            samples = [(r["total_us"], 1) for r in records]
+        else:
+            samples = [r["phases"][phase] for r in records if r["phases"].get(phase, (0, 0))[1]]
+        if not samples:
+            continue
+        values = [us for us, _ in samples]
+        calls = sum(c for _, c in samples) / len(samples)
+        print(f"{phase:<16}{len(values):>7}{calls:>7.1f}{sum(values) / len(values) / 1000:>10.1f}"
+              f"{percentile(values, 0.5) / 1000:>10.1f}{percentile(values, 0.95) / 1000:>10.1f}"
+              f"{max(values) / 1000:>10.1f}")
+        if args.histogram:
+            print(histogram(values))
+
+    disk_records = [r["disk"] for r in records if r["disk"]]
+    if disk_records:
+        print(f"\nSD card I/O per wake ({len(disk_records)} wakes)")
+        print(f"{'counter':<16}{'mean':>10}{'max':>10}")
+        for counter in DISK_COUNTERS:
+            values = [d[counter] for d in disk_records]
+            print(f"{counter:<16}{sum(values) / len(values):>10.1f}{max(values):>10}")
+
+
+if __name__ == "__main__":
+    main()
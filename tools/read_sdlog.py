@@ -0,0 +1,70 @@
+"""
+Read a ring log file written by the firmware (e.g. /logfiles/batt.log on the
+SD card) and print its records, oldest first. The binary trace log is decoded
+with decode_trace.py, which uses this to read the log.
+"""
+
+import argparse
+import struct
+import sys
+
+SECTOR_SIZE = 512
+LOG_MAGIC = 0x474F4C41  # "ALOG"
+LOG_PREFIX = struct.Struct("<IHH")  # magic, version, sector size
+# id, sectors, columns of each header version, after the prefix
+LOG_HEADERS = {1: struct.Struct("<II112s"), 2: struct.Struct("<II240s")}
+LOG_SECTOR = struct.Struct("<IIIHH")  # id, seq, wake, used, flags
+LOG_FLAG_FIRST = 0x01
+
+
+def read_sectors(path: str) -> tuple:
+    """
+    Read the header and the valid data sectors of a log file, ordered from
+    oldest to newest.
+    """
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    magic, version, sector_size = LOG_PREFIX.unpack_from(data)
+    if magic != LOG_MAGIC or version not in LOG_HEADERS or sector_size != SECTOR_SIZE:
+        raise ValueError(f"{path} is not a log file")
+    log_id, sectors, columns = LOG_HEADERS[version].unpack_from(data, LOG_PREFIX.size)
+
+    records = []
+    for i in range(sectors):
+        offset = (i + 1) * SECTOR_SIZE
+        if offset + SECTOR_SIZE > len(data):
+            break
+        sector_id, seq, wake, used, flags = LOG_SECTOR.unpack_from(data, offset)
+        # sectors not written since the file was created hold stale data
+        if sector_id != log_id or used > SECTOR_SIZE - LOG_SECTOR.size:
+            continue
+        start = offset + LOG_SECTOR.size
+        records.append((seq, wake, flags, data[start:start + used]))
+
+    # order by sequence number, allowing for it wrapping around
+    if records:
+        newest = max(records, key=lambda r: r[0])[0]
+        records.sort(key=lambda r: (r[0] - newest - 1) & 0xFFFFFFFF)
+
+    return columns.rstrip(b'\0').decode('ascii'), records
+
+
+def main():
+    """
+    Print the contents of an SD card ring log.
+    """
+    parser = argparse.ArgumentParser(description="Print an Aeon ring log file, oldest records first")
+    parser.add_argument("log_file", help="Log file copied from /logfiles on the SD card")
+    args = parser.parse_args()
+
+    columns, records = read_sectors(args.log_file)
+
+    if columns:
+        print(columns)
+    for seq, wake, flags, data in records:
+        sys.stdout.write(data.decode('ascii', errors='replace'))
+
+
+if __name__ == "__main__":
+    main()